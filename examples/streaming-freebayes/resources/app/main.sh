@@ -8,17 +8,23 @@ set -e -o pipefail
 # process command line #
 ########################
 USAGE="Usage:
-  docker run --rm dnamlin/ga4gh-streaming-freebayes [-c CHR] SERVER_URL NAMESPACE ID [ID2 ID3 ...] > variants.vcf
+  docker run --rm dnamlin/ga4gh-streaming-freebayes [-c CHR] [-R FILE] SERVER_URL NAMESPACE ID [ID2 ID3 ...] > variants.vcf
 Options:
   -c CHR    analyze one chromosome only (e.g. 22)
+  -R FILE   use these regions (seq:lo-hi, one per line) instead of the built-in
+            4Mbp intervals, e.g. from htsnexus_shard
 "
 
 CHR=""
-while getopts "c:" opt; do
+REGIONS="hs37d5_interLCR_intervals.4Mbp.regions"
+while getopts "c:R:" opt; do
   case $opt in
     c)
       CHR="$OPTARG"
       ;;
+    R)
+      REGIONS="$OPTARG"
+      ;;
     *)
       >&2 echo "$USAGE"
       exit 1
@@ -37,12 +43,12 @@ NAMESPACE="$2"
 shift 2 # now $@ holds the IDs
 
 if [ -n "$CHR" ]; then
-  if ! grep "^${CHR}:" hs37d5_interLCR_intervals.4Mbp.regions > regions; then
-    >&2 echo "Unknown chromosome ${CHR}; try one of: $(cut -d ':' -f1 hs37d5_interLCR_intervals.4Mbp.regions | sort -V | uniq | tr '\n' ' ')"
+  if ! grep "^${CHR}:" "$REGIONS" > regions; then
+    >&2 echo "Unknown chromosome ${CHR}; try one of: $(cut -d ':' -f1 "$REGIONS" | sort -V | uniq | tr '\n' ' ')"
     exit 1
   fi
 else
-  mv hs37d5_interLCR_intervals.4Mbp.regions regions
+  cp "$REGIONS" regions
 fi
 
 # log system utilization statistics to stderr
@@ -11,6 +11,12 @@ rewrite_url() {
     echo "$1" | sed "s#https://dl.dnanex.us/#http://10.0.3.1:8090/#"
 }
 
+download() {
+    # Download sequentially (in one stream, front to back), so that the
+    # indexer can follow the file as it grows
+    curl -sSfL --retry 10 --retry-delay 30 -o "$2" "$(rewrite_url "$1")"
+}
+
 main() {
     set -ex -o pipefail
 
@@ -25,19 +31,15 @@ main() {
     dlfn=""
     for i in $(seq 0 $(expr $N - 1)); do
         if [ "$i" -eq 0 ]; then
-            nexturl=$(rewrite_url "${urls[0]}")
             dlfn=$(mktempdl "${urls[0]}")
-            rm "$dlfn"
-            aria2c -x 10 -j 10 -s 10 -m 10 --retry-wait 30 -o "$dlfn" "$nexturl" & dlpid=$!
+            download "${urls[0]}" "$dlfn" & dlpid=$!
         fi
-        wait $dlpid
 
         fn="$dlfn"
+        fnpid="$dlpid"
         if [ "$i" -lt "$(expr $N - 1)" ]; then
-            nexturl=$(rewrite_url "${urls[$(expr $i + 1)]}")
-            dlfn=$(mktempdl "$nexturl")
-            rm "$dlfn"
-            aria2c -x 10 -j 10 -s 10 -m 10 --retry-wait 30 -o "$dlfn" "$nexturl" & dlpid=$!
+            dlfn=$(mktempdl "${urls[$(expr $i + 1)]}")
+            download "${urls[$(expr $i + 1)]}" "$dlfn" & dlpid=$!
         fi
 
         if ! grep -F "${accessions[$i]}" <(echo "${urls[$i]}"); then
@@ -59,7 +61,10 @@ main() {
                 ;;
         esac
 
-        "$exe" --reference "$reference" /home/dnanexus/out/index_db/htsnexus_index "$namespace" "${accessions[$i]}" "$fn" "${urls[$i]}"
+        # index the file while it's still downloading, then make sure the
+        # download succeeded
+        "$exe" --reference "$reference" --follow "$fnpid" /home/dnanexus/out/index_db/htsnexus_index "$namespace" "${accessions[$i]}" "$fn" "${urls[$i]}"
+        wait "$fnpid"
         rm "$fn"
     done
 
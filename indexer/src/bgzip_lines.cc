@@ -15,23 +15,42 @@
 #include <iostream>
 #include <string>
 #include <getopt.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include "htslib/bgzf.h"
 
 using namespace std;
 
+// htsnexus_deflate.cc prototypes
+int bgzf_max_level();
+void bgzf_compress(const char* data, size_t len, int level, string& out);
+
 const char* usage =
-    "cat input.txt | bgzip_lines > output.txt.gz\n"
+    "cat input.txt | bgzip_lines [options] > output.txt.gz\n"
+    "Options:\n"
+    "  --level <n>  compression level, 0 (none) to 9, or to 12 if built with\n"
+    "               libdeflate (default: 6)\n"
 ;
 
 int main(int argc, char* argv[]) {
     static struct option long_options[] = {
-        {"help", no_argument, 0, 'h'}
+        {"help", no_argument, 0, 'h'},
+        {"level", required_argument, 0, 'l'},
+        {0, 0, 0, 0}
     };
 
+    int level = -1;
+
     int c;
-    while (-1 != (c = getopt_long(argc, argv, "h", long_options, 0))) {
+    while (-1 != (c = getopt_long(argc, argv, "hl:", long_options, 0))) {
         switch (c) {
+            case 'l':
+                level = atoi(optarg);
+                if (level < 0 || level > bgzf_max_level()) {
+                    cout << usage << endl;
+                    return 1;
+                }
+                break;
             default:
                 cout << usage << endl;
                 return 1;
@@ -44,31 +63,50 @@ int main(int argc, char* argv[]) {
     }
 
     #define H(cond) if (cond) { cerr << "[bgzip_lines] error: " << #cond << endl; return 1; }
-    BGZF *fp = bgzf_dopen(fileno(stdout), "w");
+    ios::sync_with_stdio(false);
+
+    // We accumulate lines in the uncompressed block buffer, and flush it to
+    // one or more compressed BGZF blocks (the latter only if it holds a line
+    // too long for one block).
+    string block, compressed;
+    auto flush = [&]() {
+        if (!block.empty()) {
+            compressed.clear();
+            bgzf_compress(block.c_str(), block.size(), level, compressed);
+            block.clear();
+            cout.write(compressed.c_str(), compressed.size());
+        }
+        return !cout.good();
+    };
 
     bool in_header = true;
     string line;
     while (getline(cin, line)) {
+        line += '\n';
         // If we've buffered a partial BGZF block and this line isn't gonna fit
         // in its remaining capacity, flush it and start a new block.
-        H(bgzf_flush_try(fp, line.size()+1));
+        if (block.size() + line.size() > BGZF_BLOCK_SIZE) {
+            H(flush());
+        }
         // If this is the first non-header line, start a new block.
-        if (in_header && (line.size() > 0 && line[0] != '#')) {
-            H(bgzf_flush(fp));
+        if (in_header && (line.size() > 1 && line[0] != '#')) {
+            H(flush());
             in_header = false;
         }
-        // Write the line
-        line += '\n';
-        auto block_address_pre = fp->block_address;
-        H(bgzf_write(fp, line.c_str(), line.size()) < ssize_t(line.size()));
-        // If that line was so long that it spilled over into a new block, end
-        // the block so that the next line will start in a new block.
-        if (fp->block_address != block_address_pre) {
-            H(bgzf_flush(fp));
+        // Buffer the line. If it fills the block (or more, being so long as
+        // to span multiple blocks), end the block so that the next line will
+        // start in a new block.
+        block += line;
+        if (block.size() >= BGZF_BLOCK_SIZE) {
+            H(flush());
         }
     }
 
     H(!cin.eof() || cin.bad());
-    H(bgzf_close(fp));
+    H(flush());
+    // BGZF EOF marker
+    cout.write("\037\213\010\4\0\0\0\0\0\377\6\0\102\103\2\0\033\0\3\0\0\0\0\0\0\0\0\0", 28);
+    cout.flush();
+    H(!cout.good());
     return 0;
 }
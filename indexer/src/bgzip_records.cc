@@ -0,0 +1,161 @@
+// Re-blocks a BAM (or BCF) file from stdin to stdout, the binary counterpart of
+// bgzip_lines: the records are copied unchanged, but the BGZF blocks are
+// chosen to facilitate later taking slices of the file without recompression.
+//
+// Each BGZF block begins exactly at the beginning of some record, and ends
+// exactly at the end of some record. The only EXCEPTION is a record too large
+// for one block; then as many additional blocks as necessary will be dedicated
+// to remaining parts of that record, and the next record will begin with a new
+// block.
+//
+// Furthermore, the header is written in its own block(s), and a new block is
+// started at each transition from one reference sequence to the next (including
+// the unmapped reads), so that no block holds records of more than one.
+// Smaller blocks, with --block-size, give finer slicing at some cost in
+// compression.
+
+#include <iostream>
+#include <memory>
+#include <string>
+#include <getopt.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "htslib/bgzf.h"
+#include "htslib/sam.h"
+#include "htslib/vcf.h"
+
+using namespace std;
+
+const char* usage =
+    "bgzip_records [options] < input.bam > output.bam\n"
+    "Options:\n"
+    "  --block-size <n>  start a new BGZF block before any record that would\n"
+    "                    otherwise take it over this many (uncompressed) bytes\n"
+    "                    (default and maximum: 65280)\n"
+    "  --level <n>       compression level, 0-9 (default: htslib's)\n"
+    "  --threads <n>     number of compression threads (default: 1)\n"
+;
+
+int main(int argc, char* argv[]) {
+    static struct option long_options[] = {
+        {"help", no_argument, 0, 'h'},
+        {"block-size", required_argument, 0, 'b'},
+        {"level", required_argument, 0, 'l'},
+        {"threads", required_argument, 0, 't'},
+        {0, 0, 0, 0}
+    };
+
+    int block_size = BGZF_BLOCK_SIZE;
+    int level = -1;
+    int threads = 1;
+
+    int c;
+    while (-1 != (c = getopt_long(argc, argv, "hb:l:t:", long_options, 0))) {
+        switch (c) {
+            case 'b':
+                block_size = atoi(optarg);
+                if (block_size <= 0 || block_size > BGZF_BLOCK_SIZE) {
+                    cout << usage << endl;
+                    return 1;
+                }
+                break;
+            case 'l':
+                level = atoi(optarg);
+                if (level < 0 || level > 9) {
+                    cout << usage << endl;
+                    return 1;
+                }
+                break;
+            case 't':
+                threads = atoi(optarg);
+                if (threads <= 0) {
+                    cout << usage << endl;
+                    return 1;
+                }
+                break;
+            default:
+                cout << usage << endl;
+                return 1;
+        }
+    }
+
+    if (isatty(0) || optind != argc) {
+        cout << usage << endl;
+        return 1;
+    }
+
+    #define H(cond) if (cond) { cerr << "[bgzip_records] error: " << #cond << endl; return 1; }
+    shared_ptr<htsFile> in(hts_open("-", "r"), [](htsFile* f) { if (f) hts_close(f); });
+    H(!in);
+    bool bcf_input = in->format.format == bcf;
+    H(!bcf_input && in->format.format != bam);
+
+    string mode = "wb" + (level >= 0 ? to_string(level) : string());
+    htsFile* out = hts_open("-", mode.c_str());
+    H(!out);
+    H(threads > 1 && hts_set_threads(out, threads));
+    BGZF* bgzf = out->fp.bgzf;
+
+    // copy the header, ending its block
+    shared_ptr<bam_hdr_t> sam_header;
+    shared_ptr<bcf_hdr_t> vcf_header;
+    if (bcf_input) {
+        vcf_header.reset(bcf_hdr_read(in.get()), [](bcf_hdr_t* h) { if (h) bcf_hdr_destroy(h); });
+        H(!vcf_header);
+        H(bcf_hdr_write(out, vcf_header.get()));
+    } else {
+        sam_header.reset(sam_hdr_read(in.get()), [](bam_hdr_t* h) { if (h) bam_hdr_destroy(h); });
+        H(!sam_header);
+        H(sam_hdr_write(out, sam_header.get()));
+    }
+    H(bgzf_flush(bgzf));
+
+    shared_ptr<bam1_t> sam_record(bam_init1(), [](bam1_t* b) { bam_destroy1(b); });
+    shared_ptr<bcf1_t> vcf_record(bcf_init(), [](bcf1_t* b) { bcf_destroy(b); });
+    int last_tid = -2;
+    while (true) {
+        // read the next record, and determine its sequence and serialized size
+        int tid;
+        int64_t size;
+        if (bcf_input) {
+            c = bcf_read(in.get(), vcf_header.get(), vcf_record.get());
+            if (c == -1) {
+                break;
+            }
+            H(c < -1 || vcf_record->errcode);
+            tid = vcf_record->rid;
+            size = 32 + vcf_record->shared.l + vcf_record->indiv.l;
+        } else {
+            c = sam_read1(in.get(), sam_header.get(), sam_record.get());
+            if (c == -1) {
+                break;
+            }
+            H(c < -1);
+            tid = sam_record->core.tid;
+            size = 4 + 32 + sam_record->l_data;
+        }
+
+        // Start a new block if this record begins a new reference sequence,
+        // or won't fit in the current block.
+        if (tid != last_tid || bgzf->block_offset + size > block_size) {
+            H(bgzf_flush(bgzf));
+        }
+        last_tid = tid;
+
+        // Write the record
+        if (bcf_input) {
+            H(bcf_write(out, vcf_header.get(), vcf_record.get()));
+        } else {
+            H(sam_write1(out, sam_header.get(), sam_record.get()) < 0);
+        }
+        // If that record was so large that it spilled over into further
+        // blocks, end the block so that the next record will start in a new
+        // block.
+        if (size >= BGZF_BLOCK_SIZE) {
+            H(bgzf_flush(bgzf));
+        }
+    }
+
+    H(hts_close(out));
+    return 0;
+}
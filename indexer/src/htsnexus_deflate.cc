@@ -0,0 +1,155 @@
+// BGZF block compression for the paths where htsnexus itself decides the block
+// boundaries (bgzip_lines and the header fragments stored in the index), so
+// that they needn't go through htslib's BGZF writer. This lets us choose the
+// deflate implementation: zlib by default, or libdeflate if built with
+// -DHTSNEXUS_LIBDEFLATE=ON, which is considerably faster at a given level and
+// additionally offers levels 10-12 for better compression.
+
+#include <string>
+#include <memory>
+#include <stdexcept>
+#include <string.h>
+#include <stdint.h>
+#include "htslib/bgzf.h"
+#ifdef HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#else
+#include <zlib.h>
+#endif
+
+using namespace std;
+
+// BGZF block header, with the BSIZE field (bytes 16-17) left zero
+static const unsigned char bgzf_block_header[18] = {
+    31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0, 0, 0
+};
+// the block header plus the CRC32 and ISIZE footer
+static const size_t bgzf_block_overhead = sizeof(bgzf_block_header) + 8;
+
+int bgzf_max_level() {
+#ifdef HAVE_LIBDEFLATE
+    return 12;
+#else
+    return 9;
+#endif
+}
+
+static void put_le16(unsigned char* p, uint32_t v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+}
+
+static void put_le32(unsigned char* p, uint32_t v) {
+    put_le16(p, v & 0xffff);
+    put_le16(p + 2, v >> 16);
+}
+
+// Raw-deflate len bytes (at most BGZF_BLOCK_SIZE) into out, which has room for
+// BGZF_MAX_BLOCK_SIZE-bgzf_block_overhead bytes. Returns the compressed size,
+// or 0 if the data didn't compress to fit.
+static size_t raw_deflate(const char* data, size_t len, int level, unsigned char* out) {
+    const size_t out_size = BGZF_MAX_BLOCK_SIZE - bgzf_block_overhead;
+    // the compressor takes some effort to set up, so keep one around for the
+    // most recently used level
+#ifdef HAVE_LIBDEFLATE
+    thread_local shared_ptr<libdeflate_compressor> compressor;
+    thread_local int compressor_level = -2;
+    if (!compressor || compressor_level != level) {
+        compressor.reset(libdeflate_alloc_compressor(level < 0 ? 6 : level),
+                         [](libdeflate_compressor* p) { if (p) libdeflate_free_compressor(p); });
+        if (!compressor) {
+            throw runtime_error("libdeflate_alloc_compressor(" + to_string(level) + ")");
+        }
+        compressor_level = level;
+    }
+    return libdeflate_deflate_compress(compressor.get(), data, len, out, out_size);
+#else
+    thread_local shared_ptr<z_stream> zs;
+    thread_local int zs_level = -2;
+    if (!zs || zs_level != level) {
+        zs.reset();
+        unique_ptr<z_stream> p(new z_stream);
+        memset(p.get(), 0, sizeof(z_stream));
+        if (deflateInit2(p.get(), level < 0 ? Z_DEFAULT_COMPRESSION : level, Z_DEFLATED, -15, 8,
+                         Z_DEFAULT_STRATEGY) != Z_OK) {
+            throw runtime_error("deflateInit2(" + to_string(level) + ")");
+        }
+        zs.reset(p.release(), [](z_stream* p) { deflateEnd(p); delete p; });
+        zs_level = level;
+    } else if (deflateReset(zs.get()) != Z_OK) {
+        throw runtime_error("deflateReset");
+    }
+    zs->next_in = (Bytef*) data;
+    zs->avail_in = len;
+    zs->next_out = out;
+    zs->avail_out = out_size;
+    int ret = deflate(zs.get(), Z_FINISH);
+    if (ret != Z_STREAM_END) {
+        if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            throw runtime_error("deflate: " + to_string(ret));
+        }
+        return 0;
+    }
+    return zs->total_out;
+#endif
+}
+
+static uint32_t crc32_of(const char* data, size_t len) {
+#ifdef HAVE_LIBDEFLATE
+    return libdeflate_crc32(0, data, len);
+#else
+    return crc32(crc32(0, Z_NULL, 0), (const Bytef*) data, len);
+#endif
+}
+
+// Compress data into one or more complete BGZF blocks, each holding up to
+// BGZF_BLOCK_SIZE bytes of it, at the given level (-1 for the backend's
+// default; 0 to store the data uncompressed). Appends the blocks to out. As with
+// htslib, data too long for one block fills as many full blocks as necessary,
+// with any remainder in the last.
+void bgzf_compress(const char* data, size_t len, int level, string& out) {
+    if (level < -1 || level > bgzf_max_level()) {
+        throw runtime_error("invalid compression level " + to_string(level));
+    }
+    unsigned char block[BGZF_MAX_BLOCK_SIZE];
+    do {
+        size_t n = len < BGZF_BLOCK_SIZE ? len : BGZF_BLOCK_SIZE;
+        unsigned char* payload = block + sizeof(bgzf_block_header);
+        size_t compressed = level == 0 ? 0 : raw_deflate(data, n, level, payload);
+        if (compressed == 0) {
+            // a single uncompressed deflate block: the final-block flag and
+            // type 00, then LEN and its complement NLEN
+            payload[0] = 1;
+            put_le16(payload + 1, n);
+            put_le16(payload + 3, ~n);
+            memcpy(payload + 5, data, n);
+            compressed = n + 5;
+        }
+        size_t block_size = compressed + bgzf_block_overhead;
+        memcpy(block, bgzf_block_header, sizeof(bgzf_block_header));
+        put_le16(block + 16, block_size - 1);
+        put_le32(payload + compressed, crc32_of(data, n));
+        put_le32(payload + compressed + 4, n);
+        out.append((const char*) block, block_size);
+        data += n;
+        len -= n;
+    } while (len > 0);
+}
+
+string bgzf_compress(const string& data, int level) {
+    string ans;
+    bgzf_compress(data.c_str(), data.size(), level, ans);
+    return ans;
+}
+
+// Parse the first 18 bytes of a BGZF block, returning the block's total size,
+// or 0 if they aren't a block header. We expect the header layout written by
+// htslib (and above), with the BC subfield (holding the block size) as the
+// only extra field.
+int64_t bgzf_block_size(const unsigned char* header) {
+    if (memcmp(header, bgzf_block_header, 3) || !(header[3] & 4) ||
+        memcmp(header + 10, bgzf_block_header + 10, 4)) {
+        return 0;
+    }
+    return (header[16] | (header[17] << 8)) + 1;
+}
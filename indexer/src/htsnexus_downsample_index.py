@@ -23,57 +23,66 @@ args = parser.parse_args()
 dest_fn = args.db + '.downsampled'
 shutil.copy(args.db, dest_fn)
 
-# open the source database and list the files and seqs
+# open the source database and list the files and sequence tids
 src_conn = sqlite3.connect(args.db)
-files = set(row[0] for row in src_conn.execute('select distinct _dbid from htsfiles_blocks order by _dbid'))
-seqs = set(row[0] for row in src_conn.execute('select distinct seq from htsfiles_blocks where seq is not null order by seq'))
+files = set(row[0] for row in src_conn.execute('select distinct file_id from htsfiles_blocks order by file_id'))
+tids = set(row[0] for row in src_conn.execute('select distinct tid from htsfiles_blocks where tid >= 0 order by tid'))
 
 # open the destination database and delete everything in htsfiles_blocks
 dest_conn = sqlite3.connect(dest_fn)
 dest_cursor = dest_conn.cursor()
 dest_cursor.execute('delete from htsfiles_blocks')
 
+# Index entries with their own block_prefix/block_suffix (e.g. CRAM slices,
+# framed by a synthesized container header) can't be consolidated; copy them
+# as-is, and consolidate only the others.
+unframed = 'block_prefix is null and block_suffix is null'
+for row in src_conn.execute('select * from htsfiles_blocks where not (' + unframed + ')'):
+    dest_cursor.execute('insert into htsfiles_blocks values(?,?,?,?,?,?,?,?)', row)
+
 # main processing loop
 for file in files:
-    for seq in seqs:
+    for tid in tids:
         byteLo = sys.maxint
         byteHi = -1
-        seqLo = (sys.maxint if seq is not None else None)
-        seqHi = (-1 if seq is not None else None)
+        seqLo = sys.maxint
+        seqHi = -1
 
         # scan the index entries for this file & seq
-        # TODO: handle block_prefix and block_suffix
-        for row in src_conn.execute('select byteLo, byteHi, seqLo, seqHi from htsfiles_blocks where _dbid=? and seq=? order by byteLo, byteHi', (file, seq)):
+        for row in src_conn.execute('select byteLo, byteHi, seqLo, seqHi from htsfiles_blocks where file_id=? and tid=? and ' + unframed + ' order by byteLo, byteHi', (file, tid)):
             byteLo = min(byteLo, row[0])
             byteHi = max(byteHi, row[1])
-            if seq is not None:
-                seqLo = min(seqLo, row[2])
-                seqHi = max(seqHi, row[3])
+            seqLo = min(seqLo, row[2])
+            seqHi = max(seqHi, row[3])
 
             # when the accumulated byte range for seq passes the desired
             # resolution, insert a consolidated destination index entry
-            assert (byteLo >= 0 and byteHi > byteLo and (seq is None or (seqLo >= 0 and seqHi > seqLo)))
+            assert (byteLo >= 0 and byteHi > byteLo and seqLo >= 0 and seqHi > seqLo)
             if byteHi - byteLo >= args.resolution:
-                dest_cursor.execute('insert into htsfiles_blocks values(?,?,?,?,?,?,?,?)', (file, byteLo, byteHi, seq, seqLo, seqHi, None, None))
+                dest_cursor.execute('insert into htsfiles_blocks values(?,?,?,?,?,?,?,?)', (file, byteLo, byteHi, tid, seqLo, seqHi, None, None))
                 byteLo = sys.maxint
                 byteHi = -1
-                seqLo = (sys.maxint if seq is not None else None)
-                seqHi = (-1 if seq is not None else None)
+                seqLo = sys.maxint
+                seqHi = -1
 
         # last entry
         if byteHi >= 0:
-            dest_cursor.execute('insert into htsfiles_blocks values(?,?,?,?,?,?,?,?)', (file, byteLo, byteHi, seq, seqLo, seqHi, None, None))
+            dest_cursor.execute('insert into htsfiles_blocks values(?,?,?,?,?,?,?,?)', (file, byteLo, byteHi, tid, seqLo, seqHi, None, None))
 
-    # create a consolidated entry for the unmapped reads (if any)
-    unmapped_query = 'select min(byteLo), max(byteHi) from htsfiles_blocks where _dbid=? and seq is null'
+    # create a consolidated entry for the unmapped reads (tid -1, if any)
+    unmapped_query = 'select min(byteLo), max(byteHi) from htsfiles_blocks where file_id=? and tid=-1 and ' + unframed
     unmapped = list(src_conn.execute(unmapped_query, (file,)))
     if len(unmapped) and unmapped[0][0] is not None:
-        dest_cursor.execute('insert into htsfiles_blocks values(?,?,?,?,?,?,?,?)', (file, unmapped[0][0], unmapped[0][1], None, None, None, None, None))
+        dest_cursor.execute('insert into htsfiles_blocks values(?,?,?,?,?,?,?,?)', (file, unmapped[0][0], unmapped[0][1], -1, None, None, None, None))
 
 # sanity check concordance of the old and new indices
-check = "select min(seqLo), max(seqHi), min(byteLo), max(byteHi) from htsfiles_blocks group by _dbid, seq order by _dbid, seq"
+check = "select min(seqLo), max(seqHi), min(byteLo), max(byteHi) from htsfiles_blocks group by file_id, tid order by file_id, tid"
 assert (list(src_conn.execute(check)) == list(dest_conn.execute(check)))
 
+# the per-sequence block summaries (if any) remain valid, except for the counts
+if list(dest_conn.execute("select name from sqlite_master where type = 'table' and name = 'htsfiles_blocks_summary'")):
+    dest_cursor.execute('update htsfiles_blocks_summary set blocks = (select count(*) from htsfiles_blocks b where b.file_id = htsfiles_blocks_summary.file_id and b.tid = htsfiles_blocks_summary.tid)')
+
 # finish up
 dest_conn.commit()
 dest_conn.execute('vacuum')
@@ -0,0 +1,181 @@
+#!/bin/bash
+# Export an htsnexus index database to a read-optimized snapshot for serving
+# nodes. The indexers' database accumulates rows in whatever order the files
+# were indexed, with pages fragmented by the interleaved tables and indices.
+# The snapshot holds the same information, rebuilt in one pass:
+#  - files are renumbered in order of _dbid
+#  - htsfiles_blocks is a WITHOUT ROWID table clustered on
+#    (file_id, tid, byteLo), so each sequence's entries are contiguous, in
+#    genomic order for coordinate-sorted files (seqLo itself can't be part of
+#    the key, since it's null for unmapped reads)
+#  - large pages (64KiB by default), fully packed by a final vacuum
+#  - sqlite_stat1 statistics from analyze, for the query planner
+# The snapshot is made read-only (chmod a-w), so that the indexers can't add to
+# it by mistake. Optionally, it's gzipped for transfer; it must then be
+# decompressed before serving.
+set -e -o pipefail
+
+usage() {
+    echo "Usage: htsnexus_export_snapshot.sh [--page-size <bytes>] [--gzip] index.db snapshot.db"
+    echo ""
+    echo "snapshot.db must not exist. With --gzip, it's written gzip-compressed."
+    exit 1
+}
+
+page_size=65536
+gzip=0
+while [ $# -gt 0 ]; do
+    case "$1" in
+        --page-size)
+            [ $# -ge 2 ] || usage
+            page_size="$2"
+            shift 2
+            ;;
+        --gzip)
+            gzip=1
+            shift
+            ;;
+        -*)
+            usage
+            ;;
+        *)
+            break
+            ;;
+    esac
+done
+if [ $# -ne 2 ]; then
+    usage
+fi
+case "$page_size" in
+    512|1024|2048|4096|8192|16384|32768|65536) ;;
+    *)
+        echo "invalid page size (must be a power of two from 512 to 65536): $page_size"
+        exit 1
+        ;;
+esac
+
+if ! [ -f "$1" ]; then
+    echo "does not exist: $1"
+    exit 1
+fi
+if [ -e "$2" ]; then
+    echo "already exists: $2"
+    exit 1
+fi
+
+version=$(sqlite3 -batch "$1" "pragma user_version")
+if [ "$version" != "2" ]; then
+    echo "schema version $version; upgrade with htsnexus_migrate_database.sh"
+    exit 1
+fi
+
+# Databases generated by older indexer versions lack the per-sequence block
+# summaries; the servers do without them.
+summary_sql=""
+summary_table=""
+if [ "$(sqlite3 -batch "$1" "select count(*) from sqlite_master where type = 'table' and name = 'htsfiles_blocks_summary'")" = "1" ]; then
+    summary_sql="create table htsfiles_blocks_summary (file_id integer not null, tid integer not null check(tid >= -1), \
+    blocks integer not null check(blocks >= 0), seqLo integer, seqHi integer, byteLo integer, byteHi integer, \
+    contiguous integer not null, bin_size integer, occupancy blob, \
+    primary key(file_id,tid), foreign key(file_id) references htsfiles_blocks_meta(file_id)) without rowid;
+insert into htsfiles_blocks_summary select new_id, tid, blocks, seqLo, seqHi, byteLo, byteHi, contiguous, bin_size, occupancy \
+    from src.htsfiles_blocks_summary join file_ids on old_id = file_id order by new_id, tid;"
+    summary_table=htsfiles_blocks_summary
+fi
+
+tmp="${2}.tmp$$"
+trap 'rm -f "$tmp" "$tmp.gz"' EXIT
+rm -f "$tmp"
+
+# The tables match the schema in htsnexus_index_util.cc, except for
+# htsfiles_blocks. Rows of the same block and sequence (which a file unsorted
+# within a block can produce) are merged into one entry covering both, as the
+# primary key requires; the server would return the block for either anyway.
+# The indices are created after the rows are inserted, so that they're built
+# in order too.
+sqlite3 -batch -bail "$tmp" "pragma page_size = $page_size;
+pragma journal_mode = off;
+pragma synchronous = off;
+attach '$1' as src;
+begin;
+create table htsfiles (file_id integer primary key, _dbid text not null unique, \
+    format text not null, namespace text not null, accession text not null, url text not null, \
+    file_size integer check(file_size is null or file_size > 0));
+create table htsfiles_blocks_meta (file_id integer primary key, reference text not null, \
+    header text not null, slice_prefix blob, slice_suffix blob, \
+    foreign key(file_id) references htsfiles(file_id));
+create table htsfiles_seqs (file_id integer not null, tid integer not null check(tid >= 0), \
+    name text not null, length integer check(length is null or length >= 0), \
+    primary key(file_id,tid), foreign key(file_id) references htsfiles(file_id));
+create table htsfiles_blocks (file_id integer not null, \
+    byteLo integer not null check(byteLo >= 0), byteHi integer not null check(byteHi > byteLo), \
+    tid integer not null check(tid >= 0 or (tid = -1 and seqLo is null and seqHi is null)), \
+    seqLo integer check(tid = -1 or (seqLo is not null and seqLo >= 0)), \
+    seqHi integer check(tid = -1 or (seqHi is not null and seqHi >= seqLo)), \
+    block_prefix blob, block_suffix blob, primary key(file_id,tid,byteLo), \
+    foreign key(file_id) references htsfiles_blocks_meta(file_id)) without rowid;
+create table htsfiles_coverage (file_id integer not null, tid integer not null check(tid >= 0), \
+    binLo integer not null check(binLo >= 0), binHi integer not null check(binHi > binLo), \
+    reads integer not null check(reads >= 0), bases integer not null check(bases >= 0), \
+    bytes integer not null check(bytes >= 0), foreign key(file_id) references htsfiles(file_id));
+create table htsfiles_chunks (file_id integer not null, \
+    byteLo integer not null check(byteLo >= 0), byteHi integer not null check(byteHi > byteLo), \
+    foreign key(file_id) references htsfiles(file_id));
+
+insert into htsfiles(_dbid,format,namespace,accession,url,file_size) \
+    select _dbid, format, namespace, accession, url, file_size from src.htsfiles order by _dbid;
+create temp table file_ids (old_id integer primary key, new_id integer not null);
+insert into file_ids select s.file_id, d.file_id from src.htsfiles s join main.htsfiles d using (_dbid);
+insert into htsfiles_blocks_meta select new_id, reference, header, slice_prefix, slice_suffix \
+    from src.htsfiles_blocks_meta join file_ids on old_id = file_id order by new_id;
+insert into htsfiles_seqs select new_id, tid, name, length \
+    from src.htsfiles_seqs join file_ids on old_id = file_id order by new_id, tid;
+insert into htsfiles_blocks select new_id, byteLo, max(byteHi), tid, min(seqLo), max(seqHi), \
+    min(block_prefix), min(block_suffix) \
+    from src.htsfiles_blocks join file_ids on old_id = file_id \
+    group by new_id, tid, byteLo order by new_id, tid, byteLo;
+insert into htsfiles_coverage select new_id, tid, binLo, binHi, reads, bases, bytes \
+    from src.htsfiles_coverage join file_ids on old_id = file_id order by new_id, tid, binLo;
+insert into htsfiles_chunks select new_id, byteLo, byteHi \
+    from src.htsfiles_chunks join file_ids on old_id = file_id order by new_id, byteLo;
+$summary_sql
+
+create unique index htsfiles_namespace_accession on htsfiles(namespace,accession,format);
+create unique index htsfiles_seqs_name on htsfiles_seqs(file_id,name);
+create index htsfiles_blocks_index1 on htsfiles_blocks(file_id,tid,seqLo,seqHi);
+create index htsfiles_blocks_index2 on htsfiles_blocks(file_id,tid,seqHi);
+create index htsfiles_coverage_index on htsfiles_coverage(file_id,tid,binLo);
+create index htsfiles_chunks_index on htsfiles_chunks(file_id,byteLo);
+pragma user_version = $version;
+commit;
+detach src;
+analyze;
+vacuum;
+pragma journal_mode = delete" > /dev/null
+
+# sanity check concordance of the source database and the snapshot
+check="select _dbid, tid, count(distinct byteLo), min(seqLo), max(seqHi), min(byteLo), max(byteHi) \
+    from htsfiles_blocks join htsfiles using (file_id) group by _dbid, tid order by _dbid, tid"
+if [ "$(sqlite3 -batch "$1" "$check")" != "$(sqlite3 -batch "$tmp" "$check")" ]; then
+    echo "snapshot index differs from $1"
+    exit 1
+fi
+for table in htsfiles htsfiles_blocks_meta htsfiles_seqs htsfiles_coverage htsfiles_chunks $summary_table; do
+    if [ "$(sqlite3 -batch "$1" "select count(*) from $table")" != "$(sqlite3 -batch "$tmp" "select count(*) from $table")" ]; then
+        echo "snapshot $table differs from $1"
+        exit 1
+    fi
+done
+if [ "$(sqlite3 -batch "$tmp" "pragma integrity_check")" != "ok" ]; then
+    echo "snapshot integrity check failed"
+    exit 1
+fi
+
+if [ "$gzip" -eq 1 ]; then
+    gzip -c "$tmp" > "$tmp.gz"
+    chmod a-w "$tmp.gz"
+    mv "$tmp.gz" "$2"
+else
+    chmod a-w "$tmp"
+    mv "$tmp" "$2"
+fi
@@ -0,0 +1,856 @@
+// Native htsnexus client: request the ticket for a file or genomic range
+// slice, then fetch the byte ranges it lists as concurrent sub-range requests
+// (through htslib's libcurl-backed hFILE), writing the data to standard output
+// in order. The parts arriving out of order wait in a bounded reorder buffer.
+// Optionally, the BGZF block or CRAM container framing of the output is
+// checked as it's written.
+
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <exception>
+#include <stdexcept>
+#include <algorithm>
+#include <functional>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <zlib.h>
+#include "htslib/hfile.h"
+
+using namespace std;
+
+/*************************************************************************************************/
+
+// htsnexus_deflate.cc prototypes
+int64_t bgzf_block_size(const unsigned char* header);
+
+/*************************************************************************************************/
+
+// Minimal JSON parser, sufficient for htsget tickets
+struct json_value {
+    enum kind_t { null_t, bool_t, number_t, string_t, array_t, object_t };
+    kind_t kind = null_t;
+    bool boolean = false;
+    double number = 0;
+    string str;
+    vector<json_value> array;
+    vector<pair<string,json_value>> object;
+
+    // look up a key of an object, or return null
+    const json_value* get(const string& key) const {
+        if (kind == object_t) {
+            for (const auto& kv : object) {
+                if (kv.first == key) {
+                    return &kv.second;
+                }
+            }
+        }
+        return nullptr;
+    }
+};
+
+class json_parser {
+    const string& text;
+    size_t pos = 0;
+
+    [[noreturn]] void fail(const string& what) {
+        throw runtime_error("Invalid JSON (" + what + ") at offset " + to_string(pos));
+    }
+
+    void skip_space() {
+        while (pos < text.size() && text[pos] && strchr(" \t\r\n", text[pos])) {
+            pos++;
+        }
+    }
+
+    void expect(const char* literal) {
+        size_t n = strlen(literal);
+        if (text.compare(pos, n, literal) != 0) {
+            fail(string("expected ") + literal);
+        }
+        pos += n;
+    }
+
+    // append code point cp to out as UTF-8
+    static void put_utf8(string& out, unsigned cp) {
+        if (cp < 0x80) {
+            out += (char) cp;
+        } else if (cp < 0x800) {
+            out += (char) (0xC0 | (cp >> 6));
+            out += (char) (0x80 | (cp & 0x3F));
+        } else if (cp < 0x10000) {
+            out += (char) (0xE0 | (cp >> 12));
+            out += (char) (0x80 | ((cp >> 6) & 0x3F));
+            out += (char) (0x80 | (cp & 0x3F));
+        } else {
+            out += (char) (0xF0 | (cp >> 18));
+            out += (char) (0x80 | ((cp >> 12) & 0x3F));
+            out += (char) (0x80 | ((cp >> 6) & 0x3F));
+            out += (char) (0x80 | (cp & 0x3F));
+        }
+    }
+
+    unsigned parse_hex4() {
+        if (pos + 4 > text.size()) {
+            fail("truncated \\u escape");
+        }
+        unsigned ans = 0;
+        for (int i = 0; i < 4; i++) {
+            char c = text[pos++];
+            ans <<= 4;
+            if (c >= '0' && c <= '9') ans |= c - '0';
+            else if (c >= 'a' && c <= 'f') ans |= c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F') ans |= c - 'A' + 10;
+            else fail("invalid \\u escape");
+        }
+        return ans;
+    }
+
+    string parse_string() {
+        expect("\"");
+        string ans;
+        while (true) {
+            if (pos >= text.size()) {
+                fail("unterminated string");
+            }
+            char c = text[pos++];
+            if (c == '"') {
+                return ans;
+            } else if (c != '\\') {
+                ans += c;
+                continue;
+            }
+            if (pos >= text.size()) {
+                fail("unterminated string");
+            }
+            switch (c = text[pos++]) {
+                case '"': case '\\': case '/': ans += c; break;
+                case 'b': ans += '\b'; break;
+                case 'f': ans += '\f'; break;
+                case 'n': ans += '\n'; break;
+                case 'r': ans += '\r'; break;
+                case 't': ans += '\t'; break;
+                case 'u': {
+                    unsigned cp = parse_hex4();
+                    if (cp >= 0xD800 && cp < 0xDC00 && text.compare(pos, 2, "\\u") == 0) {
+                        // surrogate pair
+                        pos += 2;
+                        unsigned lo = parse_hex4();
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                    }
+                    put_utf8(ans, cp);
+                    break;
+                }
+                default:
+                    fail("invalid escape");
+            }
+        }
+    }
+
+    json_value parse_value() {
+        json_value ans;
+        skip_space();
+        if (pos >= text.size()) {
+            fail("unexpected end");
+        }
+        char c = text[pos];
+        if (c == '{') {
+            ans.kind = json_value::object_t;
+            pos++;
+            skip_space();
+            if (pos < text.size() && text[pos] == '}') {
+                pos++;
+                return ans;
+            }
+            while (true) {
+                skip_space();
+                string key = parse_string();
+                skip_space();
+                expect(":");
+                json_value v = parse_value();
+                ans.object.push_back(make_pair(key, v));
+                skip_space();
+                if (pos < text.size() && text[pos] == ',') {
+                    pos++;
+                } else {
+                    expect("}");
+                    return ans;
+                }
+            }
+        } else if (c == '[') {
+            ans.kind = json_value::array_t;
+            pos++;
+            skip_space();
+            if (pos < text.size() && text[pos] == ']') {
+                pos++;
+                return ans;
+            }
+            while (true) {
+                ans.array.push_back(parse_value());
+                skip_space();
+                if (pos < text.size() && text[pos] == ',') {
+                    pos++;
+                } else {
+                    expect("]");
+                    return ans;
+                }
+            }
+        } else if (c == '"') {
+            ans.kind = json_value::string_t;
+            ans.str = parse_string();
+        } else if (c == 't') {
+            expect("true");
+            ans.kind = json_value::bool_t;
+            ans.boolean = true;
+        } else if (c == 'f') {
+            expect("false");
+            ans.kind = json_value::bool_t;
+        } else if (c == 'n') {
+            expect("null");
+        } else {
+            const char* lo = text.c_str() + pos;
+            char* hi = nullptr;
+            ans.kind = json_value::number_t;
+            ans.number = strtod(lo, &hi);
+            if (hi == lo) {
+                fail("unexpected character");
+            }
+            pos += hi - lo;
+        }
+        return ans;
+    }
+
+public:
+    json_parser(const string& text_) : text(text_) {}
+
+    json_value parse() {
+        json_value ans = parse_value();
+        skip_space();
+        if (pos != text.size()) {
+            fail("trailing characters");
+        }
+        return ans;
+    }
+};
+
+/*************************************************************************************************/
+
+string base64_decode(const string& in) {
+    static int table[256];
+    static once_flag init;
+    call_once(init, []() {
+        const char* alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        fill(table, table + 256, -1);
+        for (int i = 0; i < 64; i++) {
+            table[(unsigned char) alphabet[i]] = i;
+        }
+    });
+
+    string ans;
+    unsigned bits = 0;
+    int nbits = 0;
+    for (unsigned char c : in) {
+        if (c == '=') {
+            break;
+        }
+        if (table[c] < 0) {
+            if (isspace(c)) {
+                continue;
+            }
+            throw runtime_error("Invalid base64 data");
+        }
+        bits = (bits << 6) | table[c];
+        nbits += 6;
+        if (nbits >= 8) {
+            nbits -= 8;
+            ans += (char) ((bits >> nbits) & 0xFF);
+        }
+    }
+    return ans;
+}
+
+// percent-encode a URL path component or query parameter
+string url_quote(const string& s) {
+    string ans;
+    for (unsigned char c : s) {
+        if (isalnum(c) || (c && strchr("-_.~", c))) {
+            ans += c;
+        } else {
+            char buf[4];
+            snprintf(buf, sizeof(buf), "%%%02X", c);
+            ans += buf;
+        }
+    }
+    return ans;
+}
+
+// GET the URL with the given request headers ("Name: value") and return the
+// response body. If expected_size is nonnegative, the body must be exactly
+// that long.
+string http_get(const string& url, const vector<string>& headers, int64_t expected_size) {
+    vector<const char*> hdrs;
+    for (const auto& h : headers) {
+        hdrs.push_back(h.c_str());
+    }
+    hdrs.push_back(nullptr);
+
+    errno = 0;
+    shared_ptr<hFILE> fp(hopen(url.c_str(), "r", "httphdr:v", hdrs.data(), nullptr),
+                         [](hFILE* f) { if (f) hclose_abruptly(f); });
+    if (!fp) {
+        throw runtime_error("GET " + url + ": " + (errno ? strerror(errno) : "failed"));
+    }
+
+    string ans;
+    if (expected_size >= 0) {
+        ans.reserve(expected_size);
+    }
+    const size_t bufsize = 1048576;
+    unique_ptr<char[]> buf(new char[bufsize]);
+    ssize_t n;
+    while ((n = hread(fp.get(), buf.get(), bufsize)) > 0) {
+        ans.append(buf.get(), n);
+        if (expected_size >= 0 && (int64_t) ans.size() > expected_size) {
+            throw runtime_error("GET " + url + ": response longer than the requested byte range");
+        }
+    }
+    if (n < 0) {
+        throw runtime_error("GET " + url + ": " + strerror(errno));
+    }
+    if (expected_size >= 0 && (int64_t) ans.size() != expected_size) {
+        throw runtime_error("GET " + url + ": response shorter than the requested byte range");
+    }
+    return ans;
+}
+
+/*************************************************************************************************/
+
+// Checks the framing of a BGZF or CRAM byte stream fed to it piece by piece:
+// that it consists of whole BGZF blocks, or of the CRAM file definition
+// followed by whole containers, ending with the EOF marker block/container.
+class framing_checker {
+    bool cram;
+    int cram_version = 0;
+    // stream offset of the current block/container, and the bytes of its
+    // header seen so far (possibly running into the body)
+    int64_t block_offset = 0;
+    string header;
+    // remaining bytes of the current block/container body to skip
+    int64_t skip = 0;
+    bool last_was_eof = false;
+
+    [[noreturn]] void fail(const string& what) {
+        throw runtime_error("Invalid " + string(cram ? "CRAM" : "BGZF") + " framing at byte " +
+                            to_string(block_offset) + " of the output: " + what);
+    }
+
+    // CRAM variable-length integers; these return false if header doesn't
+    // hold all of it (yet)
+    bool itf8(size_t& p, int32_t& v) {
+        if (p >= header.size()) return false;
+        const unsigned char* b = (const unsigned char*) header.data() + p;
+        size_t n = b[0] < 0x80 ? 1 : b[0] < 0xC0 ? 2 : b[0] < 0xE0 ? 3 : b[0] < 0xF0 ? 4 : 5;
+        if (p + n > header.size()) return false;
+        uint32_t u;
+        switch (n) {
+            case 1: u = b[0]; break;
+            case 2: u = ((b[0] << 8) | b[1]) & 0x3FFF; break;
+            case 3: u = ((b[0] << 16) | (b[1] << 8) | b[2]) & 0x1FFFFF; break;
+            case 4: u = (((uint32_t) b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3]) & 0x0FFFFFFF; break;
+            default: u = (((uint32_t) b[0] & 0x0F) << 28) | (b[1] << 20) | (b[2] << 12) | (b[3] << 4) | (b[4] & 0x0F);
+        }
+        v = (int32_t) u;
+        p += n;
+        return true;
+    }
+
+    bool ltf8(size_t& p, int64_t& v) {
+        if (p >= header.size()) return false;
+        const unsigned char* b = (const unsigned char*) header.data() + p;
+        // the number of leading one bits in the first byte is the number of
+        // bytes following it
+        size_t extra = 0;
+        while (extra < 8 && (b[0] & (0x80 >> extra))) extra++;
+        if (p + 1 + extra > header.size()) return false;
+        uint64_t u = extra < 8 ? (b[0] & (0x7F >> extra)) : 0;
+        for (size_t i = 1; i <= extra; i++) {
+            u = (u << 8) | b[i];
+        }
+        v = (int64_t) u;
+        p += 1 + extra;
+        return true;
+    }
+
+    // Try to parse the header of the next block/container from header,
+    // returning its length and setting body to the length of the rest of the
+    // block/container; or return 0 if more bytes are needed.
+    size_t parse_header(int64_t& body) {
+        const unsigned char* h = (const unsigned char*) header.data();
+        if (!cram) {
+            if (header.size() < 18) {
+                return 0;
+            }
+            int64_t bsize = bgzf_block_size(h);
+            if (!bsize) {
+                fail("unexpected BGZF block header");
+            }
+            if (bsize < 28) {
+                fail("unexpected BGZF block size");
+            }
+            body = bsize - 18;
+            // the EOF marker is an empty block, 28 bytes in all
+            last_was_eof = bsize == 28;
+            return 18;
+        }
+
+        if (!cram_version) {
+            // file definition
+            if (header.size() < 26) {
+                return 0;
+            }
+            if (memcmp(h, "CRAM", 4) || (h[4] != 2 && h[4] != 3)) {
+                fail("unexpected CRAM file definition");
+            }
+            cram_version = h[4];
+            body = 0;
+            return 26;
+        }
+
+        // container header
+        if (header.size() < 4) {
+            return 0;
+        }
+        int32_t length = (int32_t) (h[0] | (h[1] << 8) | (h[2] << 16) | ((uint32_t) h[3] << 24));
+        size_t p = 4;
+        int32_t ref_id, start, span, nrec, counter32, nblocks, nlandmarks, landmark;
+        int64_t counter, bases;
+        if (!itf8(p, ref_id) || !itf8(p, start) || !itf8(p, span) || !itf8(p, nrec) ||
+            !(cram_version >= 3 ? ltf8(p, counter) : itf8(p, counter32)) ||
+            !ltf8(p, bases) || !itf8(p, nblocks) || !itf8(p, nlandmarks)) {
+            return 0;
+        }
+        if (length < 0 || nlandmarks < 0 || nlandmarks > 1048576) {
+            fail("unexpected CRAM container header");
+        }
+        for (int32_t i = 0; i < nlandmarks; i++) {
+            if (!itf8(p, landmark)) {
+                return 0;
+            }
+        }
+        if (cram_version >= 3) {
+            if (p + 4 > header.size()) {
+                return 0;
+            }
+            uint32_t crc = h[p] | (h[p+1] << 8) | (h[p+2] << 16) | ((uint32_t) h[p+3] << 24);
+            if (crc != crc32(0L, h, p)) {
+                fail("CRAM container header checksum mismatch");
+            }
+            p += 4;
+        }
+        body = length;
+        last_was_eof = ref_id == -1 && nrec == 0 && start == 4542278;
+        return p;
+    }
+
+public:
+    framing_checker(bool cram_) : cram(cram_) {}
+
+    void feed(const char* data, size_t n) {
+        while (n > 0) {
+            if (skip > 0) {
+                size_t k = min((int64_t) n, skip);
+                skip -= k;
+                block_offset += k;
+                data += k;
+                n -= k;
+                continue;
+            }
+            // accumulate the next header a few bytes at a time
+            size_t k = min(n, (size_t) 32);
+            header.append(data, k);
+            data += k;
+            n -= k;
+            int64_t body = 0;
+            size_t len = parse_header(body);
+            if (len) {
+                // the bytes appended past the header belong to the body, or
+                // even beyond it (to be fed again)
+                int64_t extra = header.size() - len;
+                skip = body - extra;
+                if (skip < 0) {
+                    data += skip;
+                    n -= skip;
+                    skip = 0;
+                }
+                block_offset += len + body - skip;
+                header.clear();
+            }
+        }
+    }
+
+    void finish() {
+        if (skip > 0 || !header.empty()) {
+            fail("truncated");
+        }
+        if (!last_was_eof) {
+            fail("missing EOF marker");
+        }
+    }
+};
+
+/*************************************************************************************************/
+
+// one piece of the output: either data given inline in the ticket, or a
+// request for (a sub-range of) one of its URLs
+struct part {
+    string url;
+    vector<string> headers;
+    // byte range requested (inclusive), or -1 if the whole URL
+    int64_t lo = -1, hi = -1;
+
+    bool ready = false;
+    string data;
+    exception_ptr error;
+};
+
+// Fetches the parts on a pool of threads, each taking the next part not yet
+// started, as long as it's no more than window parts ahead of the one being
+// written out, which bounds the memory used by the reorder buffer.
+class parallel_fetcher {
+    vector<part>& parts;
+    size_t window;
+    bool verbose;
+
+    mutex mu;
+    condition_variable cv;
+    size_t next_start = 0, next_write = 0;
+    bool stopping = false;
+    vector<thread> workers;
+
+    void work() {
+        unique_lock<mutex> lock(mu);
+        while (true) {
+            cv.wait(lock, [this]() {
+                return stopping || next_start >= parts.size() || next_start < next_write + window;
+            });
+            if (stopping || next_start >= parts.size()) {
+                return;
+            }
+            part& pt = parts[next_start++];
+            if (pt.ready) {
+                // inline data
+                continue;
+            }
+            lock.unlock();
+
+            string data;
+            exception_ptr error;
+            vector<string> headers = pt.headers;
+            if (pt.lo >= 0) {
+                headers.push_back("Range: bytes=" + to_string(pt.lo) + "-" + to_string(pt.hi));
+            }
+            // retry transient failures a couple of times
+            for (int attempt = 1; attempt <= 3; attempt++) {
+                if (verbose) {
+                    lock.lock();
+                    cerr << "GET " << pt.url;
+                    for (const auto& h : headers) {
+                        cerr << " [" << h << "]";
+                    }
+                    cerr << endl;
+                    lock.unlock();
+                }
+                try {
+                    data = http_get(pt.url, headers, pt.lo >= 0 ? pt.hi - pt.lo + 1 : -1);
+                    error = nullptr;
+                    break;
+                } catch (...) {
+                    error = current_exception();
+                }
+                if (attempt < 3) {
+                    sleep(attempt);
+                }
+            }
+
+            lock.lock();
+            pt.data.swap(data);
+            pt.error = error;
+            pt.ready = true;
+            cv.notify_all();
+        }
+    }
+
+public:
+    parallel_fetcher(vector<part>& parts_, unsigned connections, bool verbose_)
+        : parts(parts_), window(2*connections), verbose(verbose_) {
+        for (unsigned i = 0; i < connections; i++) {
+            workers.push_back(thread([this]() { work(); }));
+        }
+    }
+
+    ~parallel_fetcher() {
+        {
+            lock_guard<mutex> lock(mu);
+            stopping = true;
+            cv.notify_all();
+        }
+        for (auto& t : workers) {
+            t.join();
+        }
+    }
+
+    // pass each part's data to output, in order, as it becomes available
+    void run(const function<void(const string&)>& output) {
+        for (size_t i = 0; i < parts.size(); i++) {
+            string data;
+            {
+                unique_lock<mutex> lock(mu);
+                cv.wait(lock, [&]() { return parts[i].ready; });
+                if (parts[i].error) {
+                    rethrow_exception(parts[i].error);
+                }
+                data.swap(parts[i].data);
+                next_write = i+1;
+                cv.notify_all();
+            }
+            output(data);
+        }
+    }
+};
+
+// Request the ticket and break it down into parts of about part_size bytes.
+// Sets format to the format given in the ticket.
+vector<part> get_ticket(const string& query_url, const vector<string>& query_headers,
+                        int64_t part_size, string& format) {
+    json_value response = json_parser(http_get(query_url, query_headers, -1)).parse();
+    const json_value* ticket = response.get("htsget");
+    const json_value* urls = ticket ? ticket->get("urls") : nullptr;
+    if (!urls || urls->kind != json_value::array_t) {
+        throw runtime_error("Unexpected response JSON format from server");
+    }
+    const json_value* fmt = ticket->get("format");
+    if (fmt && fmt->kind == json_value::string_t) {
+        format = fmt->str;
+    }
+
+    vector<part> ans;
+    for (const auto& item : urls->array) {
+        const json_value* url = item.get("url");
+        if (!url || url->kind != json_value::string_t) {
+            throw runtime_error("Unexpected response JSON format from server");
+        }
+        if (url->str.compare(0, 5, "data:") == 0) {
+            // a blob given inline, typically a format-specific header or
+            // footer/EOF when taking a genomic range slice
+            size_t comma = url->str.find(',');
+            if (comma == string::npos || url->str.rfind(";base64", comma) == string::npos) {
+                throw runtime_error("Unsupported data URI in ticket");
+            }
+            part pt;
+            pt.data = base64_decode(url->str.substr(comma+1));
+            pt.ready = true;
+            ans.push_back(pt);
+            continue;
+        }
+
+        part pt;
+        pt.url = url->str;
+        const json_value* headers = item.get("headers");
+        if (headers && headers->kind == json_value::object_t) {
+            for (const auto& kv : headers->object) {
+                if (kv.second.kind != json_value::string_t) {
+                    throw runtime_error("Unexpected response JSON format from server");
+                }
+                string name = kv.first;
+                transform(name.begin(), name.end(), name.begin(), ::tolower);
+                long long lo, hi;
+                int n = 0;
+                if (name == "range" &&
+                    sscanf(kv.second.str.c_str(), "bytes=%lld-%lld%n", &lo, &hi, &n) == 2 &&
+                    n == (int) kv.second.str.size() && lo >= 0 && hi >= lo) {
+                    // we'll formulate our own Range headers for the sub-ranges
+                    pt.lo = lo;
+                    pt.hi = hi;
+                } else {
+                    pt.headers.push_back(kv.first + ": " + kv.second.str);
+                }
+            }
+        }
+        if (pt.lo < 0) {
+            // size unknown; fetch it in one piece
+            ans.push_back(pt);
+            continue;
+        }
+
+        // divide the range evenly into sub-ranges of about part_size bytes
+        int64_t len = pt.hi - pt.lo + 1;
+        int64_t n = max((int64_t) 1, (len + part_size/2) / part_size);
+        int64_t lo0 = pt.lo;
+        for (int64_t k = 0; k < n; k++) {
+            part sub = pt;
+            sub.lo = lo0 + len*k/n;
+            sub.hi = lo0 + len*(k+1)/n - 1;
+            ans.push_back(sub);
+        }
+    }
+    return ans;
+}
+
+/*************************************************************************************************/
+
+const char* usage =
+    "htsnexus_fetch [options] <namespace> <accession> [format]\n"
+    "  namespace   accession namespace\n"
+    "  accession   accession identifier\n"
+    "  format      BAM (default), CRAM, or VCF\n"
+    "Requests the ticket for the file (or a genomic range slice) from the htsnexus\n"
+    "server, then fetches the byte ranges it lists using concurrent requests, and\n"
+    "writes the data to standard output in order.\n"
+    "Options:\n"
+    "  --server <url>    htsnexus server endpoint\n"
+    "                    (default: https://htsnexus.rnd.dnanex.us/v1/reads)\n"
+    "  --range <range>   target genomic range, seq:lo-hi or just seq\n"
+    "  --token <XXXX>    API auth token\n"
+    "  --connections <n> number of concurrent requests (default: 8)\n"
+    "  --part-size <n>   split the byte ranges into requests of about this many\n"
+    "                    bytes (default: 8MiB)\n"
+    "  --validate        check the BGZF block or CRAM container framing of the\n"
+    "                    data as it's written\n"
+    "  --verbose         log the requests to standard error\n"
+;
+
+int main(int argc, char* argv[]) {
+    static struct option long_options[] = {
+        {"help", no_argument, 0, 'h'},
+        {"server", required_argument, 0, 's'},
+        {"range", required_argument, 0, 'r'},
+        {"token", required_argument, 0, 't'},
+        {"connections", required_argument, 0, 'c'},
+        {"part-size", required_argument, 0, 'p'},
+        {"validate", no_argument, 0, 'V'},
+        {"verbose", no_argument, 0, 'v'},
+        {0, 0, 0, 0}
+    };
+
+    string server = getenv("DX_JOB_ID") ? "https://htsnexus.rnd.dnanex.us/dxjob/v1/reads"
+                                        : "https://htsnexus.rnd.dnanex.us/v1/reads";
+    string range, token;
+    int connections = 8;
+    int64_t part_size = 8388608;
+    bool validate = false, verbose = false;
+
+    int c;
+    while (-1 != (c = getopt_long(argc, argv, "hs:r:t:c:p:Vv", long_options, 0))) {
+        switch (c) {
+            case 's':
+                server = optarg;
+                break;
+            case 'r':
+                range = optarg;
+                break;
+            case 't':
+                token = optarg;
+                break;
+            case 'c':
+                connections = atoi(optarg);
+                if (connections <= 0) {
+                    cout << usage << endl;
+                    return 1;
+                }
+                break;
+            case 'p':
+                part_size = atoll(optarg);
+                if (part_size <= 0) {
+                    cout << usage << endl;
+                    return 1;
+                }
+                break;
+            case 'V':
+                validate = true;
+                break;
+            case 'v':
+                verbose = true;
+                break;
+            default:
+                cout << usage << endl;
+                return 1;
+        }
+    }
+
+    if (argc-optind != 2 && argc-optind != 3) {
+        cout << usage << endl;
+        return 1;
+    }
+    string name_space = argv[optind], accession = argv[optind+1];
+    string format = argc-optind == 3 ? argv[optind+2] : "BAM";
+    transform(format.begin(), format.end(), format.begin(), ::toupper);
+    if (format != "BAM" && format != "CRAM" && format != "VCF") {
+        cout << usage << endl;
+        return 1;
+    }
+
+    // construct the query URL, addressing /variants for VCF (as the Python
+    // client does)
+    string endpoint = server;
+    if (format == "VCF" && endpoint.size() >= 6 && endpoint.compare(endpoint.size()-6, 6, "/reads") == 0) {
+        endpoint = endpoint.substr(0, endpoint.size()-6) + "/variants";
+    }
+    string query_url = endpoint + "/" + url_quote(name_space) + "/" + url_quote(accession) + "?format=" + format;
+    if (!range.empty()) {
+        size_t colon = range.find(':');
+        query_url += "&referenceName=" + url_quote(range.substr(0, colon));
+        if (colon != string::npos) {
+            long long lo, hi;
+            int n = 0;
+            string bounds = range.substr(colon+1);
+            if (sscanf(bounds.c_str(), "%lld-%lld%n", &lo, &hi, &n) != 2 || n != (int) bounds.size()) {
+                cout << usage << endl;
+                return 1;
+            }
+            query_url += "&start=" + to_string(lo) + "&end=" + to_string(hi);
+        }
+    }
+    vector<string> query_headers;
+    if (!token.empty()) {
+        query_headers.push_back("Authorization: Bearer " + token);
+    }
+    if (verbose) {
+        cerr << "Query URL: " << query_url << endl;
+    }
+
+    vector<part> parts = get_ticket(query_url, query_headers, part_size, format);
+    unique_ptr<framing_checker> checker;
+    if (validate) {
+        checker.reset(new framing_checker(format == "CRAM"));
+    }
+
+    parallel_fetcher fetcher(parts, connections, verbose);
+    fetcher.run([&](const string& data) {
+        if (checker) {
+            checker->feed(data.data(), data.size());
+        }
+        if (fwrite(data.data(), 1, data.size(), stdout) != data.size()) {
+            throw runtime_error("writing to standard output");
+        }
+    });
+    if (checker) {
+        checker->finish();
+    }
+    if (fflush(stdout)) {
+        throw runtime_error("writing to standard output");
+    }
+
+    if (verbose) {
+        cerr << "Success" << endl;
+    }
+    return 0;
+}
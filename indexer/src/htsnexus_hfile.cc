@@ -0,0 +1,951 @@
+// Alternative hFILE backends used by the indexers to read their local input
+// files, selected by name with the --io option.
+//
+// mmap: the whole file is memory-mapped read-only, with MADV_SEQUENTIAL and
+// MADV_WILLNEED read-ahead issued well ahead of the read position. The mapping
+// is shared among all hFILEs concurrently open on the same path, so e.g. the
+// CRAM indexer's second pass over the raw header costs neither another open()
+// nor another trip to the disk. Files that can't be mapped (pipes, special
+// files) fall back to htslib's default backend.
+//
+// direct: the file is opened with O_DIRECT, bypassing the page cache, and a
+// pool of threads keeps several large aligned reads in flight ahead of the
+// read position. If the filesystem doesn't support O_DIRECT, we fall back to
+// ordinary reads followed by POSIX_FADV_DONTNEED on the consumed ranges, which
+// similarly avoids filling the page cache.
+//
+// Regardless of --io, the input filename "-" reads standard input through a
+// stream backend, which copies every byte read to the --tee file (if any) and
+// counts them, since the pipe can't be seeked or re-opened. The bytes read
+// since a given offset can be retained in memory, to be recalled by the CRAM
+// indexer in lieu of re-reading the file.
+//
+// With follow_input(pid), local input files are instead taken to be still
+// growing as process pid (e.g. a downloader) writes them, and read through a
+// follow backend: a read reaching the current end of the file waits for more
+// data until the writer exits.
+//
+// hopen_concat() reads a sequence of pieces, each some literal data followed
+// by a byte range of a local file, as if they were one file. htsnexus_verify
+// uses it to read slices assembled the way the servers' tickets describe
+// them, without copying the byte ranges into memory.
+
+#include <memory>
+#include <string>
+#include <map>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <algorithm>
+#include <stdexcept>
+#include <fstream>
+#include <tuple>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include "htslib/hfile.h"
+#include "hfile_internal.h"
+
+using namespace std;
+
+/*************************************************************************************************/
+
+// buffer capacity for the hFILEs we create
+const size_t hfile_capacity = 1048576;
+
+// read-ahead window requested from the kernel ahead of the mmap read position
+const size_t mmap_readahead = 67108864;
+
+// a read-only memory mapping of an entire local file
+struct mmap_region {
+    void* data = MAP_FAILED;
+    size_t size = 0;
+
+    ~mmap_region() {
+        if (data != MAP_FAILED) {
+            munmap(data, size);
+        }
+    }
+};
+
+// map the file, or return the live mapping if it's already open. Returns
+// null if the file can't be mapped.
+static shared_ptr<mmap_region> map_file(const char* fn) {
+    static mutex mu;
+    static map<string, weak_ptr<mmap_region>> live;
+
+    lock_guard<mutex> lock(mu);
+    auto p = live.find(fn);
+    if (p != live.end()) {
+        auto region = p->second.lock();
+        if (region) {
+            return region;
+        }
+    }
+
+    int fd = open(fn, O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        close(fd);
+        return nullptr;
+    }
+
+    shared_ptr<mmap_region> region(new mmap_region);
+    region->size = st.st_size;
+    region->data = mmap(0, region->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (region->data == MAP_FAILED) {
+        return nullptr;
+    }
+    madvise(region->data, region->size, MADV_SEQUENTIAL);
+
+    live[fn] = region;
+    return region;
+}
+
+struct hFILE_mmap {
+    hFILE base;
+    shared_ptr<mmap_region>* region;
+    size_t pos;
+    // offset through which MADV_WILLNEED has been issued
+    size_t readahead;
+};
+
+static ssize_t mmap_read(hFILE* fpv, void* buffer, size_t nbytes) {
+    hFILE_mmap* fp = (hFILE_mmap*) fpv;
+    const mmap_region& region = **fp->region;
+    if (fp->pos >= region.size) {
+        return 0;
+    }
+    size_t n = min(nbytes, region.size - fp->pos);
+
+    if (fp->pos + n + mmap_readahead/2 > fp->readahead) {
+        // keep the kernel read-ahead window well in front of us
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t lo = (max(fp->pos, fp->readahead) / page) * page;
+        size_t hi = min(region.size, fp->pos + n + mmap_readahead);
+        if (hi > lo) {
+            madvise((char*) region.data + lo, hi - lo, MADV_WILLNEED);
+        }
+        fp->readahead = hi;
+    }
+
+    memcpy(buffer, (const char*) region.data + fp->pos, n);
+    fp->pos += n;
+    return n;
+}
+
+static off_t mmap_seek(hFILE* fpv, off_t offset, int whence) {
+    hFILE_mmap* fp = (hFILE_mmap*) fpv;
+    off_t base;
+    switch (whence) {
+        case SEEK_SET: base = 0; break;
+        case SEEK_CUR: base = fp->pos; break;
+        case SEEK_END: base = (*fp->region)->size; break;
+        default:
+            errno = EINVAL;
+            return -1;
+    }
+    if (base + offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    fp->pos = base + offset;
+    // restart the read-ahead window from the new position
+    fp->readahead = fp->pos;
+    return fp->pos;
+}
+
+static int mmap_close(hFILE* fpv) {
+    hFILE_mmap* fp = (hFILE_mmap*) fpv;
+    delete fp->region;
+    fp->region = nullptr;
+    return 0;
+}
+
+static const struct hFILE_backend mmap_backend = {
+    mmap_read, nullptr, mmap_seek, nullptr, mmap_close
+};
+
+// open a memory-mapped hFILE for reading, or return null
+static hFILE* hopen_mmap(const char* fn) {
+    auto region = map_file(fn);
+    if (!region) {
+        return nullptr;
+    }
+    hFILE_mmap* fp = (hFILE_mmap*) hfile_init(sizeof(hFILE_mmap), "r", hfile_capacity);
+    if (!fp) {
+        return nullptr;
+    }
+    fp->region = new shared_ptr<mmap_region>(region);
+    fp->pos = 0;
+    fp->readahead = 0;
+    fp->base.backend = &mmap_backend;
+    return &fp->base;
+}
+
+/*************************************************************************************************/
+
+// alignment, size and number of the reads kept in flight by direct_reader
+const size_t direct_align = 4096;
+const size_t direct_chunk = 4194304;
+const unsigned direct_depth = 8;
+
+// Reads a local file in direct_chunk-sized pieces, keeping up to direct_depth
+// of them in flight ahead of the read position on a pool of worker threads.
+// Each slot's buffer holds one chunk; the slots are consumed round-robin, and
+// each consumed slot is immediately re-queued for the chunk direct_depth
+// positions ahead.
+class direct_reader {
+    struct slot {
+        void* buf = nullptr;
+        off_t offset = 0;
+        ssize_t len = 0;
+        int err = 0;
+        bool ready = false;
+    };
+
+    string fn;
+    int fd = -1;
+    bool direct = false;
+    off_t size = 0;
+
+    mutex mu;
+    condition_variable cv;
+    vector<slot> slots;
+    deque<unsigned> queue;
+    unsigned in_flight = 0;
+    bool stopping = false;
+    vector<thread> workers;
+
+    // logical read position; whether the slots must be refilled from it
+    // before the next read; the slot holding the chunk at pos; and the offset
+    // of the next chunk to be scheduled
+    off_t pos = 0;
+    bool restart_needed = true;
+    unsigned head = 0;
+    off_t next_offset = 0;
+
+    void work() {
+        unique_lock<mutex> lock(mu);
+        while (true) {
+            cv.wait(lock, [this]() { return stopping || !queue.empty(); });
+            if (stopping) {
+                return;
+            }
+            unsigned i = queue.front();
+            queue.pop_front();
+            void* buf = slots[i].buf;
+            off_t offset = slots[i].offset;
+            int rfd = fd;
+            lock.unlock();
+
+            // fill the chunk, retrying short reads until the end of the
+            // file (beyond which an O_DIRECT read would be misaligned)
+            ssize_t len = 0;
+            int err = 0;
+            while (len < (ssize_t) direct_chunk && offset + len < size) {
+                ssize_t n = pread(rfd, (char*) buf + len, direct_chunk - len, offset + len);
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n < 0) {
+                    err = errno;
+                    break;
+                }
+                if (n == 0) {
+                    break;
+                }
+                len += n;
+            }
+
+            lock.lock();
+            slots[i].len = len;
+            slots[i].err = err;
+            slots[i].ready = true;
+            in_flight--;
+            cv.notify_all();
+        }
+    }
+
+    // (with mu held) queue a read of the chunk at offset into slot i
+    void schedule(unsigned i, off_t offset) {
+        slots[i].offset = offset;
+        slots[i].len = 0;
+        slots[i].err = 0;
+        slots[i].ready = false;
+        if (offset < size) {
+            queue.push_back(i);
+            in_flight++;
+            cv.notify_all();
+        } else {
+            // beyond EOF; nothing to read
+            slots[i].ready = true;
+        }
+    }
+
+    // (with mu held) discard all the slots and refill them starting at pos
+    void restart(unique_lock<mutex>& lock) {
+        in_flight -= queue.size();
+        queue.clear();
+        cv.wait(lock, [this]() { return in_flight == 0; });
+        off_t offset = pos - pos % direct_align;
+        for (unsigned i = 0; i < slots.size(); i++) {
+            schedule(i, offset);
+            offset += direct_chunk;
+        }
+        head = 0;
+        next_offset = offset;
+        restart_needed = false;
+    }
+
+    // (with mu held) reopen the file without O_DIRECT
+    bool reopen_buffered(unique_lock<mutex>& lock) {
+        in_flight -= queue.size();
+        queue.clear();
+        cv.wait(lock, [this]() { return in_flight == 0; });
+        int fd2 = open(fn.c_str(), O_RDONLY);
+        if (fd2 < 0) {
+            return false;
+        }
+        close(fd);
+        fd = fd2;
+        direct = false;
+        restart_needed = true;
+        return true;
+    }
+
+    // stop the workers and free the buffers
+    void shutdown() {
+        {
+            lock_guard<mutex> lock(mu);
+            stopping = true;
+            cv.notify_all();
+        }
+        for (auto& t : workers) {
+            t.join();
+        }
+        workers.clear();
+        for (auto& s : slots) {
+            free(s.buf);
+            s.buf = nullptr;
+        }
+    }
+
+public:
+    // takes ownership of fd, unless this throws
+    direct_reader(const char* fn_, int fd_, bool direct_, off_t size_)
+        : fn(fn_), fd(fd_), direct(direct_), size(size_), slots(direct_depth) {
+        try {
+            for (auto& s : slots) {
+                if (posix_memalign(&s.buf, direct_align, direct_chunk)) {
+                    s.buf = nullptr;
+                    throw bad_alloc();
+                }
+            }
+            for (unsigned i = 0; i < direct_depth; i++) {
+                workers.push_back(thread([this]() { work(); }));
+            }
+        } catch (...) {
+            shutdown();
+            throw;
+        }
+    }
+
+    ~direct_reader() {
+        shutdown();
+        close(fd);
+    }
+
+    ssize_t read(void* buffer, size_t nbytes) {
+        unique_lock<mutex> lock(mu);
+        while (true) {
+            if (pos >= size) {
+                return 0;
+            }
+            if (restart_needed) {
+                restart(lock);
+            }
+            slot& s = slots[head];
+            cv.wait(lock, [&s]() { return s.ready; });
+            if (s.err) {
+                if (s.err == EINVAL && direct && reopen_buffered(lock)) {
+                    // the filesystem accepted O_DIRECT at open() but not
+                    // for our reads; carry on without it
+                    continue;
+                }
+                errno = s.err;
+                return -1;
+            }
+
+            off_t within = pos - s.offset;
+            if (s.len <= within) {
+                // file ended early (truncated since we opened it?)
+                return 0;
+            }
+            size_t n = min(nbytes, size_t(s.len - within));
+            memcpy(buffer, (const char*) s.buf + within, n);
+            pos += n;
+
+            if (pos >= s.offset + (off_t) direct_chunk) {
+                // done with this chunk; reuse the slot for the next one
+                if (!direct) {
+                    posix_fadvise(fd, s.offset, direct_chunk, POSIX_FADV_DONTNEED);
+                }
+                schedule(head, next_offset);
+                next_offset += direct_chunk;
+                head = (head + 1) % slots.size();
+            }
+            return n;
+        }
+    }
+
+    off_t seek(off_t offset, int whence) {
+        lock_guard<mutex> lock(mu);
+        off_t base;
+        switch (whence) {
+            case SEEK_SET: base = 0; break;
+            case SEEK_CUR: base = pos; break;
+            case SEEK_END: base = size; break;
+            default:
+                errno = EINVAL;
+                return -1;
+        }
+        if (base + offset < 0) {
+            errno = EINVAL;
+            return -1;
+        }
+        if (base + offset != pos) {
+            pos = base + offset;
+            // refill lazily, in case of another seek before the next read
+            restart_needed = true;
+        }
+        return pos;
+    }
+};
+
+struct hFILE_direct {
+    hFILE base;
+    direct_reader* reader;
+};
+
+static ssize_t direct_read(hFILE* fpv, void* buffer, size_t nbytes) {
+    return ((hFILE_direct*) fpv)->reader->read(buffer, nbytes);
+}
+
+static off_t direct_seek(hFILE* fpv, off_t offset, int whence) {
+    return ((hFILE_direct*) fpv)->reader->seek(offset, whence);
+}
+
+static int direct_close(hFILE* fpv) {
+    hFILE_direct* fp = (hFILE_direct*) fpv;
+    delete fp->reader;
+    fp->reader = nullptr;
+    return 0;
+}
+
+static const struct hFILE_backend direct_backend = {
+    direct_read, nullptr, direct_seek, nullptr, direct_close
+};
+
+// open an hFILE reading with O_DIRECT (or, failing that, with
+// POSIX_FADV_DONTNEED), or return null if the file isn't a regular file
+static hFILE* hopen_direct(const char* fn) {
+    bool direct = true;
+    int fd = open(fn, O_RDONLY | O_DIRECT);
+    if (fd < 0 && errno == EINVAL) {
+        // filesystem doesn't support O_DIRECT (e.g. tmpfs)
+        direct = false;
+        fd = open(fn, O_RDONLY);
+    }
+    if (fd < 0) {
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return nullptr;
+    }
+    if (!direct) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+
+    hFILE_direct* fp = (hFILE_direct*) hfile_init(sizeof(hFILE_direct), "r", hfile_capacity);
+    if (!fp) {
+        close(fd);
+        return nullptr;
+    }
+    try {
+        fp->reader = new direct_reader(fn, fd, direct, st.st_size);
+    } catch (exception&) {
+        // out of memory or threads; let the default backend have a go
+        hfile_destroy(&fp->base);
+        close(fd);
+        return nullptr;
+    }
+    fp->base.backend = &direct_backend;
+    return &fp->base;
+}
+
+/*************************************************************************************************/
+
+// standard input, as read through the stream backend. There's only one, so
+// this state is static; it outlives the hFILE in order to report the total
+// size once the pipe has been closed.
+static struct {
+    string tee_fn;
+    int tee_fd = -1;
+    bool opened = false, closed = false;
+    // total bytes read from the pipe
+    int64_t total = 0;
+    // bytes retained since offset kept_lo (if nonnegative)
+    int64_t kept_lo = -1;
+    string kept;
+} stdin_stream;
+
+struct hFILE_stream {
+    hFILE base;
+};
+
+// account for n bytes just read from standard input, copying them to the tee
+// file. Returns false with errno set if the copy fails.
+static bool stream_consume(const void* buffer, size_t n) {
+    auto& s = stdin_stream;
+    for (size_t ofs = 0; s.tee_fd >= 0 && ofs < n; ) {
+        ssize_t w = write(s.tee_fd, (const char*) buffer + ofs, n - ofs);
+        if (w < 0 && errno != EINTR) {
+            return false;
+        }
+        ofs += max(w, ssize_t(0));
+    }
+    if (s.kept_lo >= 0) {
+        s.kept.append((const char*) buffer, n);
+    }
+    s.total += n;
+    return true;
+}
+
+static ssize_t stream_read(hFILE* fpv, void* buffer, size_t nbytes) {
+    ssize_t n;
+    do {
+        n = read(STDIN_FILENO, buffer, nbytes);
+    } while (n < 0 && errno == EINTR);
+    if (n > 0 && !stream_consume(buffer, n)) {
+        return -1;
+    }
+    return n;
+}
+
+static off_t stream_seek(hFILE* fpv, off_t offset, int whence) {
+    // htslib copes with this, e.g. by skipping the BGZF EOF marker check
+    errno = ESPIPE;
+    return -1;
+}
+
+static int stream_close(hFILE* fpv) {
+    // read any remainder of the input the indexer didn't need, so that the
+    // tee file is complete and we know the total size
+    auto& s = stdin_stream;
+    s.kept_lo = -1;
+    s.kept.clear();
+    const size_t bufsize = 1048576;
+    shared_ptr<void> buf(malloc(bufsize), &free);
+    int ans = 0;
+    ssize_t n;
+    while ((n = stream_read(fpv, buf.get(), bufsize)) > 0);
+    if (n < 0) {
+        ans = -1;
+    }
+    if (s.tee_fd >= 0 && close(s.tee_fd) != 0) {
+        ans = -1;
+    }
+    s.tee_fd = -1;
+    s.closed = true;
+    return ans;
+}
+
+static const struct hFILE_backend stream_backend = {
+    stream_read, nullptr, stream_seek, nullptr, stream_close
+};
+
+// open an hFILE reading standard input through the stream backend. It can be
+// opened only once.
+static hFILE* hopen_stdin() {
+    auto& s = stdin_stream;
+    if (s.opened) {
+        throw runtime_error("standard input can be read only once");
+    }
+    if (!s.tee_fn.empty()) {
+        s.tee_fd = open(s.tee_fn.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (s.tee_fd < 0) {
+            throw runtime_error("opening " + s.tee_fn);
+        }
+    }
+    hFILE_stream* fp = (hFILE_stream*) hfile_init(sizeof(hFILE_stream), "r", hfile_capacity);
+    if (!fp) {
+        if (s.tee_fd >= 0) {
+            int save_errno = errno;
+            close(s.tee_fd);
+            s.tee_fd = -1;
+            errno = save_errno;
+        }
+        return nullptr;
+    }
+    fp->base.backend = &stream_backend;
+    s.opened = true;
+    return &fp->base;
+}
+
+// copy everything subsequently read from standard input to the named file
+void tee_stdin(const string& fn) {
+    stdin_stream.tee_fn = fn;
+}
+
+// Read standard input through to the end, if it hasn't already been, and
+// return its total size.
+int64_t finish_stdin() {
+    auto& s = stdin_stream;
+    if (!s.opened && hclose(hopen_stdin()) != 0) {
+        throw runtime_error("reading standard input" + (s.tee_fn.empty() ? string() : " or writing " + s.tee_fn));
+    }
+    if (!s.closed) {
+        throw runtime_error("Unexpected: standard input still open");
+    }
+    return s.total;
+}
+
+// Start (or continue) retaining the bytes read from the stream hFILE fp from
+// the given offset on, discarding any retained before it.
+void hstream_retain(hFILE* fp, int64_t offset) {
+    if (fp->backend != &stream_backend) {
+        throw runtime_error("Unexpected: not a stream hFILE");
+    }
+    auto& s = stdin_stream;
+    if (s.kept_lo < 0) {
+        s.kept_lo = s.total;
+    }
+    if (offset > s.kept_lo) {
+        int64_t drop = min(offset, s.total) - s.kept_lo;
+        s.kept.erase(0, drop);
+        s.kept_lo += drop;
+    }
+}
+
+// Copy n retained bytes from the given offset into buffer, returning false if
+// they aren't all retained (they must already have passed through fp's buffer).
+bool hstream_recall(hFILE* fp, int64_t offset, void* buffer, size_t n) {
+    if (fp->backend != &stream_backend) {
+        throw runtime_error("Unexpected: not a stream hFILE");
+    }
+    const auto& s = stdin_stream;
+    if (s.kept_lo < 0 || offset < s.kept_lo || offset + (int64_t) n > s.total) {
+        return false;
+    }
+    memcpy(buffer, s.kept.data() + (offset - s.kept_lo), n);
+    return true;
+}
+
+/*************************************************************************************************/
+
+// how long the follow backend waits for a growing file to grow before giving
+// up, and the bounds of its polling interval
+const time_t follow_timeout = 600;
+const useconds_t follow_poll_min = 10000;
+const useconds_t follow_poll_max = 1000000;
+
+// the process writing the local input file, or 0 if it's complete
+static pid_t follow_pid = 0;
+
+// whether the process is still running; a zombie, which has exited but not
+// yet been reaped by its parent, doesn't count
+static bool process_running(pid_t pid) {
+    if (kill(pid, 0) != 0 && errno == ESRCH) {
+        return false;
+    }
+    ifstream stat("/proc/" + to_string(pid) + "/stat");
+    string line;
+    if (getline(stat, line)) {
+        auto p = line.rfind(')');
+        if (p != string::npos && p+2 < line.size() && line[p+2] == 'Z') {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Repeatedly call attempt() until it returns true, or the writer has exited,
+// or follow_timeout elapses, polling with exponential backoff. attempt() is
+// told whether the writer was still running beforehand, so that if not, it
+// sees everything the writer wrote. Returns false with errno = ETIMEDOUT on
+// timeout.
+template<typename F>
+static bool follow_poll(F attempt) {
+    time_t t0 = time(nullptr);
+    useconds_t delay = follow_poll_min;
+    while (true) {
+        bool writing = process_running(follow_pid);
+        if (attempt(writing) || !writing) {
+            return true;
+        }
+        if (time(nullptr) - t0 >= follow_timeout) {
+            errno = ETIMEDOUT;
+            return false;
+        }
+        usleep(delay);
+        delay = min(delay*2, follow_poll_max);
+    }
+}
+
+struct hFILE_follow {
+    hFILE base;
+    int fd;
+    off_t pos;
+};
+
+static ssize_t follow_read(hFILE* fpv, void* buffer, size_t nbytes) {
+    hFILE_follow* fp = (hFILE_follow*) fpv;
+    ssize_t n = 0;
+    bool ok = follow_poll([&](bool writing) {
+        do {
+            n = pread(fp->fd, buffer, nbytes, fp->pos);
+        } while (n < 0 && errno == EINTR);
+        // done unless we're at the current end of the file
+        return n != 0 || !writing;
+    });
+    if (!ok) {
+        return -1;
+    }
+    if (n > 0) {
+        fp->pos += n;
+    }
+    return n;
+}
+
+static off_t follow_seek(hFILE* fpv, off_t offset, int whence) {
+    hFILE_follow* fp = (hFILE_follow*) fpv;
+    off_t base;
+    switch (whence) {
+        case SEEK_SET: base = 0; break;
+        case SEEK_CUR: base = fp->pos; break;
+        case SEEK_END:
+            // the end isn't known yet; htslib copes with this, e.g. by
+            // skipping the BGZF EOF marker check
+            errno = ESPIPE;
+            return -1;
+        default:
+            errno = EINVAL;
+            return -1;
+    }
+    if (base + offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    // a subsequent read beyond the current end of the file will wait for it
+    fp->pos = base + offset;
+    return fp->pos;
+}
+
+static int follow_close(hFILE* fpv) {
+    hFILE_follow* fp = (hFILE_follow*) fpv;
+    return close(fp->fd);
+}
+
+static const struct hFILE_backend follow_backend = {
+    follow_read, nullptr, follow_seek, nullptr, follow_close
+};
+
+// open an hFILE reading the growing file, waiting for it to be created if
+// necessary. Returns null with errno set on failure.
+static hFILE* hopen_follow(const char* fn) {
+    int fd = -1;
+    bool ok = follow_poll([&](bool writing) {
+        fd = open(fn, O_RDONLY);
+        return fd >= 0 || errno != ENOENT;
+    });
+    if (!ok || fd < 0) {
+        return nullptr;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    hFILE_follow* fp = (hFILE_follow*) hfile_init(sizeof(hFILE_follow), "r", hfile_capacity);
+    if (!fp) {
+        close(fd);
+        return nullptr;
+    }
+    fp->fd = fd;
+    fp->pos = 0;
+    fp->base.backend = &follow_backend;
+    return &fp->base;
+}
+
+// read local input files as they're being written by process pid
+void follow_input(pid_t pid) {
+    follow_pid = pid;
+}
+
+// Wait for the writer of the followed file to exit, and return the file's
+// final size.
+int64_t finish_follow(const char* fn) {
+    int64_t size = -1;
+    bool writing = true;
+    while (writing) {
+        // wait for the file to grow or the writer to exit
+        bool ok = follow_poll([&](bool w) {
+            struct stat st;
+            if (stat(fn, &st) != 0) {
+                throw runtime_error(string("couldn't stat ") + fn);
+            }
+            writing = w;
+            bool grew = st.st_size != size;
+            size = st.st_size;
+            return grew;
+        });
+        if (!ok) {
+            throw runtime_error(string("timed out waiting for ") + fn + " to be completed");
+        }
+    }
+    return size;
+}
+
+/*************************************************************************************************/
+
+struct hFILE_concat {
+    hFILE base;
+    int fd;
+    // (literal data, file byteLo, file byteHi) of each piece
+    vector<tuple<string,int64_t,int64_t>>* pieces;
+    // offset of each piece in the concatenation, and the total size
+    vector<int64_t>* offsets;
+    int64_t size;
+    int64_t pos;
+};
+
+static ssize_t concat_read(hFILE* fpv, void* buffer, size_t nbytes) {
+    hFILE_concat* fp = (hFILE_concat*) fpv;
+    if (fp->pos >= fp->size || nbytes == 0) {
+        return 0;
+    }
+    // find the piece holding pos, and read from it only
+    size_t i = upper_bound(fp->offsets->begin(), fp->offsets->end(), fp->pos) - fp->offsets->begin() - 1;
+    const auto& piece = (*fp->pieces)[i];
+    int64_t within = fp->pos - (*fp->offsets)[i];
+    int64_t literal = get<0>(piece).size();
+    ssize_t n;
+    if (within < literal) {
+        n = min(int64_t(nbytes), literal - within);
+        memcpy(buffer, get<0>(piece).data() + within, n);
+    } else {
+        int64_t ofs = get<1>(piece) + within - literal;
+        do {
+            n = pread(fp->fd, buffer, min(int64_t(nbytes), get<2>(piece) - ofs), ofs);
+        } while (n < 0 && errno == EINTR);
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            // the local file is shorter than the index says
+            errno = EIO;
+            return -1;
+        }
+    }
+    fp->pos += n;
+    return n;
+}
+
+static off_t concat_seek(hFILE* fpv, off_t offset, int whence) {
+    hFILE_concat* fp = (hFILE_concat*) fpv;
+    off_t base;
+    switch (whence) {
+        case SEEK_SET: base = 0; break;
+        case SEEK_CUR: base = fp->pos; break;
+        case SEEK_END: base = fp->size; break;
+        default:
+            errno = EINVAL;
+            return -1;
+    }
+    if (base + offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    fp->pos = base + offset;
+    return fp->pos;
+}
+
+static int concat_close(hFILE* fpv) {
+    hFILE_concat* fp = (hFILE_concat*) fpv;
+    delete fp->pieces;
+    delete fp->offsets;
+    return close(fp->fd);
+}
+
+static const struct hFILE_backend concat_backend = {
+    concat_read, nullptr, concat_seek, nullptr, concat_close
+};
+
+// Open an hFILE reading the concatenation of the given pieces, each the
+// literal data followed by the byte range [byteLo,byteHi) of the local file
+// fn. Returns null with errno set on failure.
+hFILE* hopen_concat(const char* fn, const vector<tuple<string,int64_t,int64_t>>& pieces) {
+    int fd = open(fn, O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+    hFILE_concat* fp = (hFILE_concat*) hfile_init(sizeof(hFILE_concat), "r", hfile_capacity);
+    if (!fp) {
+        close(fd);
+        return nullptr;
+    }
+    fp->fd = fd;
+    fp->pieces = new vector<tuple<string,int64_t,int64_t>>();
+    fp->offsets = new vector<int64_t>();
+    fp->size = 0;
+    for (const auto& piece : pieces) {
+        int64_t len = get<0>(piece).size() + max(get<2>(piece) - get<1>(piece), int64_t(0));
+        if (len > 0) {
+            fp->pieces->push_back(make_tuple(get<0>(piece), get<1>(piece), max(get<1>(piece), get<2>(piece))));
+            fp->offsets->push_back(fp->size);
+            fp->size += len;
+        }
+    }
+    fp->pos = 0;
+    fp->base.backend = &concat_backend;
+    return &fp->base;
+}
+
+/*************************************************************************************************/
+
+// open a local input file for reading using the named backend: "hfile"
+// (htslib's default), "mmap", or "direct"; or, if fn is "-", standard input
+// through the stream backend; or, if following a writer, the follow backend.
+// Returns null with errno set on failure.
+hFILE* hopen_input(const char* fn, const string& backend) {
+    if (string(fn) == "-") {
+        return hopen_stdin();
+    }
+    if (follow_pid) {
+        return hopen_follow(fn);
+    }
+    if (backend == "mmap" || backend == "direct") {
+        hFILE* fp = backend == "mmap" ? hopen_mmap(fn) : hopen_direct(fn);
+        if (fp) {
+            return fp;
+        }
+        // not a suitable regular file; fall back to the default backend
+        // (which will report any error opening the file)
+    } else if (backend != "hfile") {
+        throw runtime_error("unknown --io backend: " + backend);
+    }
+    return hopen(fn, "r");
+}
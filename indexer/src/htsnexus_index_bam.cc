@@ -25,24 +25,45 @@ using namespace std;
 // htsnexus_index_util.cc prototypes
 shared_ptr<sqlite3> open_database(const char* db);
 string derive_dbid(const char* name_space, const char* accession, const char* format, const char* fn, const char* url);
-void insert_htsfile(sqlite3* dbh, const char* dbid, const char* format, const char* name_space,
-                    const char* accession, const char* url, ssize_t file_size);
-
-void insert_block_index_meta(sqlite3* dbh, const char* reference, const char* dbid,
+int64_t insert_htsfile(sqlite3* dbh, const char* dbid, const char* format, const char* name_space,
+                       const char* accession, const char* url, ssize_t file_size);
+void update_htsfile_size(sqlite3* dbh, int64_t file_id, int64_t file_size);
+int64_t find_append_file(sqlite3* dbh, const string& dbid);
+int64_t find_append_offset(sqlite3* dbh, int64_t file_id, const char* reference, const string& header);
+void check_append_order(sqlite3* dbh, int64_t file_id, int64_t offset);
+
+void insert_block_index_meta(sqlite3* dbh, const char* reference, int64_t file_id,
                              const string& header, const string& prefix, const string& suffix);
+void insert_seqs(sqlite3* dbh, int64_t file_id, const vector<string>& names, const vector<int64_t>& lengths);
 shared_ptr<sqlite3_stmt> prepare_insert_block(sqlite3* dbh);
-void insert_block_index_entry(sqlite3_stmt* insert_block_stmt, const char* dbid,
+void insert_block_index_entry(sqlite3_stmt* insert_block_stmt, int64_t file_id,
                               const vector<string>& target_names,
                               int64_t block_lo, int64_t block_hi,
                               int tid, int seq_lo, int seq_hi,
                               const string& prefix, const string& suffix);
+unsigned insert_chunks(sqlite3* dbh, int64_t file_id, int64_t chunk_size);
+void insert_blocks_summary(sqlite3* dbh, int64_t file_id);
+shared_ptr<sqlite3_stmt> prepare_insert_coverage(sqlite3* dbh);
+void insert_coverage_entry(sqlite3_stmt* insert_coverage_stmt, int64_t file_id, int tid,
+                           int64_t bin_lo, int64_t bin_hi, int64_t reads, int64_t bases, int64_t bytes);
 string bgzf_eof();
 
+// htsnexus_hfile.cc prototypes
+hFILE* hopen_input(const char* fn, const string& backend);
+void tee_stdin(const string& fn);
+int64_t finish_stdin();
+void follow_input(pid_t pid);
+int64_t finish_follow(const char* fn);
+
+// htsnexus_deflate.cc prototypes
+int bgzf_max_level();
+string bgzf_compress(const string& data, int level);
+
 /*************************************************************************************************/
 
 // Serialize the BAM header to a BGZF fragment, to which additional BGZF
 // blocks containing alignments can be appended. Here be an ugly hack...
-string generate_bam_header_bgzf(const bam_hdr_t* header) {
+string generate_bam_header_bgzf(const bam_hdr_t* header, int level) {
     // open a temp file (descriptor)
     char tmpfn[16];
     strcpy(tmpfn, "/tmp/XXXXXX.bam");
@@ -51,8 +72,8 @@ string generate_bam_header_bgzf(const bam_hdr_t* header) {
         throw runtime_error(string("creating temp file") + tmpfn);
     }
 
-    // attach BGZF and write out the BAM header
-    BGZF* tmpbgzf = bgzf_dopen(tmpfd, "w");
+    // attach BGZF and write out the BAM header, uncompressed
+    BGZF* tmpbgzf = bgzf_dopen(tmpfd, "wu");
     if (!tmpbgzf) {
         close(tmpfd);
         throw runtime_error("opening temp BGZF");
@@ -85,21 +106,124 @@ string generate_bam_header_bgzf(const bam_hdr_t* header) {
     unlink(tmpfn);
 
     // sanity-check the temp BAM file
-    if (len <= 28 ||
-        memcmp((unsigned char*)buf.get(), "\x1F\x8B", 2) ||
-        memcmp((unsigned char*)buf.get() + len - 28, "\037\213\010\4\0\0\0\0\0\377\6\0\102\103\2\0\033\0\3\0\0\0\0\0\0\0\0\0", 28)) {
-        throw runtime_error("incomplete temp BAM file");
+    if (len <= 4 || memcmp((unsigned char*)buf.get(), "BAM\1", 4)) {
+        throw runtime_error("ill-formed temp BAM file");
     }
 
-    // return the header without the EOF marker
-    return string((char*) buf.get(), len - 28);
+    // compress the header into BGZF block(s)
+    return bgzf_compress(string((char*) buf.get(), len), level);
 }
 
-// populate the block-level index for the BAM file (htsfiles_blocks_meta and htsfiles_blocks)
-unsigned bam_block_index(sqlite3* dbh, const char* reference, const char* dbid, const char* bamfile) {
+// Accumulates per-sequence coverage histograms at a fixed genomic bin size as
+// bam_block_index scans the records. For each bin we count the reads starting
+// in it, the aligned bases falling in it, and the compressed bytes attributable
+// to it (each BGZF block's size is apportioned among the bins in which its
+// records start).
+class coverage_histogram {
+    struct bin {
+        int64_t reads = 0, bases = 0, bytes = 0;
+    };
+    int64_t bin_size;
+    vector<int64_t> target_lens;
+    vector<vector<bin>> bins;
+    // runs of (tid, bin, record count) for the records starting in the
+    // 'current' BGZF block
+    vector<tuple<int,int64_t,int64_t>> block_starts;
+    int64_t block_records = 0;
+
+    bin& at(int tid, int64_t b) {
+        auto& v = bins.at(tid);
+        if (b >= (int64_t)v.size()) {
+            v.resize(b+1);
+        }
+        return v[b];
+    }
+
+public:
+    coverage_histogram(int64_t bin_size_, const bam_hdr_t* header)
+        : bin_size(bin_size_), bins(header->n_targets) {
+        if (bin_size <= 0) {
+            throw runtime_error("invalid coverage bin size");
+        }
+        // the bins are allocated as records fall in them, so that a small bin
+        // size costs memory only over the extent of the reads
+        for (int i = 0; i < header->n_targets; i++) {
+            target_lens.push_back(header->target_len[i]);
+        }
+    }
+
+    // account for one placed record
+    void add_record(const bam1_t* record) {
+        int tid = record->core.tid;
+        int64_t pos = record->core.pos, end = bam_endpos(record);
+        int64_t b = pos / bin_size;
+        at(tid, b).reads++;
+        if (!(record->core.flag & BAM_FUNMAP)) {
+            for (int64_t b2 = b; b2*bin_size < end; b2++) {
+                at(tid, b2).bases += min(end, (b2+1)*bin_size) - max(pos, b2*bin_size);
+            }
+        }
+
+        if (!block_starts.empty() && get<0>(block_starts.back()) == tid &&
+            get<1>(block_starts.back()) == b) {
+            get<2>(block_starts.back())++;
+        } else {
+            block_starts.push_back(make_tuple(tid, b, 1));
+        }
+        block_records++;
+    }
+
+    // apportion the compressed size of the BGZF block just completed among
+    // the bins in which its records started
+    void end_block(int64_t block_bytes) {
+        int64_t cum_records = 0, cum_bytes = 0;
+        for (const auto& r : block_starts) {
+            cum_records += get<2>(r);
+            int64_t bytes = block_bytes * cum_records / block_records - cum_bytes;
+            at(get<0>(r), get<1>(r)).bytes += bytes;
+            cum_bytes += bytes;
+        }
+        block_starts.clear();
+        block_records = 0;
+    }
+
+    // insert the nonempty bins into htsfiles_coverage
+    unsigned insert(sqlite3* dbh, int64_t file_id) {
+        auto insert_coverage_stmt = prepare_insert_coverage(dbh);
+        unsigned count = 0;
+        for (size_t tid = 0; tid < bins.size(); tid++) {
+            for (size_t b = 0; b < bins[tid].size(); b++) {
+                const bin& bn = bins[tid][b];
+                if (bn.reads || bn.bases || bn.bytes) {
+                    int64_t bin_lo = b*bin_size, bin_hi = (b+1)*bin_size;
+                    if (target_lens[tid] > bin_lo) {
+                        bin_hi = min(bin_hi, target_lens[tid]);
+                    }
+                    insert_coverage_entry(insert_coverage_stmt.get(), file_id, tid,
+                                          bin_lo, bin_hi, bn.reads, bn.bases, bn.bytes);
+                    count++;
+                }
+            }
+        }
+        return count;
+    }
+};
+
+// populate the block-level index for the BAM file (htsfiles_blocks_meta and
+// htsfiles_blocks). If coverage_bin_size is positive, also populate
+// htsfiles_coverage with histograms at that bin size. If append is set, the
+// file is already indexed, and we resume scanning after the last indexed block.
+// The header fragment is compressed at the given level.
+unsigned bam_block_index(sqlite3* dbh, const char* reference, int64_t file_id, const char* bamfile,
+                         int coverage_bin_size, const string& io, bool append, int level) {
     // open the BGZF file
-    BGZF* _bgzf = bgzf_open(bamfile, "r");
+    hFILE* hf = hopen_input(bamfile, io);
+    if (!hf) {
+        throw runtime_error("opening " + string(bamfile));
+    }
+    BGZF* _bgzf = bgzf_hopen(hf, "r");
     if (!_bgzf) {
+        hclose(hf);
         throw runtime_error("opening " + string(bamfile));
     }
     shared_ptr<BGZF> bgzf(_bgzf, [](BGZF* f) { bgzf_close(f); });
@@ -116,15 +240,30 @@ unsigned bam_block_index(sqlite3* dbh, const char* reference, const char* dbid,
     }
 
     vector<string> target_names;
+    vector<int64_t> target_lens;
     for (int i = 0; i < header->n_targets; i++) {
         target_names.push_back(string(header->target_name[i]));
+        target_lens.push_back(header->target_len[i]);
     }
 
-    string bam_header_bgzf = generate_bam_header_bgzf(header.get());
+    unique_ptr<coverage_histogram> coverage;
+    if (coverage_bin_size > 0) {
+        coverage.reset(new coverage_histogram(coverage_bin_size, header.get()));
+    }
 
-    // insert the htsfiles_blocks_meta entry
-    insert_block_index_meta(dbh, reference, dbid, string(header->text, header->l_text),
-                            bam_header_bgzf, bgzf_eof());
+    int64_t resume = 0;
+    if (append) {
+        // skip the blocks already indexed
+        resume = find_append_offset(dbh, file_id, reference, string(header->text, header->l_text));
+        if (resume > 0 && bgzf_seek(bgzf.get(), resume << 16, SEEK_SET) < 0) {
+            throw runtime_error("Error seeking to BGZF block at byte offset " + to_string(resume));
+        }
+    } else {
+        // insert the htsfiles_blocks_meta entry
+        insert_block_index_meta(dbh, reference, file_id, string(header->text, header->l_text),
+                                generate_bam_header_bgzf(header.get(), level), bgzf_eof());
+        insert_seqs(dbh, file_id, target_names, target_lens);
+    }
 
     // Now scan the BAM file to populate the block index. This is a bit
     // complicated because we're bookkeeping on two interleaved structures:
@@ -168,6 +307,9 @@ unsigned bam_block_index(sqlite3* dbh, const char* reference, const char* dbid,
                 lo = record->core.pos;
             }
             hi = max(hi, bam_endpos(record.get()));
+            if (coverage) {
+                coverage->add_record(record.get());
+            }
         }
 
         if (bgzf->block_address != last_block_address) {
@@ -178,17 +320,20 @@ unsigned bam_block_index(sqlite3* dbh, const char* reference, const char* dbid,
             }
             if (bgzf->block_offset != 0) {
                 // it appears the last bam1_t record was split across two BGZF blocks
-                throw runtime_error("Unable to index this file due to bam1_t/BGZF block misalignment. Please report this file upstream.");
+                throw runtime_error("Unable to index this file due to bam1_t/BGZF block misalignment. Please re-block it using bgzip_records.");
             }
             block_ranges.push_back(make_tuple(tid, lo, hi));
             lo = hi = -1;
             for (const auto& r : block_ranges) {
-                insert_block_index_entry(insert_block_stmt.get(), dbid, target_names,
+                insert_block_index_entry(insert_block_stmt.get(), file_id, target_names,
                                          last_block_address, bgzf->block_address,
                                          get<0>(r), get<1>(r), get<2>(r),
                                          string(), string());
             }
             block_ranges.clear();
+            if (coverage) {
+                coverage->end_block(bgzf->block_address - last_block_address);
+            }
             last_block_address = bgzf->block_address;
         }
     }
@@ -202,6 +347,13 @@ unsigned bam_block_index(sqlite3* dbh, const char* reference, const char* dbid,
         throw runtime_error("Truncated BAM or unexpected BGZF/BAM reader behavior");
     }
 
+    if (coverage) {
+        coverage->insert(dbh, file_id);
+    }
+    if (append) {
+        check_append_order(dbh, file_id, resume);
+    }
+
     return block_count;
 }
 
@@ -212,29 +364,100 @@ const char* usage =
     "  index.db    SQLite3 database (will be created if nonexistent)\n"
     "  namespace   accession namespace\n"
     "  accession   accession identifier\n"
-    "  local_file  filename to local copy of BAM\n"
+    "  local_file  filename to local copy of BAM, or - to read it from standard\n"
+    "              input (e.g. as it's being downloaded)\n"
     "  url         BAM URL to serve to clients\n"
     "The BAM file is added to the database (without a block-level range index)\n"
     "based on the above information.\n"
     "Options:\n"
     "  --reference <id>  generate the block-level range index and associate it with\n"
     "                    this (arbitrary, server-specific) reference genome ID\n"
+    "  --coverage <bp>   with --reference, also record per-sequence coverage\n"
+    "                    histograms (reads, aligned bases, and compressed bytes)\n"
+    "                    in bins of this size, e.g. 16384\n"
+    "  --io <backend>    input file access method: hfile (htslib default),\n"
+    "                    mmap, or direct\n"
+    "  --chunk-size <n>  with --reference, also record chunk boundaries dividing the\n"
+    "                    file into pieces of about this many bytes, which the server\n"
+    "                    uses to split tickets for parallel download (default: 1GiB)\n"
+    "  --tee <file>      with local_file -, also write the input to this file\n"
+    "  --append          if the file is already indexed, assume it has since grown\n"
+    "                    by appending, and index only the new data (not with\n"
+    "                    --coverage)\n"
+    "  --follow <pid>    local_file is still being written by process pid (e.g. a\n"
+    "                    download); index it as it grows until pid exits (not\n"
+    "                    with --io)\n"
+    "  --level <n>       compression level for the BGZF header served ahead of the\n"
+    "                    file's blocks, 0-9, or up to 12 if built with libdeflate\n"
+    "                    (default: 6)\n"
 ;
 
 int main(int argc, char* argv[]) {
     static struct option long_options[] = {
         {"help", no_argument, 0, 'h'},
-        {"reference", required_argument, 0, 'r'}
+        {"reference", required_argument, 0, 'r'},
+        {"coverage", required_argument, 0, 'c'},
+        {"io", required_argument, 0, 'i'},
+        {"chunk-size", required_argument, 0, 'k'},
+        {"tee", required_argument, 0, 'T'},
+        {"append", no_argument, 0, 'a'},
+        {"follow", required_argument, 0, 'f'},
+        {"level", required_argument, 0, 'l'},
+        {0, 0, 0, 0}
     };
 
     string reference;
+    int coverage_bin_size = 0;
+    string io = "hfile";
+    int64_t chunk_size = 1073741824;
+    string tee;
+    bool append = false;
+    pid_t follow = 0;
+    int level = -1;
 
     int c;
-    while (-1 != (c = getopt_long(argc, argv, "hr:", long_options, 0))) {
+    while (-1 != (c = getopt_long(argc, argv, "hr:c:i:k:T:af:l:", long_options, 0))) {
         switch (c) {
             case 'r':
                 reference = optarg;
                 break;
+            case 'c':
+                coverage_bin_size = atoi(optarg);
+                if (coverage_bin_size <= 0) {
+                    cout << usage << endl;
+                    return 1;
+                }
+                break;
+            case 'i':
+                io = optarg;
+                break;
+            case 'k':
+                chunk_size = atoll(optarg);
+                if (chunk_size <= 0) {
+                    cout << usage << endl;
+                    return 1;
+                }
+                break;
+            case 'T':
+                tee = optarg;
+                break;
+            case 'a':
+                append = true;
+                break;
+            case 'f':
+                follow = atoi(optarg);
+                if (follow <= 0) {
+                    cout << usage << endl;
+                    return 1;
+                }
+                break;
+            case 'l':
+                level = atoi(optarg);
+                if (level < 0 || level > bgzf_max_level()) {
+                    cout << usage << endl;
+                    return 1;
+                }
+                break;
             default:
                 cout << usage << endl;
                 return 1;
@@ -251,10 +474,22 @@ int main(int argc, char* argv[]) {
                *fn = argv[optind+3],
                *url = argv[optind+4];
 
-    // get the file size
+    bool stream = string(fn) == "-";
+    if ((!tee.empty() && !stream) || (follow && (stream || io != "hfile")) ||
+        (append && (stream || reference.empty() || coverage_bin_size > 0))) {
+        cout << usage << endl;
+        return 1;
+    }
+
+    // get the file size (or, reading standard input or following a growing
+    // file, record it once we've read through to the end)
     ssize_t file_size = -1;
     struct stat fnstat;
-    if (stat(fn, &fnstat) == 0) {
+    if (stream) {
+        tee_stdin(tee);
+    } else if (follow) {
+        follow_input(follow);
+    } else if (stat(fn, &fnstat) == 0) {
         file_size = fnstat.st_size;
     } else {
         cerr << "WARNING: couldn't open " << fn << ", recording unknown file size." << endl;
@@ -273,12 +508,26 @@ int main(int argc, char* argv[]) {
     }
 	cout << "master transaction finished " << endl;
 
-    // insert the basic htsfiles entry
-    insert_htsfile(dbh.get(), dbid.c_str(), "bam", name_space, accession, url, file_size);
+    // insert the basic htsfiles entry, unless we're appending to the index of
+    // a file already in the database
+    int64_t file_id = append ? find_append_file(dbh.get(), dbid) : -1;
+    if (file_id < 0) {
+        append = false;
+        file_id = insert_htsfile(dbh.get(), dbid.c_str(), "bam", name_space, accession, url, file_size);
+    } else {
+        update_htsfile_size(dbh.get(), file_id, file_size);
+    }
 
     if (!reference.empty()) {
         // build the block-level range index
-        bam_block_index(dbh.get(), reference.c_str(), dbid.c_str(), fn);
+        bam_block_index(dbh.get(), reference.c_str(), file_id, fn, coverage_bin_size, io, append, level);
+        insert_chunks(dbh.get(), file_id, chunk_size);
+        insert_blocks_summary(dbh.get(), file_id);
+    }
+    if (stream) {
+        update_htsfile_size(dbh.get(), file_id, finish_stdin());
+    } else if (follow) {
+        update_htsfile_size(dbh.get(), file_id, finish_follow(fn));
     }
 
     // commit the master transaction
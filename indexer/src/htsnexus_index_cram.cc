@@ -6,13 +6,21 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <tuple>
+#include <algorithm>
 #include <sstream>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
 #include <stdlib.h>
 #include <getopt.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <string.h>
+#include <zlib.h>
 #include "sqlite3.h"
 #include "cram/cram.h"
 #include "htslib/hfile.h"
@@ -24,17 +32,34 @@ using namespace std;
 // htsnexus_index_util.cc prototypes
 shared_ptr<sqlite3> open_database(const char* db);
 string derive_dbid(const char* name_space, const char* accession, const char* format, const char* fn, const char* url);
-void insert_htsfile(sqlite3* dbh, const char* dbid, const char* format, const char* name_space,
-                    const char* accession, const char* url, ssize_t file_size);
-
-void insert_block_index_meta(sqlite3* dbh, const char* reference, const char* dbid,
+int64_t insert_htsfile(sqlite3* dbh, const char* dbid, const char* format, const char* name_space,
+                       const char* accession, const char* url, ssize_t file_size);
+void update_htsfile_size(sqlite3* dbh, int64_t file_id, int64_t file_size);
+int64_t find_append_file(sqlite3* dbh, const string& dbid);
+int64_t find_append_offset(sqlite3* dbh, int64_t file_id, const char* reference, const string& header);
+int find_append_framing(sqlite3* dbh, int64_t file_id);
+void check_append_order(sqlite3* dbh, int64_t file_id, int64_t offset);
+
+void insert_block_index_meta(sqlite3* dbh, const char* reference, int64_t file_id,
                              const string& header, const string& prefix, const string& suffix);
+void insert_seqs(sqlite3* dbh, int64_t file_id, const vector<string>& names, const vector<int64_t>& lengths);
 shared_ptr<sqlite3_stmt> prepare_insert_block(sqlite3* dbh);
-void insert_block_index_entry(sqlite3_stmt* insert_block_stmt, const char* dbid,
+void insert_block_index_entry(sqlite3_stmt* insert_block_stmt, int64_t file_id,
                               const vector<string>& target_names,
                               int64_t block_lo, int64_t block_hi,
                               int tid, int seq_lo, int seq_hi,
                               const string& prefix, const string& suffix);
+unsigned insert_chunks(sqlite3* dbh, int64_t file_id, int64_t chunk_size);
+void insert_blocks_summary(sqlite3* dbh, int64_t file_id);
+
+// htsnexus_hfile.cc prototypes
+hFILE* hopen_input(const char* fn, const string& backend);
+void tee_stdin(const string& fn);
+int64_t finish_stdin();
+void follow_input(pid_t pid);
+int64_t finish_follow(const char* fn);
+void hstream_retain(hFILE* fp, int64_t offset);
+bool hstream_recall(hFILE* fp, int64_t offset, void* buffer, size_t n);
 
 /*************************************************************************************************/
 
@@ -54,76 +79,466 @@ const string CRAM_EOF_OLD(
     "\x00\x01\x00\x00\x01\x00\x06\x06"
     "\x01\x00\x01\x00\x01\x00", 30);
 
-// add genomic ranges covered by one CRAM slice to the output data structure
-void cram_slice_ranges(cram_fd *fd, cram_container* c, cram_slice* s, map<int, tuple<int,int>>& ans) {
-    if (s->hdr->ref_seq_id >= 0) {
-        // s->hdr->ref_seq_start is one-based, here we express lo as zero-
-        // based.
-        int lo = s->hdr->ref_seq_start-1;
-        int hi = lo + s->hdr->ref_seq_span;
-        auto p = ans.find(s->hdr->ref_seq_id);
-        if (p != ans.end()) {
-            lo = min(lo, get<0>(p->second));
-            hi = max(hi, get<1>(p->second));
+// CRAM ITF8 & LTF8 variable-length integer encodings (cf. htslib itf8_put and
+// ltf8_put)
+void itf8_put(string& out, int32_t v) {
+    uint32_t u = v;
+    if (!(u & ~0x7fU)) {
+        out += (char) u;
+    } else if (!(u & ~0x3fffU)) {
+        out += (char) ((u >> 8) | 0x80);
+        out += (char) u;
+    } else if (!(u & ~0x1fffffU)) {
+        out += (char) ((u >> 16) | 0xc0);
+        out += (char) (u >> 8);
+        out += (char) u;
+    } else if (!(u & ~0xfffffffU)) {
+        out += (char) ((u >> 24) | 0xe0);
+        out += (char) (u >> 16);
+        out += (char) (u >> 8);
+        out += (char) u;
+    } else {
+        out += (char) (0xf0 | ((u >> 28) & 0x0f));
+        out += (char) (u >> 20);
+        out += (char) (u >> 12);
+        out += (char) (u >> 4);
+        out += (char) (u & 0x0f);
+    }
+}
+
+void ltf8_put(string& out, int64_t v) {
+    uint64_t u = v;
+    // number of bytes following the first, and the first byte's marker bits
+    int n;
+    unsigned char marker;
+    if (u < (1ULL << 7)) { n = 0; marker = 0; }
+    else if (u < (1ULL << 14)) { n = 1; marker = 0x80; }
+    else if (u < (1ULL << 21)) { n = 2; marker = 0xc0; }
+    else if (u < (1ULL << 28)) { n = 3; marker = 0xe0; }
+    else if (u < (1ULL << 35)) { n = 4; marker = 0xf0; }
+    else if (u < (1ULL << 42)) { n = 5; marker = 0xf8; }
+    else if (u < (1ULL << 49)) { n = 6; marker = 0xfc; }
+    else if (u < (1ULL << 56)) { n = 7; marker = 0xfe; }
+    else { n = 8; marker = 0xff; }
+    out += (char) (marker | (n < 7 ? (unsigned char) (u >> (8*n)) : 0));
+    for (int i = n-1; i >= 0; i--) {
+        out += (char) (u >> (8*i));
+    }
+}
+
+// Synthesize the header of a container holding only the compression header
+// (comp_hdr_size bytes) followed by one slice (slice_size bytes), so that the
+// slice can be served on its own, preceded by this header and a copy of the
+// compression header. The number of bases isn't recorded per slice, so it's
+// given as zero; readers use it only for statistics.
+string synthesize_container_header(int cram_version, const cram_block_slice_hdr* sh, int32_t num_blocks,
+                                   int32_t comp_hdr_size, int32_t slice_size) {
+    string ans;
+    int32_t length = comp_hdr_size + slice_size;
+    for (int i = 0; i < 4; i++) {
+        ans += (char) (length >> (8*i));
+    }
+    itf8_put(ans, sh->ref_seq_id);
+    itf8_put(ans, sh->ref_seq_start);
+    itf8_put(ans, sh->ref_seq_span);
+    itf8_put(ans, sh->num_records);
+    if (cram_version >= 3) {
+        ltf8_put(ans, sh->record_counter);
+    } else {
+        itf8_put(ans, (int32_t) sh->record_counter);
+    }
+    ltf8_put(ans, 0);
+    itf8_put(ans, num_blocks);
+    itf8_put(ans, 1);
+    itf8_put(ans, comp_hdr_size);
+    if (cram_version >= 3) {
+        uint32_t crc = crc32(0L, (const Bytef*) ans.data(), ans.size());
+        for (int i = 0; i < 4; i++) {
+            ans += (char) (crc >> (8*i));
         }
-        ans[s->hdr->ref_seq_id] = make_tuple(lo, hi);
-    } else if (s->hdr->ref_seq_id == -1) {
-        // unmapped
-        ans[-1] = make_tuple(-1,-1);
-    } else if (s->hdr->ref_seq_id == -2) {
-        // "multi-ref" slice: decode and scan as in htslib:cram_index.c:cram_index_build_multiref
-        if (0 != cram_decode_slice(fd, c, s, fd->header)) {
-            throw runtime_error("cram_decode_slice failed");
-        }
-
-        int ref = -2, ref_start = -1, ref_end = -1;
-        for (int i = 0; i < s->hdr->num_records; i++) {
-            if (s->crecs[i].ref_id == ref) {
-                if (ref != -1) {
-                    if (s->crecs[i].apos <= ref_start) {
-                        throw runtime_error("unsorted within multi-ref slice");
-                    }
-                    ref_end = std::max(ref_end, s->crecs[i].aend);
-                }
-                continue;
+    }
+    return ans;
+}
+
+// widen the genomic range recorded for ref in ans to include [lo,hi)
+void merge_range(map<int, tuple<int,int>>& ans, int ref, int lo, int hi) {
+    auto p = ans.find(ref);
+    if (p != ans.end()) {
+        lo = min(lo, get<0>(p->second));
+        hi = max(hi, get<1>(p->second));
+    }
+    ans[ref] = make_tuple(lo, hi);
+}
+
+// Cache of the genomic ranges found by decoding multi-ref slices, persisted
+// in a small SQLite database, so that re-indexing a file needn't decode them
+// again. Entries are keyed by the identity of the file (the size and CRC32 of
+// its raw header, which includes the CRAM file ID and the SAM header), the
+// slice's file offset, and the CRC32 of the slice's header block, which would
+// change with its contents (record counter, block content IDs, reference MD5,
+// etc.) The file identity doesn't include its size, so that entries remain
+// valid as the file grows by appending.
+class slice_range_cache {
+    shared_ptr<sqlite3> dbh_;
+    int64_t file_header_size_;
+    uint32_t file_header_crc32_;
+    map<pair<int64_t,uint32_t>, map<int, tuple<int,int>>> entries_, new_entries_;
+
+public:
+    slice_range_cache(const string& filename, const void* file_header, size_t file_header_size)
+        : file_header_size_(file_header_size),
+          file_header_crc32_(crc32(0L, (const Bytef*) file_header, file_header_size)) {
+        sqlite3* raw = 0;
+        if (sqlite3_open_v2(filename.c_str(), &raw, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, 0) != SQLITE_OK) {
+            if (raw) {
+                sqlite3_close(raw);
+            }
+            throw runtime_error("couldn't open slice cache " + filename);
+        }
+        dbh_ = shared_ptr<sqlite3>(raw, &sqlite3_close);
+        // caches from before the entries were keyed by file identity (user
+        // version 0) are discarded
+        if (sqlite3_exec(raw, "begin", 0, 0, 0)) {
+            throw runtime_error("couldn't initialize slice cache " + filename + ": " + sqlite3_errmsg(raw));
+        }
+        sqlite3_stmt *stmt = 0;
+        if (sqlite3_prepare_v2(raw, "pragma user_version", -1, &stmt, 0)) {
+            throw runtime_error("couldn't read slice cache " + filename);
+        }
+        shared_ptr<sqlite3_stmt> version_stmt(stmt, &sqlite3_finalize);
+        if (sqlite3_step(stmt) != SQLITE_ROW) {
+            throw runtime_error("couldn't read slice cache " + filename);
+        }
+        if (sqlite3_column_int(stmt, 0) < 1) {
+            version_stmt.reset();
+            if (sqlite3_exec(raw, "drop table if exists slice_ranges; \
+                                   create table slice_ranges (file_header_size integer not null, \
+                                       file_header_crc32 integer not null, slice_offset integer not null, \
+                                       header_crc32 integer not null, tid integer not null, \
+                                       lo integer not null, hi integer not null, \
+                                       primary key(file_header_size, file_header_crc32, slice_offset, header_crc32, tid)); \
+                                   pragma user_version = 1", 0, 0, 0)) {
+                throw runtime_error("couldn't initialize slice cache " + filename + ": " + sqlite3_errmsg(raw));
             }
+        }
+        version_stmt.reset();
+        if (sqlite3_exec(raw, "commit", 0, 0, 0)) {
+            throw runtime_error("couldn't initialize slice cache " + filename + ": " + sqlite3_errmsg(raw));
+        }
+
+        // load the entries for this file
+        if (sqlite3_prepare_v2(raw, "select slice_offset, header_crc32, tid, lo, hi from slice_ranges \
+                                     where file_header_size = ? and file_header_crc32 = ?", -1, &stmt, 0)) {
+            throw runtime_error("couldn't read slice cache " + filename);
+        }
+        shared_ptr<sqlite3_stmt> select_stmt(stmt, &sqlite3_finalize);
+        if (sqlite3_bind_int64(stmt, 1, file_header_size_) ||
+            sqlite3_bind_int64(stmt, 2, file_header_crc32_)) {
+            throw runtime_error("couldn't read slice cache " + filename);
+        }
+        int c;
+        while ((c = sqlite3_step(stmt)) == SQLITE_ROW) {
+            auto key = make_pair(sqlite3_column_int64(stmt, 0), (uint32_t) sqlite3_column_int64(stmt, 1));
+            entries_[key][sqlite3_column_int(stmt, 2)] = make_tuple(sqlite3_column_int(stmt, 3), sqlite3_column_int(stmt, 4));
+        }
+        if (c != SQLITE_DONE) {
+            throw runtime_error("couldn't read slice cache " + filename);
+        }
+    }
 
-            if (ref != -2) {
-                auto p = ans.find(ref);
-                if (p != ans.end()) {
-                    ref_start = min(ref_start, get<0>(p->second));
-                    ref_end = max(ref_end, get<1>(p->second));
+    const map<int, tuple<int,int>>* find(int64_t slice_offset, uint32_t header_crc32) const {
+        auto p = entries_.find(make_pair(slice_offset, header_crc32));
+        return p != entries_.end() ? &(p->second) : nullptr;
+    }
+
+    void insert(int64_t slice_offset, uint32_t header_crc32, const map<int, tuple<int,int>>& ranges) {
+        auto key = make_pair(slice_offset, header_crc32);
+        entries_[key] = ranges;
+        new_entries_[key] = ranges;
+    }
+
+    // write out the entries inserted since loading
+    void save() {
+        if (new_entries_.empty()) {
+            return;
+        }
+        sqlite3* raw = dbh_.get();
+        sqlite3_stmt *stmt = 0;
+        if (sqlite3_exec(raw, "begin", 0, 0, 0) ||
+            sqlite3_prepare_v2(raw, "insert or replace into slice_ranges values(?,?,?,?,?,?,?)", -1, &stmt, 0)) {
+            throw runtime_error(string("couldn't update slice cache: ") + sqlite3_errmsg(raw));
+        }
+        shared_ptr<sqlite3_stmt> insert_stmt(stmt, &sqlite3_finalize);
+        for (const auto& e : new_entries_) {
+            for (const auto& r : e.second) {
+                if (sqlite3_bind_int64(stmt, 1, file_header_size_) ||
+                    sqlite3_bind_int64(stmt, 2, file_header_crc32_) ||
+                    sqlite3_bind_int64(stmt, 3, e.first.first) ||
+                    sqlite3_bind_int64(stmt, 4, e.first.second) ||
+                    sqlite3_bind_int(stmt, 5, r.first) ||
+                    sqlite3_bind_int(stmt, 6, get<0>(r.second)) ||
+                    sqlite3_bind_int(stmt, 7, get<1>(r.second)) ||
+                    sqlite3_step(stmt) != SQLITE_DONE ||
+                    sqlite3_reset(stmt)) {
+                    throw runtime_error(string("couldn't update slice cache: ") + sqlite3_errmsg(raw));
                 }
-                ans[ref] = make_tuple(ref_start, ref_end);
             }
+        }
+        insert_stmt.reset();
+        if (sqlite3_exec(raw, "commit", 0, 0, 0)) {
+            throw runtime_error(string("couldn't update slice cache: ") + sqlite3_errmsg(raw));
+        }
+        new_entries_.clear();
+    }
+};
+
+// decode a multi-ref slice to find the genomic range covered on each
+// reference, as in htslib:cram_index.c:cram_index_build_multiref. The fd
+// should be set up to decode only the positional fields (see
+// cram_block_index), so that this never needs to load reference sequences.
+// Several slices may be decoded concurrently with the same fd, but not with the
+// same compression header, which cram_decode_slice updates (marking the data
+// series needed; see cram_dependent_data_series). The slice is decoded against
+// a private copy of its container, given the compression header comp_hdr.
+map<int, tuple<int,int>> decode_multiref_slice(cram_fd *fd, const cram_container* c,
+                                               cram_block_compression_hdr* comp_hdr, cram_slice* s) {
+    cram_container cc = *c;
+    cc.comp_hdr = comp_hdr;
+    if (0 != cram_decode_slice(fd, &cc, s, fd->header)) {
+        throw runtime_error("cram_decode_slice failed");
+    }
 
-            ref = s->crecs[i].ref_id;
+    map<int, tuple<int,int>> ans;
+    int ref = -2, ref_start = -1, ref_end = -1;
+    for (int i = 0; i < s->hdr->num_records; i++) {
+        if (s->crecs[i].ref_id == ref) {
             if (ref != -1) {
-                ref_start = s->crecs[i].apos - 1;
-                ref_end = s->crecs[i].aend;
-            } else {
-                ref_start = ref_end = -1;
+                if (s->crecs[i].apos <= ref_start) {
+                    throw runtime_error("unsorted within multi-ref slice");
+                }
+                ref_end = std::max(ref_end, s->crecs[i].aend);
             }
+            continue;
         }
 
         if (ref != -2) {
-            auto p = ans.find(ref);
-            if (p != ans.end()) {
-                ref_start = min(ref_start, get<0>(p->second));
-                ref_end = max(ref_end, get<1>(p->second));
+            merge_range(ans, ref, ref_start, ref_end);
+        }
+
+        ref = s->crecs[i].ref_id;
+        if (ref != -1) {
+            ref_start = s->crecs[i].apos - 1;
+            ref_end = s->crecs[i].aend;
+        } else {
+            ref_start = ref_end = -1;
+        }
+    }
+
+    if (ref != -2) {
+        merge_range(ans, ref, ref_start, ref_end);
+    }
+    return ans;
+}
+
+// The compression header decoded for one decoding thread, which is kept for
+// as long as the following slices' containers repeat the same (raw) header,
+// as writers usually do.
+class compression_header_cache {
+    shared_ptr<const string> data_;
+    shared_ptr<cram_block_compression_hdr> hdr_;
+
+public:
+    cram_block_compression_hdr* get(cram_fd* fd, const shared_ptr<const string>& data) {
+        if (hdr_ && (data_ == data || *data_ == *data)) {
+            return hdr_.get();
+        }
+        hdr_.reset();
+        data_ = data;
+        cram_block b;
+        memset(&b, 0, sizeof(b));
+        b.method = b.orig_method = RAW;
+        b.content_type = COMPRESSION_HEADER;
+        b.data = (unsigned char*) data_->data();
+        b.comp_size = b.uncomp_size = data_->size();
+        hdr_.reset(cram_decode_compression_header(fd, &b),
+                   [](cram_block_compression_hdr* h) { if (h) cram_free_compression_header(h); });
+        if (!hdr_) {
+            throw runtime_error("Error decoding CRAM compression header");
+        }
+        return hdr_.get();
+    }
+};
+
+// A multi-ref slice queued for decoding. The job holds the slice, its
+// container, and the container's raw compression header until it's decoded,
+// whereupon they're released and only the ranges are kept.
+struct multiref_job {
+    shared_ptr<const string> comp_hdr_data;
+    shared_ptr<cram_container> c;
+    shared_ptr<cram_slice> s;
+
+    bool done = false;
+    map<int, tuple<int,int>> ranges;
+    exception_ptr error;
+};
+
+// Decodes multi-ref slices on a pool of threads, which live for the whole
+// scan. The caller submits each slice as it's read, and later waits for the
+// results in file order. With one thread, slices are decoded as they're
+// submitted, on the caller's thread. Each thread decodes the compression
+// headers for itself.
+class multiref_decoder {
+    cram_fd* fd;
+    compression_header_cache caller_comp_hdr;
+
+    mutex mu;
+    condition_variable cv;
+    deque<shared_ptr<multiref_job>> queue;
+    bool stopping = false;
+    vector<thread> workers;
+
+    void decode(multiref_job& job, compression_header_cache& comp_hdr) {
+        map<int, tuple<int,int>> ranges;
+        exception_ptr error;
+        try {
+            ranges = decode_multiref_slice(fd, job.c.get(), comp_hdr.get(fd, job.comp_hdr_data), job.s.get());
+        } catch (...) {
+            error = current_exception();
+        }
+        // free the decoded slice now, rather than when the caller gets around
+        // to collecting the ranges
+        job.s.reset();
+        job.c.reset();
+        job.comp_hdr_data.reset();
+        lock_guard<mutex> lock(mu);
+        job.ranges.swap(ranges);
+        job.error = error;
+        job.done = true;
+        cv.notify_all();
+    }
+
+    void work() {
+        compression_header_cache comp_hdr;
+        unique_lock<mutex> lock(mu);
+        while (true) {
+            cv.wait(lock, [this]() { return stopping || !queue.empty(); });
+            if (stopping) {
+                return;
             }
-            ans[ref] = make_tuple(ref_start, ref_end);
+            auto job = queue.front();
+            queue.pop_front();
+            lock.unlock();
+            decode(*job, comp_hdr);
+            lock.lock();
+        }
+    }
+
+public:
+    multiref_decoder(cram_fd* fd_, unsigned threads) : fd(fd_) {
+        for (unsigned i = 0; threads > 1 && i < threads; i++) {
+            workers.push_back(thread([this]() { work(); }));
+        }
+    }
+
+    ~multiref_decoder() {
+        {
+            lock_guard<mutex> lock(mu);
+            stopping = true;
+            cv.notify_all();
+        }
+        for (auto& t : workers) {
+            t.join();
+        }
+    }
+
+    // number of slices to keep in flight, bounding the memory held by slices
+    // read but not yet decoded
+    size_t window() const {
+        return workers.empty() ? 1 : 4*workers.size();
+    }
+
+    shared_ptr<multiref_job> submit(const shared_ptr<const string>& comp_hdr_data,
+                                    const shared_ptr<cram_container>& c, const shared_ptr<cram_slice>& s) {
+        shared_ptr<multiref_job> job(new multiref_job);
+        job->comp_hdr_data = comp_hdr_data;
+        job->c = c;
+        job->s = s;
+        if (workers.empty()) {
+            decode(*job, caller_comp_hdr);
+        } else {
+            lock_guard<mutex> lock(mu);
+            queue.push_back(job);
+            cv.notify_one();
+        }
+        return job;
+    }
+
+    // wait for the job to finish, rethrowing any error in decoding
+    const map<int, tuple<int,int>>& wait(multiref_job& job) {
+        unique_lock<mutex> lock(mu);
+        cv.wait(lock, [&job]() { return job.done; });
+        if (job.error) {
+            rethrow_exception(job.error);
+        }
+        return job.ranges;
+    }
+};
+
+// find the genomic ranges covered by one CRAM slice (at file offset spos)
+// from its header or, for a multi-ref slice, from the cache (if any). Returns
+// false if the multi-ref slice must be decoded instead; header_crc32 is then
+// set to the checksum keying its cache entry.
+bool cram_slice_ranges(cram_slice* s, int64_t spos, const slice_range_cache* cache,
+                       uint32_t& header_crc32, map<int, tuple<int,int>>& ans) {
+    if (s->hdr->ref_seq_id >= 0) {
+        // s->hdr->ref_seq_start is one-based, here we express lo as zero-
+        // based.
+        int lo = s->hdr->ref_seq_start-1;
+        int hi = lo + s->hdr->ref_seq_span;
+        merge_range(ans, s->hdr->ref_seq_id, lo, hi);
+    } else if (s->hdr->ref_seq_id == -1) {
+        // unmapped
+        ans[-1] = make_tuple(-1,-1);
+    } else if (s->hdr->ref_seq_id == -2) {
+        // "multi-ref" slice
+        header_crc32 = crc32(0L, s->hdr_block->data, s->hdr_block->uncomp_size);
+        const map<int, tuple<int,int>>* cached = cache ? cache->find(spos, header_crc32) : nullptr;
+        if (!cached) {
+            return false;
+        }
+        for (const auto& r : *cached) {
+            merge_range(ans, r.first, get<0>(r.second), get<1>(r.second));
         }
     } else {
         throw runtime_error("Corrupt CRAM slice header (invalid ref_seq_id)");
     }
+    return true;
 }
 
-// populate the block-level index for the CRAM file (htsfiles_blocks_meta and htsfiles_blocks)
-unsigned cram_block_index(sqlite3* dbh, const char* reference, const char* dbid, const char* cramfile) {
-    // open the CRAM file
-    shared_ptr<cram_fd> fd(cram_open(cramfile, "r"), cram_close);
+// populate the block-level index for the CRAM file (htsfiles_blocks_meta and
+// htsfiles_blocks). By default there's one entry per container (and reference
+// sequence therein); with slices, one per slice, each with a block_prefix
+// holding a synthesized container header and the compression header.
+// If slice_cache is nonempty, it names the database caching the ranges of
+// multi-ref slices across runs. Multi-ref slices are decoded on the given
+// number of threads. If append is set, the file is already indexed, and we
+// resume scanning after the last indexed container.
+unsigned cram_block_index(sqlite3* dbh, const char* reference, int64_t file_id, const char* cramfile,
+                          const string& io, bool slices, const string& slice_cache, unsigned threads,
+                          bool append) {
+    // open the CRAM file. Reading standard input, we retain the bytes read
+    // from it, starting with the raw header, to recall them below.
+    bool stream = string(cramfile) == "-";
+    hFILE* hf = hopen_input(cramfile, io);
+    if (!hf) {
+        throw runtime_error("Failed to open CRAM file");
+    }
+    if (stream) {
+        hstream_retain(hf, 0);
+    }
+    shared_ptr<cram_fd> fd(cram_dopen(hf, cramfile, "r"), cram_close);
     if (!fd) {
+        hclose(hf);
         throw runtime_error("Failed to open CRAM file");
     }
 
@@ -132,18 +547,49 @@ unsigned cram_block_index(sqlite3* dbh, const char* reference, const char* dbid,
         throw runtime_error("Unsupported CRAM version " + to_string(cram_version));
     }
 
+    // We decode (multi-ref) slices only to find the alignment span of each
+    // record, which depends only on its position and CIGAR-equivalent read
+    // features. Requesting just those fields (no SEQ, MD or NM) means htslib
+    // never loads reference sequences, which could otherwise involve slow
+    // REF_PATH/EBI lookups, and indexing stays CPU-bound and offline.
+    if (cram_set_option(fd.get(), CRAM_OPT_REQUIRED_FIELDS, SAM_FLAG | SAM_RNAME | SAM_POS | SAM_CIGAR) ||
+        cram_set_option(fd.get(), CRAM_OPT_DECODE_MD, 0)) {
+        throw runtime_error("Failed to set CRAM decoding options");
+    }
+
+    // re-read bytes which fd has already consumed: those retained from
+    // standard input, or else through a second hFILE on the file (with --io
+    // mmap, this reuses the mapping made for fd)
+    shared_ptr<hFILE> raw_hf;
+    if (!stream) {
+        raw_hf.reset(hopen_input(cramfile, io), &hclose);
+        if (!raw_hf) {
+            throw runtime_error("Failed to reopen CRAM file");
+        }
+    }
+    auto reread = [&](int64_t offset, void* buffer, size_t n) {
+        if (stream) {
+            return hstream_recall(hf, offset, buffer, n);
+        }
+        return hseek(raw_hf.get(), offset, SEEK_SET) == offset &&
+               hread(raw_hf.get(), buffer, n) == (ssize_t) n && !raw_hf->has_errno;
+    };
+
     // read in the raw header bytes (now that we can find out its exact size
-    // based on how far cram_open read)
+    // based on how far cram_dopen read)
     size_t raw_header_size = (size_t) htell(fd->fp);
     shared_ptr<void> raw_header(malloc(raw_header_size), &free);
-    shared_ptr<hFILE> raw_hf(hopen(cramfile, "r"), &hclose);
-    if (!raw_hf) {
-        throw runtime_error("Failed to reopen CRAM file");
-    }
-    if (hread(raw_hf.get(), raw_header.get(), raw_header_size) != raw_header_size || raw_hf->has_errno) {
+    if (!reread(0, raw_header.get(), raw_header_size)) {
         throw runtime_error("Failed to read CRAM raw header");
     }
-    raw_hf.reset();
+
+    unique_ptr<slice_range_cache> cache;
+    if (!slice_cache.empty()) {
+        cache.reset(new slice_range_cache(slice_cache, raw_header.get(), raw_header_size));
+    }
+    if (!slices) {
+        raw_hf.reset();
+    }
 
     // read the parsed SAM header
     SAM_hdr *header = cram_fd_get_header(fd.get());
@@ -151,40 +597,139 @@ unsigned cram_block_index(sqlite3* dbh, const char* reference, const char* dbid,
         throw runtime_error("Failed to read CRAM header");
     }
     vector<string> target_names;
+    vector<int64_t> target_lens;
     for (int i = 0; i < header->nref; i++) {
         target_names.push_back(string(header->ref[i].name));
+        target_lens.push_back(header->ref[i].len);
     }
 
-    // insert the htsfiles_blocks_meta entry
-    insert_block_index_meta(dbh, reference, dbid, string(sam_hdr_str(header)),
-                            string((char*)raw_header.get(), raw_header_size),
-                            cram_version >= 3 ? CRAM_EOF : CRAM_EOF_OLD);
+    int64_t cpos = raw_header_size;
+    int64_t resume = 0;
+    if (append) {
+        // skip the containers already indexed
+        resume = find_append_offset(dbh, file_id, reference, string(sam_hdr_str(header)));
+        // the new entries must be of the same kind as the existing ones, so
+        // that the index is the same as if the whole file were indexed at once
+        int framed = find_append_framing(dbh, file_id);
+        if (framed >= 0 && (framed != 0) != slices) {
+            throw runtime_error(string("--append: file was indexed ") + (framed ? "with" : "without") + " --slices");
+        }
+        if (resume > cpos) {
+            if (cram_seek(fd.get(), resume, SEEK_SET)) {
+                throw runtime_error("Error seeking to CRAM container at byte offset " + to_string(resume));
+            }
+            cpos = resume;
+        }
+    } else {
+        // insert the htsfiles_blocks_meta entry
+        insert_block_index_meta(dbh, reference, file_id, string(sam_hdr_str(header)),
+                                string((char*)raw_header.get(), raw_header_size),
+                                cram_version >= 3 ? CRAM_EOF : CRAM_EOF_OLD);
+        insert_seqs(dbh, file_id, target_names, target_lens);
+    }
 
-    // now scan the CRAM file to populate htsfiles_blocks
+    // now scan the CRAM file to populate htsfiles_blocks. The containers are
+    // read in order on this thread, while the multi-ref slices found therein
+    // are decoded on the decoder's threads. Each container's entries are
+    // inserted once the ranges of all its slices are known, in file order.
     auto insert_block_stmt = prepare_insert_block(dbh);
+    struct pending_slice {
+        int64_t spos;
+        cram_block_slice_hdr sh;
+        uint32_t header_crc32;
+        map<int, tuple<int,int>> ranges;
+        shared_ptr<multiref_job> job;
+    };
+    struct pending_container {
+        int64_t cpos, epos;
+        // raw compression header and count of other blocks, with slices
+        string comp_hdr;
+        int32_t other_blocks = 0;
+        vector<pending_slice> slices;
+        size_t jobs = 0;
+    };
+    deque<pending_container> pending;
+    multiref_decoder decoder(fd.get(), threads);
+    size_t in_flight = 0;
+
+    auto insert_pending = [&]() {
+        pending_container& pc = pending.front();
+        map<int, tuple<int,int>> container_ranges;
+        for (size_t j = 0; j < pc.slices.size(); j++) {
+            pending_slice& ps = pc.slices[j];
+            if (ps.job) {
+                ps.ranges = decoder.wait(*ps.job);
+                if (cache) {
+                    cache->insert(ps.spos, ps.header_crc32, ps.ranges);
+                }
+                ps.job.reset();
+            }
+            if (!slices) {
+                for (const auto& r : ps.ranges) {
+                    merge_range(container_ranges, r.first, get<0>(r.second), get<1>(r.second));
+                }
+                continue;
+            }
+            int64_t slo = ps.spos, shi = j+1 < pc.slices.size() ? pc.slices[j+1].spos : pc.epos;
+            string prefix = synthesize_container_header(cram_version, &ps.sh, pc.other_blocks + 1 + ps.sh.num_blocks,
+                                                        pc.comp_hdr.size(), shi - slo) + pc.comp_hdr;
+            for (const auto& r : ps.ranges) {
+                insert_block_index_entry(insert_block_stmt.get(), file_id, target_names,
+                                         slo, shi,
+                                         r.first, get<0>(r.second), get<1>(r.second),
+                                         prefix, string());
+            }
+        }
+        for (const auto& r : container_ranges) {
+            insert_block_index_entry(insert_block_stmt.get(), file_id, target_names,
+                                     pc.cpos, pc.epos,
+                                     r.first, get<0>(r.second), get<1>(r.second),
+                                     string(), string());
+        }
+        in_flight -= pc.jobs;
+        pending.pop_front();
+    };
+
+    // The compression header is decoded only by the decoder's threads, as
+    // needed for multi-ref slices, from the raw header bytes. Writers usually
+    // repeat the same header in every container, so we keep sharing the last
+    // one's bytes as long as the following containers' are identical, letting
+    // each thread reuse the header it decoded.
+    shared_ptr<const string> comp_hdr_data;
+
     unsigned containers = 0;
-    auto cpos = raw_header_size;
     shared_ptr<cram_container> c(cram_read_container(fd.get()), &cram_free_container);
     while (c) {
         if (fd->err) {
             throw runtime_error("Error reading CRAM container header");
         }
         containers++;
+        if (stream) {
+            // we'll need at most this container's compression header
+            hstream_retain(hf, cpos);
+        }
 
         auto hpos = htell(fd->fp);
 
         if (!(c->comp_hdr_block = cram_read_block(fd.get()))) {
             throw runtime_error("Error reading CRAM compression header");
         }
-
-        if (c->comp_hdr_block->content_type != COMPRESSION_HEADER ||
-            !(c->comp_hdr = cram_decode_compression_header(fd.get(), c->comp_hdr_block))) {
+        cram_block* b = c->comp_hdr_block;
+        if (b->content_type != COMPRESSION_HEADER || cram_uncompress_block(b)) {
             throw runtime_error("Error decoding CRAM compression header");
         }
+        if (!comp_hdr_data || comp_hdr_data->size() != (size_t) b->uncomp_size ||
+            memcmp(comp_hdr_data->data(), b->data, b->uncomp_size)) {
+            comp_hdr_data.reset(new string((const char*) b->data, b->uncomp_size));
+        }
 
-        // iterate through the slices in this container to accumulate a table
-        // of the reference genomic ranges covered
-        map<int, tuple<int,int>> container_ranges;
+        // iterate through the slices in this container to find the reference
+        // genomic ranges covered by each, submitting any multi-ref slices for
+        // decoding
+        pending.push_back(pending_container());
+        pending_container& pc = pending.back();
+        pc.cpos = cpos;
+        int32_t slice_blocks = 0;
         for (int j = 0; j < c->num_landmarks; j++) {
             auto spos = htell(fd->fp);
             if (spos - cpos - c->offset != c->landmark[j]) {
@@ -196,27 +741,59 @@ unsigned cram_block_index(sqlite3* dbh, const char* reference, const char* dbid,
                 throw runtime_error("Error reading CRAM slice in");
             }
 
-            cram_slice_ranges(fd.get(), c.get(), s.get(), container_ranges);
+            pc.slices.push_back(pending_slice());
+            pending_slice& ps = pc.slices.back();
+            ps.spos = spos;
+            ps.sh = *(s->hdr);
+            ps.sh.block_content_ids = 0;
+            if (!cram_slice_ranges(s.get(), spos, cache.get(), ps.header_crc32, ps.ranges)) {
+                ps.job = decoder.submit(comp_hdr_data, c, s);
+                pc.jobs++;
+                in_flight++;
+            }
+            slice_blocks += 1 + s->hdr->num_blocks;
+        }
+        pc.epos = htell(fd->fp);
+
+        if (slices && c->num_landmarks > 0) {
+            // copy the compression header, which precedes the first slice
+            int32_t comp_hdr_size = c->landmark[0];
+            pc.comp_hdr.assign(comp_hdr_size, 0);
+            if (!reread(hpos, &pc.comp_hdr[0], comp_hdr_size)) {
+                throw runtime_error("Failed to reread CRAM compression header");
+            }
+            // blocks in the container other than those of the slices (i.e.
+            // the compression header), following the writer's convention
+            pc.other_blocks = max(0, c->num_blocks - slice_blocks);
         }
+        auto epos = pc.epos;
 
-        // insert the entries
-        for (const auto& r : container_ranges) {
-            insert_block_index_entry(insert_block_stmt.get(), dbid, target_names,
-                                     cpos, htell(fd->fp),
-                                     r.first, get<0>(r.second), get<1>(r.second),
-                                     string(), string());
+        // insert the entries for containers no longer awaiting decoding, or
+        // wait for the earliest if too many slices are in flight
+        while (!pending.empty() && (pending.front().jobs == 0 || in_flight > decoder.window())) {
+            insert_pending();
         }
 
         // advance to next container
-        cpos = htell(fd->fp);
+        cpos = epos;
         if (cpos != hpos + c->length) {
             throw runtime_error("Corrupt CRAM container header");
         }
-        c.reset(cram_read_container(fd.get()));
+        c.reset(cram_read_container(fd.get()), &cram_free_container);
     }
     if (fd->err) {
         throw runtime_error("Error reading CRAM container header");
     }
+    while (!pending.empty()) {
+        insert_pending();
+    }
+
+    if (cache) {
+        cache->save();
+    }
+    if (append) {
+        check_append_order(dbh, file_id, resume);
+    }
 
     return containers;
 }
@@ -228,29 +805,103 @@ const char* usage =
     "  index.db    SQLite3 database (will be created if nonexistent)\n"
     "  namespace   accession namespace\n"
     "  accession   accession identifier\n"
-    "  local_file  filename to local copy of CRAM\n"
+    "  local_file  filename to local copy of CRAM, or - to read it from standard\n"
+    "              input (e.g. as it's being downloaded)\n"
     "  url         CRAM URL to serve to clients\n"
     "The CRAM file is added to the database (without a block-level range index)\n"
     "based on the above information.\n"
     "Options:\n"
     "  --reference <id>  generate the block-level range index and associate it with\n"
     "                    this (arbitrary, server-specific) reference genome ID\n"
+    "  --io <backend>    input file access method: hfile (htslib default),\n"
+    "                    mmap, or direct\n"
+    "  --chunk-size <n>  with --reference, also record chunk boundaries dividing the\n"
+    "                    file into pieces of about this many bytes, which the server\n"
+    "                    uses to split tickets for parallel download (default: 1GiB)\n"
+    "  --tee <file>      with local_file -, also write the input to this file\n"
+    "  --append          if the file is already indexed, assume it has since grown\n"
+    "                    by appending, and index only the new data\n"
+    "  --follow <pid>    local_file is still being written by process pid (e.g. a\n"
+    "                    download); index it as it grows until pid exits (not\n"
+    "                    with --io)\n"
+    "  --slices          with --reference, index each slice rather than each\n"
+    "                    container, for finer slicing of files with many slices\n"
+    "                    per container\n"
+    "  --slice-cache <file>\n"
+    "                    cache the genomic ranges of multi-reference slices in\n"
+    "                    this SQLite database, to avoid decoding them again when\n"
+    "                    re-indexing the file\n"
+    "  --threads <n>     decode multi-reference slices on this many threads\n"
+    "                    (default: 1)\n"
 ;
 
 int main(int argc, char* argv[]) {
     static struct option long_options[] = {
         {"help", no_argument, 0, 'h'},
-        {"reference", required_argument, 0, 'r'}
+        {"reference", required_argument, 0, 'r'},
+        {"io", required_argument, 0, 'i'},
+        {"chunk-size", required_argument, 0, 'k'},
+        {"tee", required_argument, 0, 'T'},
+        {"append", no_argument, 0, 'a'},
+        {"follow", required_argument, 0, 'f'},
+        {"slices", no_argument, 0, 's'},
+        {"slice-cache", required_argument, 0, 'S'},
+        {"threads", required_argument, 0, 't'},
+        {0, 0, 0, 0}
     };
 
     string reference;
+    string io = "hfile";
+    int64_t chunk_size = 1073741824;
+    string tee;
+    bool append = false;
+    pid_t follow = 0;
+    bool slices = false;
+    string slice_cache;
+    int threads = 1;
 
     int c;
-    while (-1 != (c = getopt_long(argc, argv, "hr:", long_options, 0))) {
+    while (-1 != (c = getopt_long(argc, argv, "hr:i:k:sS:t:T:af:", long_options, 0))) {
         switch (c) {
             case 'r':
                 reference = optarg;
                 break;
+            case 'i':
+                io = optarg;
+                break;
+            case 'k':
+                chunk_size = atoll(optarg);
+                if (chunk_size <= 0) {
+                    cout << usage << endl;
+                    return 1;
+                }
+                break;
+            case 's':
+                slices = true;
+                break;
+            case 'S':
+                slice_cache = optarg;
+                break;
+            case 't':
+                threads = atoi(optarg);
+                if (threads <= 0) {
+                    cout << usage << endl;
+                    return 1;
+                }
+                break;
+            case 'T':
+                tee = optarg;
+                break;
+            case 'a':
+                append = true;
+                break;
+            case 'f':
+                follow = atoi(optarg);
+                if (follow <= 0) {
+                    cout << usage << endl;
+                    return 1;
+                }
+                break;
             default:
                 cout << usage << endl;
                 return 1;
@@ -267,10 +918,22 @@ int main(int argc, char* argv[]) {
                *fn = argv[optind+3],
                *url = argv[optind+4];
 
-    // get the file size
+    bool stream = string(fn) == "-";
+    if ((!tee.empty() && !stream) || (follow && (stream || io != "hfile")) ||
+        (append && (stream || reference.empty()))) {
+        cout << usage << endl;
+        return 1;
+    }
+
+    // get the file size (or, reading standard input or following a growing
+    // file, record it once we've read through to the end)
     ssize_t file_size = -1;
     struct stat fnstat;
-    if (stat(fn, &fnstat) == 0) {
+    if (stream) {
+        tee_stdin(tee);
+    } else if (follow) {
+        follow_input(follow);
+    } else if (stat(fn, &fnstat) == 0) {
         file_size = fnstat.st_size;
     } else {
         cerr << "WARNING: couldn't open " << fn << ", recording unknown file size." << endl;
@@ -287,12 +950,26 @@ int main(int argc, char* argv[]) {
         throw runtime_error("failed to begin transaction...");
     }
 
-    // insert the basic htsfiles entry
-    insert_htsfile(dbh.get(), dbid.c_str(), "cram", name_space, accession, url, file_size);
+    // insert the basic htsfiles entry, unless we're appending to the index of
+    // a file already in the database
+    int64_t file_id = append ? find_append_file(dbh.get(), dbid) : -1;
+    if (file_id < 0) {
+        append = false;
+        file_id = insert_htsfile(dbh.get(), dbid.c_str(), "cram", name_space, accession, url, file_size);
+    } else {
+        update_htsfile_size(dbh.get(), file_id, file_size);
+    }
 
     if (!reference.empty()) {
         // build the block-level range index
-        cram_block_index(dbh.get(), reference.c_str(), dbid.c_str(), fn);
+        cram_block_index(dbh.get(), reference.c_str(), file_id, fn, io, slices, slice_cache, threads, append);
+        insert_chunks(dbh.get(), file_id, chunk_size);
+        insert_blocks_summary(dbh.get(), file_id);
+    }
+    if (stream) {
+        update_htsfile_size(dbh.get(), file_id, finish_stdin());
+    } else if (follow) {
+        update_htsfile_size(dbh.get(), file_id, finish_follow(fn));
     }
 
     // commit the master transaction
@@ -2,6 +2,10 @@
 #include <string>
 #include <vector>
 #include <sstream>
+#include <algorithm>
+#include <utility>
+#include <tuple>
+#include <map>
 #include "htslib/sam.h"
 #include "sqlite3.h"
 
@@ -9,25 +13,81 @@ using namespace std;
 
 /*************************************************************************************************/
 
+// Version of the database schema, stored as its user_version. Bump this upon
+// incompatible changes, and add the corresponding step to
+// htsnexus_migrate_database.sh. htsnexus_export_snapshot.sh (and, for
+// htsfiles_blocks_summary, htsnexus_merge_databases.sh) repeat the schema
+// below too.
+const int schema_version = 2;
+
+// Each file has an integer file_id (a rowid alias), by which the other tables
+// refer to it; its text _dbid is stored just once, in htsfiles.
 const char* schema =
     "begin;"
-    "create table if not exists htsfiles (_dbid text primary key, format text not null, \
-        namespace text not null, accession text not null, url text not null, \
+    "create table if not exists htsfiles (file_id integer primary key, _dbid text not null unique, \
+        format text not null, namespace text not null, accession text not null, url text not null, \
         file_size integer check(file_size is null or file_size > 0));"
     "create unique index if not exists htsfiles_namespace_accession on htsfiles(namespace,accession,format);"
-    "create table if not exists htsfiles_blocks_meta (_dbid text primary key, reference text not null, \
+    "create table if not exists htsfiles_blocks_meta (file_id integer primary key, reference text not null, \
         header text not null, slice_prefix blob, slice_suffix blob, \
-        foreign key(_dbid) references htsfiles(_dbid));"
-    "create table if not exists htsfiles_blocks (_dbid text not null, \
+        foreign key(file_id) references htsfiles(file_id));"
+    "create table if not exists htsfiles_seqs (file_id integer not null, tid integer not null check(tid >= 0), \
+        name text not null, length integer check(length is null or length >= 0), \
+        primary key(file_id,tid), foreign key(file_id) references htsfiles(file_id));"
+    "create unique index if not exists htsfiles_seqs_name on htsfiles_seqs(file_id,name);"
+    "create table if not exists htsfiles_blocks (file_id integer not null, \
+        byteLo integer not null check(byteLo >= 0), byteHi integer not null check(byteHi > byteLo), \
+        tid integer not null check(tid >= 0 or (tid = -1 and seqLo is null and seqHi is null)), \
+        seqLo integer check(tid = -1 or (seqLo is not null and seqLo >= 0)), \
+        seqHi integer check(tid = -1 or (seqHi is not null and seqHi >= seqLo)), \
+        block_prefix blob, block_suffix blob, foreign key(file_id) references htsfiles_blocks_meta(file_id));"
+    "create index if not exists htsfiles_blocks_index1 on htsfiles_blocks(file_id,tid,seqLo,seqHi);"
+    "create index if not exists htsfiles_blocks_index2 on htsfiles_blocks(file_id,tid,seqHi);"
+    "create table if not exists htsfiles_coverage (file_id integer not null, tid integer not null check(tid >= 0), \
+        binLo integer not null check(binLo >= 0), binHi integer not null check(binHi > binLo), \
+        reads integer not null check(reads >= 0), bases integer not null check(bases >= 0), \
+        bytes integer not null check(bytes >= 0), foreign key(file_id) references htsfiles(file_id));"
+    "create index if not exists htsfiles_coverage_index on htsfiles_coverage(file_id,tid,binLo);"
+    "create table if not exists htsfiles_chunks (file_id integer not null, \
         byteLo integer not null check(byteLo >= 0), byteHi integer not null check(byteHi > byteLo), \
-        seq text check(seq is not null or (seqLo is null and seqHi is null)), \
-        seqLo integer check(seq is null or (seqLo is not null and seqLo >= 0)), \
-        seqHi integer check(seq is null or (seqHi is not null and seqHi >= seqLo)), \
-        block_prefix blob, block_suffix blob, foreign key(_dbid) references htsfiles_index_meta(_dbid));"
-    "create index if not exists htsfiles_blocks_index1 on htsfiles_blocks(_dbid,seq,seqLo,seqHi);"
-    "create index if not exists htsfiles_blocks_index2 on htsfiles_blocks(_dbid,seq,seqHi);"
+        foreign key(file_id) references htsfiles(file_id));"
+    "create index if not exists htsfiles_chunks_index on htsfiles_chunks(file_id,byteLo);"
+    "create table if not exists htsfiles_blocks_summary (file_id integer not null, tid integer not null check(tid >= -1), \
+        blocks integer not null check(blocks >= 0), seqLo integer, seqHi integer, byteLo integer, byteHi integer, \
+        contiguous integer not null, bin_size integer, occupancy blob, \
+        primary key(file_id,tid), foreign key(file_id) references htsfiles_blocks_meta(file_id));"
     "commit";
 
+// read a single integer from the database
+int select_int(sqlite3* dbh, const char* db, const char* sql) {
+    sqlite3_stmt *raw = 0;
+    if (sqlite3_prepare_v2(dbh, sql, -1, &raw, 0)) {
+        throw runtime_error(string("Failed to prepare statement: ") + sqlite3_errmsg(dbh));
+    }
+    shared_ptr<sqlite3_stmt> stmt(raw, &sqlite3_finalize);
+    if (sqlite3_step(stmt.get()) != SQLITE_ROW) {
+        throw runtime_error(string("Error reading database ") + db + ": " + sqlite3_errmsg(dbh));
+    }
+    return sqlite3_column_int(stmt.get(), 0);
+}
+
+// Check that an existing database has the schema version we expect. A
+// database lacking the htsfiles table is new and passes the check.
+void check_schema_version(sqlite3* dbh, const char* db) {
+    if (!select_int(dbh, db, "select count(*) from sqlite_master where type = 'table' and name = 'htsfiles'")) {
+        return;
+    }
+    int version = select_int(dbh, db, "pragma user_version");
+    if (version != schema_version) {
+        ostringstream msg;
+        msg << "Database " << db << " has schema version " << version << ", expected " << schema_version;
+        if (version < schema_version) {
+            msg << "; upgrade it with htsnexus_migrate_database.sh";
+        }
+        throw runtime_error(msg.str());
+    }
+}
+
 // open the htsnexus index database, or create it if necessary.
 shared_ptr<sqlite3> open_database(const char* db) {
     sqlite3* raw;
@@ -39,9 +99,11 @@ shared_ptr<sqlite3> open_database(const char* db) {
     }
 
     shared_ptr<sqlite3> dbh(raw, &sqlite3_close);
+    check_schema_version(dbh.get(), db);
 
     char *errmsg = 0;
-    c = sqlite3_exec(dbh.get(), schema, 0, 0, &errmsg);
+    string versioned_schema = string(schema) + ";pragma user_version = " + to_string(schema_version);
+    c = sqlite3_exec(dbh.get(), versioned_schema.c_str(), 0, 0, &errmsg);
     if (c) {
         ostringstream msg;
         msg << "Error applying schema in database %s" << db;
@@ -55,6 +117,20 @@ shared_ptr<sqlite3> open_database(const char* db) {
     return dbh;
 }
 
+// open an existing htsnexus index database for reading only
+shared_ptr<sqlite3> open_database_readonly(const char* db) {
+    sqlite3* raw;
+    int c = sqlite3_open_v2(db, &raw, SQLITE_OPEN_READONLY, 0);
+    if (c) {
+        ostringstream msg;
+        msg << "Error opening database " << db << ": " << sqlite3_errstr(c);
+        throw runtime_error(msg.str());
+    }
+    shared_ptr<sqlite3> dbh(raw, &sqlite3_close);
+    check_schema_version(dbh.get(), db);
+    return dbh;
+}
+
 // derive a database ID for this file; it should be sufficiently unique to
 // permit naive merging of databases indexing different sets of files
 string derive_dbid(const char* name_space, const char* accession, const char* format, const char* fn, const char* url) {
@@ -65,14 +141,15 @@ string derive_dbid(const char* name_space, const char* accession, const char* fo
 }
 
 // insert the core entry in the htsfiles table. set file_size to negative if
-// that information is not known.
-void insert_htsfile(sqlite3* dbh, const char* dbid, const char* format, const char* name_space,
-                    const char* accession, const char* url, ssize_t file_size) {
+// that information is not known. Returns the file_id assigned to it, by which
+// the other tables refer to the file.
+int64_t insert_htsfile(sqlite3* dbh, const char* dbid, const char* format, const char* name_space,
+                       const char* accession, const char* url, ssize_t file_size) {
 
 	ostringstream msg;
 	msg << "Inserting BAM index info to SQLite db: " << dbid;
     sqlite3_stmt *raw = 0;
-    if (sqlite3_prepare_v2(dbh, "insert into htsfiles values(?,?,?,?,?,?)", -1, &raw, 0)) {
+    if (sqlite3_prepare_v2(dbh, "insert into htsfiles(_dbid,format,namespace,accession,url,file_size) values(?,?,?,?,?,?)", -1, &raw, 0)) {
         throw runtime_error("Failed to prepare statement: insert into htsfiles...\n");
     }
     shared_ptr<sqlite3_stmt> stmt(raw, &sqlite3_finalize);
@@ -93,10 +170,176 @@ void insert_htsfile(sqlite3* dbh, const char* dbid, const char* format, const ch
         msg << "Error inserting htsfiles entry: " << sqlite3_errstr(c);
         throw runtime_error(msg.str());
     }
+
+    return sqlite3_last_insert_rowid(dbh);
+}
+
+// record the size of a file whose htsfiles entry was inserted before it was
+// known (e.g. read from a pipe)
+void update_htsfile_size(sqlite3* dbh, int64_t file_id, int64_t file_size) {
+    sqlite3_stmt *raw = 0;
+    if (sqlite3_prepare_v2(dbh, "update htsfiles set file_size = ? where file_id = ?", -1, &raw, 0)) {
+        throw runtime_error("Failed to prepare statement: update htsfiles...\n");
+    }
+    shared_ptr<sqlite3_stmt> stmt(raw, &sqlite3_finalize);
+
+    if ((file_size > 0 ? sqlite3_bind_int64(stmt.get(), 1, file_size)
+                       : sqlite3_bind_null(stmt.get(), 1)) ||
+        sqlite3_bind_int64(stmt.get(), 2, file_id)) {
+        throw runtime_error("Failed to bind: update htsfiles...");
+    }
+
+    int c = sqlite3_step(stmt.get());
+    if (c != SQLITE_DONE) {
+        ostringstream msg;
+        msg << "Error updating htsfiles entry: " << sqlite3_errstr(c);
+        throw runtime_error(msg.str());
+    }
+}
+
+// look up the file_id of the file with the given _dbid, which must have a
+// block-level range index
+int64_t find_indexed_file(sqlite3* dbh, const string& dbid) {
+    sqlite3_stmt *raw = 0;
+    if (sqlite3_prepare_v2(dbh, "select file_id from htsfiles join htsfiles_blocks_meta using (file_id) where _dbid = ?", -1, &raw, 0)) {
+        throw runtime_error(string("Failed to prepare statement: ") + sqlite3_errmsg(dbh));
+    }
+    shared_ptr<sqlite3_stmt> stmt(raw, &sqlite3_finalize);
+    if (sqlite3_bind_text(stmt.get(), 1, dbid.c_str(), -1, 0)) {
+        throw runtime_error("Failed to bind: select from htsfiles...");
+    }
+    int c = sqlite3_step(stmt.get());
+    if (c == SQLITE_DONE) {
+        throw runtime_error("No block-level range index available for " + dbid);
+    } else if (c != SQLITE_ROW) {
+        ostringstream msg;
+        msg << "Error reading htsfiles: " << sqlite3_errstr(c);
+        throw runtime_error(msg.str());
+    }
+    return sqlite3_column_int64(stmt.get(), 0);
+}
+
+// For --append: look up the file_id of the file with the given _dbid if it
+// already has a block-level range index, or return -1 if it doesn't (and can
+// be indexed from scratch)
+int64_t find_append_file(sqlite3* dbh, const string& dbid) {
+    sqlite3_stmt *raw = 0;
+    if (sqlite3_prepare_v2(dbh, "select file_id from htsfiles join htsfiles_blocks_meta using (file_id) where _dbid = ?", -1, &raw, 0)) {
+        throw runtime_error(string("Failed to prepare statement: ") + sqlite3_errmsg(dbh));
+    }
+    shared_ptr<sqlite3_stmt> stmt(raw, &sqlite3_finalize);
+    if (sqlite3_bind_text(stmt.get(), 1, dbid.c_str(), -1, 0)) {
+        throw runtime_error("Failed to bind: select from htsfiles...");
+    }
+    int c = sqlite3_step(stmt.get());
+    if (c == SQLITE_DONE) {
+        return -1;
+    } else if (c != SQLITE_ROW) {
+        ostringstream msg;
+        msg << "Error reading htsfiles: " << sqlite3_errstr(c);
+        throw runtime_error(msg.str());
+    }
+    return sqlite3_column_int64(stmt.get(), 0);
+}
+
+// For --append: check that the file's header and reference are the same as
+// when it was indexed, and return the byte offset at which to resume indexing
+// (the end of the last indexed block, or 0 if there are none)
+int64_t find_append_offset(sqlite3* dbh, int64_t file_id, const char* reference, const string& header) {
+    sqlite3_stmt *raw = 0;
+    if (sqlite3_prepare_v2(dbh, "select reference, header, (select max(byteHi) from htsfiles_blocks where file_id = ?1) "
+                                "from htsfiles_blocks_meta where file_id = ?1", -1, &raw, 0)) {
+        throw runtime_error(string("Failed to prepare statement: ") + sqlite3_errmsg(dbh));
+    }
+    shared_ptr<sqlite3_stmt> stmt(raw, &sqlite3_finalize);
+    if (sqlite3_bind_int64(stmt.get(), 1, file_id)) {
+        throw runtime_error("Failed to bind: select from htsfiles_blocks_meta...");
+    }
+    int c = sqlite3_step(stmt.get());
+    if (c != SQLITE_ROW) {
+        ostringstream msg;
+        msg << "Error reading htsfiles_blocks_meta: " << sqlite3_errstr(c);
+        throw runtime_error(msg.str());
+    }
+    if (string((const char*) sqlite3_column_text(stmt.get(), 0)) != reference) {
+        throw runtime_error(string("--append: file was indexed with reference ") +
+                            (const char*) sqlite3_column_text(stmt.get(), 0));
+    }
+    if (string((const char*) sqlite3_column_text(stmt.get(), 1), sqlite3_column_bytes(stmt.get(), 1)) != header) {
+        throw runtime_error("--append: file header has changed since it was indexed");
+    }
+    return sqlite3_column_int64(stmt.get(), 2);
+}
+
+// For --append: check whether the file's existing block index entries are
+// framed by their own prefix/suffix (as CRAM slices indexed with --slices).
+// Returns 1 if so, 0 if not, or -1 if there are no entries yet.
+int find_append_framing(sqlite3* dbh, int64_t file_id) {
+    sqlite3_stmt *raw = 0;
+    if (sqlite3_prepare_v2(dbh, "select block_prefix is not null or block_suffix is not null "
+                                "from htsfiles_blocks where file_id = ? limit 1", -1, &raw, 0)) {
+        throw runtime_error(string("Failed to prepare statement: ") + sqlite3_errmsg(dbh));
+    }
+    shared_ptr<sqlite3_stmt> stmt(raw, &sqlite3_finalize);
+    if (sqlite3_bind_int64(stmt.get(), 1, file_id)) {
+        throw runtime_error("Failed to bind: select from htsfiles_blocks...");
+    }
+    int c = sqlite3_step(stmt.get());
+    if (c == SQLITE_DONE) {
+        return -1;
+    } else if (c != SQLITE_ROW) {
+        ostringstream msg;
+        msg << "Error reading htsfiles_blocks: " << sqlite3_errstr(c);
+        throw runtime_error(msg.str());
+    }
+    return sqlite3_column_int(stmt.get(), 0);
+}
+
+// For --append: check that the first of the blocks appended from the given
+// byte offset follows the last of those before it in sort order (each of
+// the indexers checks the order among the blocks it scans)
+void check_append_order(sqlite3* dbh, int64_t file_id, int64_t offset) {
+    // the last (tid, seqLo) of the block ending at offset, and the first of
+    // the block starting at or after it, with the unmapped reads (-1) last
+    sqlite3_stmt *raw = 0;
+    if (sqlite3_prepare_v2(dbh,
+                           "select (select tid from htsfiles_blocks where file_id = ?1 and byteHi = ?2 "
+                           "        order by tid = -1 desc, tid desc, seqLo desc limit 1), "
+                           "       (select seqLo from htsfiles_blocks where file_id = ?1 and byteHi = ?2 "
+                           "        order by tid = -1 desc, tid desc, seqLo desc limit 1), "
+                           "       (select tid from htsfiles_blocks where file_id = ?1 and byteLo >= ?2 "
+                           "        order by byteLo, tid = -1, tid, seqLo limit 1), "
+                           "       (select seqLo from htsfiles_blocks where file_id = ?1 and byteLo >= ?2 "
+                           "        order by byteLo, tid = -1, tid, seqLo limit 1)",
+                           -1, &raw, 0)) {
+        throw runtime_error(string("Failed to prepare statement: ") + sqlite3_errmsg(dbh));
+    }
+    shared_ptr<sqlite3_stmt> stmt(raw, &sqlite3_finalize);
+    if (sqlite3_bind_int64(stmt.get(), 1, file_id) ||
+        sqlite3_bind_int64(stmt.get(), 2, offset)) {
+        throw runtime_error("Failed to bind: select from htsfiles_blocks...");
+    }
+    int c = sqlite3_step(stmt.get());
+    if (c != SQLITE_ROW) {
+        ostringstream msg;
+        msg << "Error reading htsfiles_blocks: " << sqlite3_errstr(c);
+        throw runtime_error(msg.str());
+    }
+    if (sqlite3_column_type(stmt.get(), 0) == SQLITE_NULL || sqlite3_column_type(stmt.get(), 2) == SQLITE_NULL) {
+        // nothing before or nothing appended
+        return;
+    }
+    int last_tid = sqlite3_column_int(stmt.get(), 0), last_lo = sqlite3_column_int(stmt.get(), 1),
+        next_tid = sqlite3_column_int(stmt.get(), 2), next_lo = sqlite3_column_int(stmt.get(), 3);
+    if (last_tid == -1 ? next_tid != -1
+                       : next_tid != -1 && (next_tid < last_tid || (next_tid == last_tid && next_lo < last_lo))) {
+        throw runtime_error("--append: data appended at byte offset " + to_string(offset) +
+                            " isn't sorted after the data already indexed");
+    }
 }
 
 // insert the index metadata entry for a file into htsfiles_blocks_meta
-void insert_block_index_meta(sqlite3* dbh, const char* reference, const char* dbid,
+void insert_block_index_meta(sqlite3* dbh, const char* reference, int64_t file_id,
                              const string& header, const string& prefix, const string& suffix) {
     sqlite3_stmt *raw = 0;
     if (sqlite3_prepare_v2(dbh, "insert into htsfiles_blocks_meta values(?,?,?,?,?)", -1, &raw, 0)) {
@@ -104,7 +347,7 @@ void insert_block_index_meta(sqlite3* dbh, const char* reference, const char* db
     }
     shared_ptr<sqlite3_stmt> stmt(raw, &sqlite3_finalize);
 
-    if (sqlite3_bind_text(stmt.get(), 1, dbid, -1, 0) ||
+    if (sqlite3_bind_int64(stmt.get(), 1, file_id) ||
         sqlite3_bind_text(stmt.get(), 2, reference, -1, 0) ||
         sqlite3_bind_text(stmt.get(), 3, header.c_str(), header.size(), 0) ||
         sqlite3_bind_null(stmt.get(), 4) ||
@@ -125,6 +368,39 @@ void insert_block_index_meta(sqlite3* dbh, const char* reference, const char* db
     }
 }
 
+// insert the file's sequence dictionary into htsfiles_seqs, mapping the
+// integer tids used in htsfiles_blocks and htsfiles_coverage to sequence
+// names. lengths may be empty, or hold negative values for unknown lengths.
+void insert_seqs(sqlite3* dbh, int64_t file_id, const vector<string>& names, const vector<int64_t>& lengths) {
+    sqlite3_stmt *raw = 0;
+    if (sqlite3_prepare_v2(dbh, "insert into htsfiles_seqs values(?,?,?,?)", -1, &raw, 0)) {
+        throw runtime_error("Failed to prepare statement: insert into htsfiles_seqs...\n");
+    }
+    shared_ptr<sqlite3_stmt> stmt(raw, &sqlite3_finalize);
+
+    for (size_t tid = 0; tid < names.size(); tid++) {
+        int64_t length = tid < lengths.size() ? lengths[tid] : -1;
+        if (sqlite3_bind_int64(stmt.get(), 1, file_id) ||
+            sqlite3_bind_int64(stmt.get(), 2, tid) ||
+            sqlite3_bind_text(stmt.get(), 3, names[tid].c_str(), -1, 0) ||
+            (length >= 0 ? sqlite3_bind_int64(stmt.get(), 4, length)
+                         : sqlite3_bind_null(stmt.get(), 4))) {
+            throw runtime_error("Failed to bind: insert into htsfiles_seqs...");
+        }
+
+        int c = sqlite3_step(stmt.get());
+        if (c != SQLITE_DONE) {
+            ostringstream msg;
+            msg << "Error inserting htsfiles_seqs entry: " << sqlite3_errstr(c);
+            throw runtime_error(msg.str());
+        }
+
+        if (sqlite3_reset(stmt.get())) {
+            throw runtime_error("Error resetting statement: insert into htsfiles_seqs...");
+        }
+    }
+}
+
 // prepare the statement to insert an entry into htsfiles_blocks
 shared_ptr<sqlite3_stmt> prepare_insert_block(sqlite3* dbh) {
     sqlite3_stmt *raw = 0;
@@ -135,7 +411,7 @@ shared_ptr<sqlite3_stmt> prepare_insert_block(sqlite3* dbh) {
 }
 
 // insert one entry in htsfiles_blocks, given the prepared statement
-void insert_block_index_entry(sqlite3_stmt* insert_block_stmt, const char* dbid,
+void insert_block_index_entry(sqlite3_stmt* insert_block_stmt, int64_t file_id,
                               const vector<string>& target_names,
                               int64_t block_lo, int64_t block_hi,
                               int tid, int seq_lo, int seq_hi,
@@ -144,19 +420,19 @@ void insert_block_index_entry(sqlite3_stmt* insert_block_stmt, const char* dbid,
         throw runtime_error("Invalid tid in BAM: " + to_string(tid));
     }
 
-    if (sqlite3_bind_text(insert_block_stmt, 1, dbid, -1, 0) ||
+    if (sqlite3_bind_int64(insert_block_stmt, 1, file_id) ||
         sqlite3_bind_int64(insert_block_stmt, 2, block_lo) ||
-        sqlite3_bind_int64(insert_block_stmt, 3, block_hi)) {
+        sqlite3_bind_int64(insert_block_stmt, 3, block_hi) ||
+        sqlite3_bind_int(insert_block_stmt, 4, tid)) {
         throw runtime_error("Failed to bind: insert into htsfiles_blocks...");
     }
-    for (int i = 4; i <= 8; i++) {
+    for (int i = 5; i <= 8; i++) {
         if (sqlite3_bind_null(insert_block_stmt, i)) {
             throw runtime_error("Failed to bind: insert into htsfiles_blocks...");
         }
     }
     if (tid != -1) {
-        if (sqlite3_bind_text(insert_block_stmt, 4, target_names.at(tid).c_str(), -1, 0) ||
-            sqlite3_bind_int64(insert_block_stmt, 5, seq_lo) ||
+        if (sqlite3_bind_int64(insert_block_stmt, 5, seq_lo) ||
             sqlite3_bind_int64(insert_block_stmt, 6, seq_hi)) {
             throw runtime_error("Failed to bind: insert into htsfiles_blocks...");
         }
@@ -178,6 +454,403 @@ void insert_block_index_entry(sqlite3_stmt* insert_block_stmt, const char* dbid,
     }
 }
 
+// prepare the statement to insert an entry into htsfiles_coverage
+shared_ptr<sqlite3_stmt> prepare_insert_coverage(sqlite3* dbh) {
+    sqlite3_stmt *raw = 0;
+    if (sqlite3_prepare_v2(dbh, "insert into htsfiles_coverage values(?,?,?,?,?,?,?)", -1, &raw, 0)) {
+        throw runtime_error("Failed to prepare statement: insert into htsfiles_coverage...\n");
+    }
+    return shared_ptr<sqlite3_stmt>(raw, [](sqlite3_stmt* s) { sqlite3_finalize(s); });
+}
+
+// insert one coverage histogram bin in htsfiles_coverage, given the prepared
+// statement
+void insert_coverage_entry(sqlite3_stmt* insert_coverage_stmt, int64_t file_id, int tid,
+                           int64_t bin_lo, int64_t bin_hi, int64_t reads, int64_t bases, int64_t bytes) {
+    if (sqlite3_bind_int64(insert_coverage_stmt, 1, file_id) ||
+        sqlite3_bind_int(insert_coverage_stmt, 2, tid) ||
+        sqlite3_bind_int64(insert_coverage_stmt, 3, bin_lo) ||
+        sqlite3_bind_int64(insert_coverage_stmt, 4, bin_hi) ||
+        sqlite3_bind_int64(insert_coverage_stmt, 5, reads) ||
+        sqlite3_bind_int64(insert_coverage_stmt, 6, bases) ||
+        sqlite3_bind_int64(insert_coverage_stmt, 7, bytes)) {
+        throw runtime_error("Failed to bind: insert into htsfiles_coverage...");
+    }
+
+    int c = sqlite3_step(insert_coverage_stmt);
+    if (c != SQLITE_DONE) {
+        ostringstream msg;
+        msg << "Error inserting htsfiles_coverage entry: " << sqlite3_errstr(c);
+        throw runtime_error(msg.str());
+    }
+
+    if (sqlite3_reset(insert_coverage_stmt)) {
+        throw runtime_error("Error resetting statement: insert into htsfiles_coverage...");
+    }
+}
+
+// Divide the file into chunks of roughly chunk_size bytes, with boundaries
+// falling on the block boundaries found in htsfiles_blocks, and insert them into
+// htsfiles_chunks. The server splits ticket byte ranges at these boundaries so
+// that clients can fetch the pieces in parallel, and retry or resume them
+// individually. If the file already has chunks (--append), the last one is
+// redone to extend over the blocks since added, which yields the same chunks
+// as starting over. Returns the number of chunks inserted.
+unsigned insert_chunks(sqlite3* dbh, int64_t file_id, int64_t chunk_size) {
+    sqlite3_stmt *raw = 0;
+    if (sqlite3_prepare_v2(dbh, "select max(byteLo) from htsfiles_chunks where file_id = ?", -1, &raw, 0)) {
+        throw runtime_error("Failed to prepare statement: select from htsfiles_chunks...\n");
+    }
+    shared_ptr<sqlite3_stmt> last_stmt(raw, &sqlite3_finalize);
+    if (sqlite3_bind_int64(last_stmt.get(), 1, file_id) || sqlite3_step(last_stmt.get()) != SQLITE_ROW) {
+        throw runtime_error("Error reading htsfiles_chunks");
+    }
+    // the first chunk also covers the file header, preceding the first block
+    int64_t chunk_lo = sqlite3_column_int64(last_stmt.get(), 0), hi = 0;
+    if (sqlite3_prepare_v2(dbh, "delete from htsfiles_chunks where file_id = ? and byteLo = ?", -1, &raw, 0)) {
+        throw runtime_error("Failed to prepare statement: delete from htsfiles_chunks...\n");
+    }
+    shared_ptr<sqlite3_stmt> delete_stmt(raw, &sqlite3_finalize);
+    if (sqlite3_bind_int64(delete_stmt.get(), 1, file_id) ||
+        sqlite3_bind_int64(delete_stmt.get(), 2, chunk_lo) ||
+        sqlite3_step(delete_stmt.get()) != SQLITE_DONE) {
+        throw runtime_error("Error deleting from htsfiles_chunks");
+    }
+
+    if (sqlite3_prepare_v2(dbh, "select distinct byteLo, byteHi from htsfiles_blocks where file_id = ? and byteLo >= ? order by byteLo", -1, &raw, 0)) {
+        throw runtime_error("Failed to prepare statement: select from htsfiles_blocks...\n");
+    }
+    shared_ptr<sqlite3_stmt> blocks_stmt(raw, &sqlite3_finalize);
+    if (sqlite3_prepare_v2(dbh, "insert into htsfiles_chunks values(?,?,?)", -1, &raw, 0)) {
+        throw runtime_error("Failed to prepare statement: insert into htsfiles_chunks...\n");
+    }
+    shared_ptr<sqlite3_stmt> insert_stmt(raw, &sqlite3_finalize);
+
+    unsigned count = 0;
+    auto insert = [&](int64_t lo, int64_t hi) {
+        if (sqlite3_bind_int64(insert_stmt.get(), 1, file_id) ||
+            sqlite3_bind_int64(insert_stmt.get(), 2, lo) ||
+            sqlite3_bind_int64(insert_stmt.get(), 3, hi)) {
+            throw runtime_error("Failed to bind: insert into htsfiles_chunks...");
+        }
+        int c = sqlite3_step(insert_stmt.get());
+        if (c != SQLITE_DONE) {
+            ostringstream msg;
+            msg << "Error inserting htsfiles_chunks entry: " << sqlite3_errstr(c);
+            throw runtime_error(msg.str());
+        }
+        if (sqlite3_reset(insert_stmt.get())) {
+            throw runtime_error("Error resetting statement: insert into htsfiles_chunks...");
+        }
+        count++;
+    };
+
+    if (sqlite3_bind_int64(blocks_stmt.get(), 1, file_id) ||
+        sqlite3_bind_int64(blocks_stmt.get(), 2, chunk_lo)) {
+        throw runtime_error("Failed to bind: select from htsfiles_blocks...");
+    }
+    int c;
+    while ((c = sqlite3_step(blocks_stmt.get())) == SQLITE_ROW) {
+        int64_t block_lo = sqlite3_column_int64(blocks_stmt.get(), 0);
+        if (block_lo - chunk_lo >= chunk_size) {
+            insert(chunk_lo, block_lo);
+            chunk_lo = block_lo;
+        }
+        hi = max(hi, (int64_t) sqlite3_column_int64(blocks_stmt.get(), 1));
+    }
+    if (c != SQLITE_DONE) {
+        ostringstream msg;
+        msg << "Error reading htsfiles_blocks: " << sqlite3_errstr(c);
+        throw runtime_error(msg.str());
+    }
+    if (hi > chunk_lo) {
+        insert(chunk_lo, hi);
+    }
+
+    return count;
+}
+
+// Summarize the file's htsfiles_blocks entries for each sequence in
+// htsfiles_blocks_summary, replacing any existing summary (--append): the
+// number of blocks, the extent of their genomic and byte ranges, and a bitmap
+// of the summary_bin_size genomic bins overlapped by any block (bit i of byte
+// i/8 for bin i). contiguous is set if the blocks have no prefix/suffix and
+// their byte ranges coalesce into one (so a query spanning the whole sequence
+// is answered by [byteLo,byteHi)). Every sequence in htsfiles_seqs gets a row,
+// as do the unmapped reads (tid -1, without a bitmap), so the servers can tell
+// that a sequence has no blocks without looking at htsfiles_blocks.
+const int64_t summary_bin_size = 1048576;
+
+void insert_blocks_summary(sqlite3* dbh, int64_t file_id) {
+    struct summary {
+        int64_t blocks = 0, seq_lo = -1, seq_hi = -1, byte_lo = -1, byte_hi = -1;
+        bool contiguous = true;
+        string occupancy;
+    };
+    map<int,summary> summaries;
+    summaries[-1] = summary();
+
+    sqlite3_stmt *raw = 0;
+    if (sqlite3_prepare_v2(dbh, "delete from htsfiles_blocks_summary where file_id = ?", -1, &raw, 0)) {
+        throw runtime_error("Failed to prepare statement: delete from htsfiles_blocks_summary...\n");
+    }
+    shared_ptr<sqlite3_stmt> delete_stmt(raw, &sqlite3_finalize);
+    if (sqlite3_bind_int64(delete_stmt.get(), 1, file_id) || sqlite3_step(delete_stmt.get()) != SQLITE_DONE) {
+        throw runtime_error("Error deleting from htsfiles_blocks_summary");
+    }
+
+    if (sqlite3_prepare_v2(dbh, "select tid from htsfiles_seqs where file_id = ?", -1, &raw, 0)) {
+        throw runtime_error("Failed to prepare statement: select from htsfiles_seqs...\n");
+    }
+    shared_ptr<sqlite3_stmt> seqs_stmt(raw, &sqlite3_finalize);
+    if (sqlite3_bind_int64(seqs_stmt.get(), 1, file_id)) {
+        throw runtime_error("Failed to bind: select from htsfiles_seqs...");
+    }
+    int c;
+    while ((c = sqlite3_step(seqs_stmt.get())) == SQLITE_ROW) {
+        summaries[sqlite3_column_int(seqs_stmt.get(), 0)] = summary();
+    }
+    if (c != SQLITE_DONE) {
+        ostringstream msg;
+        msg << "Error reading htsfiles_seqs: " << sqlite3_errstr(c);
+        throw runtime_error(msg.str());
+    }
+
+    if (sqlite3_prepare_v2(dbh, "select tid, seqLo, seqHi, byteLo, byteHi, block_prefix is not null or block_suffix is not null \
+                                 from htsfiles_blocks where file_id = ? order by tid, byteLo", -1, &raw, 0)) {
+        throw runtime_error("Failed to prepare statement: select from htsfiles_blocks...\n");
+    }
+    shared_ptr<sqlite3_stmt> blocks_stmt(raw, &sqlite3_finalize);
+    if (sqlite3_bind_int64(blocks_stmt.get(), 1, file_id)) {
+        throw runtime_error("Failed to bind: select from htsfiles_blocks...");
+    }
+    while ((c = sqlite3_step(blocks_stmt.get())) == SQLITE_ROW) {
+        int tid = sqlite3_column_int(blocks_stmt.get(), 0);
+        int64_t byte_lo = sqlite3_column_int64(blocks_stmt.get(), 3), byte_hi = sqlite3_column_int64(blocks_stmt.get(), 4);
+        summary& s = summaries[tid];
+        if (s.blocks == 0) {
+            s.byte_lo = byte_lo;
+        } else if (byte_lo > s.byte_hi) {
+            s.contiguous = false;
+        }
+        s.byte_hi = max(s.byte_hi, byte_hi);
+        if (sqlite3_column_int(blocks_stmt.get(), 5)) {
+            s.contiguous = false;
+        }
+        if (tid >= 0) {
+            int64_t seq_lo = sqlite3_column_int64(blocks_stmt.get(), 1), seq_hi = sqlite3_column_int64(blocks_stmt.get(), 2);
+            s.seq_lo = s.blocks == 0 ? seq_lo : min(s.seq_lo, seq_lo);
+            s.seq_hi = max(s.seq_hi, seq_hi);
+            size_t bin_hi = seq_hi / summary_bin_size;
+            if (s.occupancy.size() <= bin_hi / 8) {
+                s.occupancy.resize(bin_hi / 8 + 1, 0);
+            }
+            for (size_t bin = seq_lo / summary_bin_size; bin <= bin_hi; bin++) {
+                s.occupancy[bin / 8] |= 1 << (bin % 8);
+            }
+        }
+        s.blocks++;
+    }
+    if (c != SQLITE_DONE) {
+        ostringstream msg;
+        msg << "Error reading htsfiles_blocks: " << sqlite3_errstr(c);
+        throw runtime_error(msg.str());
+    }
+
+    if (sqlite3_prepare_v2(dbh, "insert into htsfiles_blocks_summary values(?,?,?,?,?,?,?,?,?,?)", -1, &raw, 0)) {
+        throw runtime_error("Failed to prepare statement: insert into htsfiles_blocks_summary...\n");
+    }
+    shared_ptr<sqlite3_stmt> insert_stmt(raw, &sqlite3_finalize);
+    for (const auto& p : summaries) {
+        const summary& s = p.second;
+        if (sqlite3_bind_int64(insert_stmt.get(), 1, file_id) ||
+            sqlite3_bind_int(insert_stmt.get(), 2, p.first) ||
+            sqlite3_bind_int64(insert_stmt.get(), 3, s.blocks) ||
+            (s.blocks > 0 && p.first >= 0
+                ? (sqlite3_bind_int64(insert_stmt.get(), 4, s.seq_lo) || sqlite3_bind_int64(insert_stmt.get(), 5, s.seq_hi))
+                : (sqlite3_bind_null(insert_stmt.get(), 4) || sqlite3_bind_null(insert_stmt.get(), 5))) ||
+            (s.blocks > 0
+                ? (sqlite3_bind_int64(insert_stmt.get(), 6, s.byte_lo) || sqlite3_bind_int64(insert_stmt.get(), 7, s.byte_hi))
+                : (sqlite3_bind_null(insert_stmt.get(), 6) || sqlite3_bind_null(insert_stmt.get(), 7))) ||
+            sqlite3_bind_int(insert_stmt.get(), 8, s.blocks > 0 && s.contiguous ? 1 : 0) ||
+            (s.occupancy.empty()
+                ? (sqlite3_bind_null(insert_stmt.get(), 9) || sqlite3_bind_null(insert_stmt.get(), 10))
+                : (sqlite3_bind_int64(insert_stmt.get(), 9, summary_bin_size) ||
+                   sqlite3_bind_blob(insert_stmt.get(), 10, s.occupancy.data(), s.occupancy.size(), SQLITE_TRANSIENT)))) {
+            throw runtime_error("Failed to bind: insert into htsfiles_blocks_summary...");
+        }
+        c = sqlite3_step(insert_stmt.get());
+        if (c != SQLITE_DONE) {
+            ostringstream msg;
+            msg << "Error inserting htsfiles_blocks_summary entry: " << sqlite3_errstr(c);
+            throw runtime_error(msg.str());
+        }
+        if (sqlite3_reset(insert_stmt.get())) {
+            throw runtime_error("Error resetting statement: insert into htsfiles_blocks_summary...");
+        }
+    }
+}
+
+// Coalesce byte ranges [lo,hi), e.g. of the blocks matching a genomic range
+// query, into a sorted list of disjoint ranges, merging those separated by no
+// more than gap bytes. A negative gap merges everything into a single range.
+// Since the indexed blocks are record-aligned, concatenating the data in the
+// resulting ranges yields a valid stream containing all the matching records.
+vector<pair<int64_t,int64_t>> coalesce_byte_ranges(vector<pair<int64_t,int64_t>> ranges, int64_t gap) {
+    vector<pair<int64_t,int64_t>> ans;
+    sort(ranges.begin(), ranges.end());
+    for (const auto& r : ranges) {
+        if (!ans.empty() && (gap < 0 || r.first <= ans.back().second + gap)) {
+            ans.back().second = max(ans.back().second, r.second);
+        } else {
+            ans.push_back(r);
+        }
+    }
+    return ans;
+}
+
+// Answer a batch of genomic range queries (seq, lo, hi) against the block
+// index of one file, returning the byte ranges of the blocks overlapping any
+// of them (seq "*" selects the unmapped reads), as (byteLo, byteHi,
+// block_prefix, block_suffix) in file order. As in the servers, blocks with a
+// prefix or suffix (e.g. CRAM slices, framed as standalone containers) are
+// returned individually with them, while the others are coalesced. Rather
+// than a range scan per query, the queries are merged into disjoint sorted
+// intervals for each sequence, which are swept in one pass alongside the
+// sequence's blocks (ordered by seqLo through htsfiles_blocks_index1), so the
+// cost is about O(queries + blocks).
+vector<tuple<int64_t,int64_t,string,string>> query_byte_ranges(sqlite3* dbh, int64_t file_id,
+                                                               const vector<tuple<string,int64_t,int64_t>>& regions,
+                                                               int64_t gap) {
+    map<string,vector<pair<int64_t,int64_t>>> intervals;
+    for (const auto& r : regions) {
+        if (get<2>(r) < get<1>(r)) {
+            throw runtime_error("invalid genomic range " + get<0>(r) + ":" + to_string(get<1>(r)) + "-" + to_string(get<2>(r)));
+        }
+        intervals[get<0>(r)].push_back(make_pair(get<1>(r), get<2>(r)));
+    }
+
+    // look up the tids of the sequence names
+    sqlite3_stmt *raw = 0;
+    if (sqlite3_prepare_v2(dbh, "select name, tid from htsfiles_seqs where file_id = ?", -1, &raw, 0)) {
+        throw runtime_error("Failed to prepare statement: select from htsfiles_seqs...\n");
+    }
+    shared_ptr<sqlite3_stmt> seqs_stmt(raw, &sqlite3_finalize);
+    if (sqlite3_bind_int64(seqs_stmt.get(), 1, file_id)) {
+        throw runtime_error("Failed to bind: select from htsfiles_seqs...");
+    }
+    map<string,int> tids;
+    int c;
+    while ((c = sqlite3_step(seqs_stmt.get())) == SQLITE_ROW) {
+        tids[string((const char*) sqlite3_column_text(seqs_stmt.get(), 0))] = sqlite3_column_int(seqs_stmt.get(), 1);
+    }
+    if (c != SQLITE_DONE) {
+        ostringstream msg;
+        msg << "Error reading htsfiles_seqs: " << sqlite3_errstr(c);
+        throw runtime_error(msg.str());
+    }
+    tids["*"] = -1;
+
+    if (sqlite3_prepare_v2(dbh, "select seqLo, seqHi, byteLo, byteHi, block_prefix, block_suffix from htsfiles_blocks where file_id = ? and tid = ? order by seqLo", -1, &raw, 0)) {
+        throw runtime_error("Failed to prepare statement: select from htsfiles_blocks...\n");
+    }
+    shared_ptr<sqlite3_stmt> seq_stmt(raw, &sqlite3_finalize);
+
+    vector<pair<int64_t,int64_t>> plain;
+    map<pair<int64_t,int64_t>,pair<string,string>> framed;
+    auto add_block = [&](sqlite3_stmt* stmt) {
+        auto range = make_pair(sqlite3_column_int64(stmt, 2), sqlite3_column_int64(stmt, 3));
+        if (sqlite3_column_type(stmt, 4) == SQLITE_NULL && sqlite3_column_type(stmt, 5) == SQLITE_NULL) {
+            plain.push_back(range);
+        } else {
+            auto blob = [stmt](int col) {
+                return string((const char*) sqlite3_column_blob(stmt, col), sqlite3_column_bytes(stmt, col));
+            };
+            framed[range] = make_pair(blob(4), blob(5));
+        }
+    };
+    for (auto& it : intervals) {
+        auto tid = tids.find(it.first);
+        if (tid == tids.end()) {
+            continue;
+        }
+        sqlite3_stmt* stmt = seq_stmt.get();
+        if (sqlite3_reset(stmt) || sqlite3_bind_int64(stmt, 1, file_id) ||
+            sqlite3_bind_int(stmt, 2, tid->second)) {
+            throw runtime_error("Failed to bind: select from htsfiles_blocks...");
+        }
+
+        // merge the queries on this sequence into disjoint sorted intervals
+        // (like the servers, a block [seqLo,seqHi] overlaps query [lo,hi] if
+        // seqLo <= hi and seqHi >= lo, so touching intervals can be merged)
+        auto& iv = it.second;
+        sort(iv.begin(), iv.end());
+        size_t n = 0;
+        for (size_t i = 1; i < iv.size(); i++) {
+            if (iv[i].first <= iv[n].second) {
+                iv[n].second = max(iv[n].second, iv[i].second);
+            } else {
+                iv[++n] = iv[i];
+            }
+        }
+        iv.resize(n+1);
+
+        // Sweep: since the blocks come in seqLo order, the first interval
+        // ending at or after seqLo only moves forward. The block overlaps some
+        // interval iff it overlaps that one, as the later ones start after it.
+        size_t j = 0;
+        while ((c = sqlite3_step(stmt)) == SQLITE_ROW) {
+            if (tid->second == -1) {
+                // unmapped reads
+                add_block(stmt);
+                continue;
+            }
+            int64_t seq_lo = sqlite3_column_int64(stmt, 0), seq_hi = sqlite3_column_int64(stmt, 1);
+            while (j < iv.size() && iv[j].second < seq_lo) {
+                j++;
+            }
+            if (j == iv.size()) {
+                break;
+            }
+            if (iv[j].first <= seq_hi) {
+                add_block(stmt);
+            }
+        }
+        if (c != SQLITE_ROW && c != SQLITE_DONE) {
+            ostringstream msg;
+            msg << "Error reading htsfiles_blocks: " << sqlite3_errstr(c);
+            throw runtime_error(msg.str());
+        }
+    }
+
+    vector<tuple<int64_t,int64_t,string,string>> ans;
+    for (const auto& r : coalesce_byte_ranges(move(plain), gap)) {
+        ans.push_back(make_tuple(r.first, r.second, string(), string()));
+    }
+    for (const auto& f : framed) {
+        ans.push_back(make_tuple(f.first.first, f.first.second, f.second.first, f.second.second));
+    }
+    sort(ans.begin(), ans.end());
+    return ans;
+}
+
+string base64_encode(const void* data, size_t len) {
+    static const char* digits = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    const unsigned char* p = (const unsigned char*) data;
+    string ans;
+    ans.reserve(4*((len+2)/3));
+    for (size_t i = 0; i < len; i += 3) {
+        uint32_t v = uint32_t(p[i]) << 16;
+        if (i+1 < len) v |= uint32_t(p[i+1]) << 8;
+        if (i+2 < len) v |= p[i+2];
+        ans += digits[(v >> 18) & 63];
+        ans += digits[(v >> 12) & 63];
+        ans += (i+1 < len) ? digits[(v >> 6) & 63] : '=';
+        ans += (i+2 < len) ? digits[v & 63] : '=';
+    }
+    return ans;
+}
+
 string bgzf_eof() {
     return string("\037\213\010\4\0\0\0\0\0\377\6\0\102\103\2\0\033\0\3\0\0\0\0\0\0\0\0\0", 28);
 }
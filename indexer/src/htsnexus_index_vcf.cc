@@ -6,7 +6,13 @@
 #include <string>
 #include <vector>
 #include <sstream>
+#include <functional>
+#include <thread>
+#include <exception>
+#include <algorithm>
+#include <stdint.h>
 #include <stdlib.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -24,24 +30,50 @@ using namespace std;
 // htsnexus_index_util.cc prototypes
 shared_ptr<sqlite3> open_database(const char* db);
 string derive_dbid(const char* name_space, const char* accession, const char* format, const char* fn, const char* url);
-void insert_htsfile(sqlite3* dbh, const char* dbid, const char* format, const char* name_space,
-                    const char* accession, const char* url, ssize_t file_size);
-
-void insert_block_index_meta(sqlite3* dbh, const char* reference, const char* dbid,
+int64_t insert_htsfile(sqlite3* dbh, const char* dbid, const char* format, const char* name_space,
+                       const char* accession, const char* url, ssize_t file_size);
+void update_htsfile_size(sqlite3* dbh, int64_t file_id, int64_t file_size);
+int64_t find_append_file(sqlite3* dbh, const string& dbid);
+int64_t find_append_offset(sqlite3* dbh, int64_t file_id, const char* reference, const string& header);
+void check_append_order(sqlite3* dbh, int64_t file_id, int64_t offset);
+
+void insert_block_index_meta(sqlite3* dbh, const char* reference, int64_t file_id,
                              const string& header, const string& prefix, const string& suffix);
+void insert_seqs(sqlite3* dbh, int64_t file_id, const vector<string>& names, const vector<int64_t>& lengths);
 shared_ptr<sqlite3_stmt> prepare_insert_block(sqlite3* dbh);
-void insert_block_index_entry(sqlite3_stmt* insert_block_stmt, const char* dbid,
+void insert_block_index_entry(sqlite3_stmt* insert_block_stmt, int64_t file_id,
                               const vector<string>& target_names,
                               int64_t block_lo, int64_t block_hi,
                               int tid, int seq_lo, int seq_hi,
                               const string& prefix, const string& suffix);
+unsigned insert_chunks(sqlite3* dbh, int64_t file_id, int64_t chunk_size);
+void insert_blocks_summary(sqlite3* dbh, int64_t file_id);
 string bgzf_eof();
 
+// htsnexus_hfile.cc prototypes
+hFILE* hopen_input(const char* fn, const string& backend);
+void tee_stdin(const string& fn);
+int64_t finish_stdin();
+void follow_input(pid_t pid);
+int64_t finish_follow(const char* fn);
+
+// htsnexus_deflate.cc prototypes
+int bgzf_max_level();
+string bgzf_compress(const string& data, int level);
+int64_t bgzf_block_size(const unsigned char* header);
+
 /*************************************************************************************************/
 
-shared_ptr<bcf_hdr_t> read_vcf_header(const char* filename) {
-    shared_ptr<vcfFile> vcffile(vcf_open(filename, "r"), [](vcfFile* f) { vcf_close(f); });
+// Open the VCF file and read its header, leaving the file positioned at the
+// beginning of the first record.
+shared_ptr<vcfFile> open_vcf(const char* filename, const string& io, shared_ptr<bcf_hdr_t>& header) {
+    hFILE* hf = hopen_input(filename, io);
+    if (!hf) {
+        throw runtime_error("opening " + string(filename));
+    }
+    shared_ptr<vcfFile> vcffile(hts_hopen(hf, filename, "r"), [](vcfFile* f) { vcf_close(f); });
     if (!vcffile) {
+        hclose(hf);
         throw runtime_error("opening " + string(filename));
     }
     if (vcffile->format.compression != bgzf) {
@@ -49,16 +81,15 @@ shared_ptr<bcf_hdr_t> read_vcf_header(const char* filename) {
     }
 
     // read the header
-    shared_ptr<bcf_hdr_t> header(vcf_hdr_read(vcffile.get()), [](bcf_hdr_t* h) { bcf_hdr_destroy(h); });
+    header.reset(vcf_hdr_read(vcffile.get()), [](bcf_hdr_t* h) { bcf_hdr_destroy(h); });
     if (!header) {
         throw runtime_error("reading VCF header from " + string(filename));
     }
-    return header;
+    return vcffile;
 }
 
-// Serialize the VCF header either in plain text or to a BGZF fragment to which
-// additional BGZF blocks can be appended.
-string generate_vcf_header(const bcf_hdr_t* header, bool bgzf_fragment) {
+// Serialize the VCF header in plain text.
+string generate_vcf_header(const bcf_hdr_t* header) {
     // open a temp file (descriptor)
     char tmpfn[256];
     strcpy(tmpfn, "/tmp/XXXXXX.vcf.gz");
@@ -73,7 +104,7 @@ string generate_vcf_header(const bcf_hdr_t* header, bool bgzf_fragment) {
         close(tmpfd);
         throw runtime_error("opening temp hFile");
     }
-    htsFile *tmphtsfile = hts_hopen(tmphfile, tmpfn, bgzf_fragment ? "wz" : "w");
+    htsFile *tmphtsfile = hts_hopen(tmphfile, tmpfn, "w");
     if (!tmphtsfile) {
         hclose(tmphfile);
         throw runtime_error("opening temp htsFile");
@@ -106,74 +137,71 @@ string generate_vcf_header(const bcf_hdr_t* header, bool bgzf_fragment) {
     unlink(tmpfn);
 
     // sanity-check the temp VCF file
-    if (!bgzf_fragment) {
-        string line1("##fileformat=VCF");
-        if (len <= line1.size() ||
-            memcmp((unsigned char*) buf.get(), line1.c_str(), line1.size()) ||
-            ((char*)buf.get())[len-1] != '\n') {
-            throw runtime_error("ill-formed temp VCF file");
-        }
-        return string((char*) buf.get(), len);;
+    string line1("##fileformat=VCF");
+    if (len <= line1.size() ||
+        memcmp((unsigned char*) buf.get(), line1.c_str(), line1.size()) ||
+        ((char*)buf.get())[len-1] != '\n') {
+        throw runtime_error("ill-formed temp VCF file");
     }
-
-    if (len <= 28 ||
-        memcmp((unsigned char*)buf.get(), "\x1F\x8B", 2) ||
-        memcmp((unsigned char*)buf.get() + len - 28, "\037\213\010\4\0\0\0\0\0\377\6\0\102\103\2\0\033\0\3\0\0\0\0\0\0\0\0\0", 28)) {
-        throw runtime_error("incomplete temp VCF file");
-    }
-
-    // return the header without the EOF marker
-    return string((char*) buf.get(), len - 28);
+    return string((char*) buf.get(), len);
 }
 
-// populate the block-level index for the VCF file (htsfiles_blocks_meta and htsfiles_blocks)
-unsigned vcf_block_index(sqlite3* dbh, const char* reference, const char* dbid, const char* filename) {
-    // read the header
-    shared_ptr<bcf_hdr_t> header = read_vcf_header(filename);
-
-    int nseqs = -1;
-    shared_ptr<const char*> _seqnames(bcf_hdr_seqnames(header.get(), &nseqs), free);
-    if (!_seqnames || nseqs <= 0) {
-        throw runtime_error("reading sequence names " + string(filename));
-    }
-    vector<string> seqnames;
-    for (int i = 0; i < nseqs; i++) {
-        const char* seqname_i = _seqnames.get()[i];
-        seqnames.push_back(string(seqname_i));
+// open the VCF file as BGZF
+shared_ptr<BGZF> open_vcf_bgzf(const char* filename, const string& io) {
+    hFILE* hf = hopen_input(filename, io);
+    if (!hf) {
+        throw runtime_error("opening BGZF " + string(filename));
     }
-
-    string vcf_header_txt = generate_vcf_header(header.get(), false);
-    string vcf_header_bgzf = generate_vcf_header(header.get(), true);
-
-    // insert the htsfiles_blocks_meta entry
-    insert_block_index_meta(dbh, reference, dbid, vcf_header_txt, vcf_header_bgzf, bgzf_eof());
-
-    // re-open as BGZF
-    shared_ptr<BGZF> bgzf(bgzf_open(filename, "r"), [](BGZF* f) { bgzf_close(f); });
+    shared_ptr<BGZF> bgzf(bgzf_hopen(hf, "r"), [](BGZF* f) { bgzf_close(f); });
     if (!bgzf) {
+        hclose(hf);
         throw runtime_error("opening BGZF " + string(filename));
     }
-    if (bgzf->block_address != 0) {
-        throw runtime_error("Unexpected: first BGZF block address != 0");
-    }
+    return bgzf;
+}
 
-    // Now scan the VCF file to populate the block index. This is a bit
-    // complicated because we're bookkeeping on two interleaved structures:
-    // the series of BGZF blocks, and the runs of records from the same
-    // reference sequence (we don't assume the boundaries align)
-    auto insert_block_stmt = prepare_insert_block(dbh);
+// Scan the VCF lines starting at BGZF block address range_lo (where bgzf must
+// be positioned), until the end of the file or of the first line ending at or
+// beyond block address range_hi. The index entries are reported through
+// emit(block_lo, block_hi, rid, lo, hi), and the rids of the first and last
+// records scanned through first_rid and last_rid (-1 if none). If
+// skip_partial_line is set, the first line is assumed to be the remainder of
+// a line begun before range_lo, and ignored.
+//
+// This is a bit complicated because we're bookkeeping on two interleaved
+// structures: the series of BGZF blocks, and the runs of records from the same
+// reference sequence (we don't assume the boundaries align)
+unsigned scan_vcf_blocks(BGZF* bgzf, bcf_hdr_t* header, size_t nseqs,
+                         int64_t range_lo, int64_t range_hi, bool skip_partial_line,
+                         const function<void(int64_t,int64_t,int,int,int)>& emit,
+                         int& first_rid, int& last_rid) {
     unsigned record_count = 0;
-    int64_t last_block_address = 0;
+    int64_t last_block_address = range_lo;
     // genomic ranges observed in the 'current' BGZF block
     vector<tuple<int,int,int>> block_ranges;
     // 'current' genomic range
     int rid = -1, lo = -1, hi = -1;
+    first_rid = -1;
+
+    // describe the current record for error messages
+    auto at_record = [&]() {
+        string ans = "at record " + to_string(record_count);
+        if (range_lo > 0) {
+            ans += " after byte offset " + to_string(range_lo);
+        }
+        return ans;
+    };
 
     shared_ptr<kstring_t> line((kstring_t*) calloc(1, sizeof(kstring_t)),
                                [](kstring_t* s) { if (s->s) free(s->s); free(s); });
     shared_ptr<bcf1_t> record(bcf_init(), &bcf_destroy);
-    int c;
-    while ((c = bgzf_getline(bgzf.get(), '\n', line.get())) >= 0) {
+    int c = 0;
+    while (bgzf->block_address < range_hi && (c = bgzf_getline(bgzf, '\n', line.get())) >= 0) {
+        if (skip_partial_line) {
+            skip_partial_line = false;
+            last_block_address = bgzf->block_address;
+            continue;
+        }
         if (line->l == 0 || line->s[0] == '#') {
             // skip header
             last_block_address = bgzf->block_address;
@@ -185,15 +213,15 @@ unsigned vcf_block_index(sqlite3* dbh, const char* reference, const char* dbid,
         }
         record_count++;
 
-        if (vcf_parse(line.get(), header.get(), record.get())) {
-            throw runtime_error("Error reading VCF line " + to_string(record_count));
+        if (vcf_parse(line.get(), header, record.get())) {
+            throw runtime_error("Error reading VCF line " + at_record());
         }
 
         if (rid >= 0 && rid != record->rid) {
             // transitioning from one reference sequence (rid) to the next;
             // record the range seen in this BGZF block so far
             if (record->rid != -1 && record->rid < rid) {
-                throw runtime_error("VCF not sorted (by sequence) at record " + to_string(record_count));
+                throw runtime_error("VCF not sorted (by sequence) " + at_record());
             }
             if (lo > -1) {
                 block_ranges.push_back(make_tuple(rid, lo, hi));
@@ -201,13 +229,16 @@ unsigned vcf_block_index(sqlite3* dbh, const char* reference, const char* dbid,
             lo = hi = -1;
         }
         rid = record->rid;
-        if (rid < 0 || rid >= seqnames.size()) {
-            throw runtime_error("VCF invalid reference sequence at record " + to_string(record_count));
+        if (rid < 0 || rid >= (int) nseqs) {
+            throw runtime_error("VCF invalid reference sequence " + at_record());
+        }
+        if (first_rid == -1) {
+            first_rid = rid;
         }
 
         // update genomic lo & hi to include this record's range
         if (record->pos < lo) {
-            throw runtime_error("VCF not sorted at record " + to_string(record_count));
+            throw runtime_error("VCF not sorted " + at_record());
         }
         if (lo == -1) {
             lo = record->pos;
@@ -216,7 +247,7 @@ unsigned vcf_block_index(sqlite3* dbh, const char* reference, const char* dbid,
 
         if (bgzf->block_address != last_block_address) {
             // that was the last record in a BGZF block; record the current
-            // range, and insert the index entries for that block
+            // range, and emit the index entries for that block
             if (bgzf->block_address < last_block_address) {
                 throw runtime_error("Unexpected BGZF block address");
             }
@@ -227,25 +258,248 @@ unsigned vcf_block_index(sqlite3* dbh, const char* reference, const char* dbid,
             block_ranges.push_back(make_tuple(rid, lo, hi));
             lo = hi = -1;
             for (const auto& r : block_ranges) {
-                insert_block_index_entry(insert_block_stmt.get(), dbid, seqnames,
-                                         last_block_address, bgzf->block_address,
-                                         get<0>(r), get<1>(r), get<2>(r),
-                                         string(), string());
+                emit(last_block_address, bgzf->block_address, get<0>(r), get<1>(r), get<2>(r));
             }
             block_ranges.clear();
             last_block_address = bgzf->block_address;
         }
     }
-    if (c != -1) {
+    if (c < -1) {
         throw runtime_error("Error reading VCF file, code " + to_string(c));
     }
     if (lo != -1 || !block_ranges.empty()) {
         // we assume that bgzf->block_address is updated in such a way that,
-        // by this point, we'll already have inserted the index entries for
+        // by this point, we'll already have emitted the index entries for
         // the last non-empty block
         throw runtime_error("Truncated VCF or unexpected BGZF/VCF reader behavior");
     }
 
+    last_rid = rid;
+    return record_count;
+}
+
+// Read through the VCF header lines to find the address of the BGZF block in
+// which the first record begins, or -1 if there are no records.
+int64_t find_first_record_block(BGZF* bgzf) {
+    shared_ptr<kstring_t> line((kstring_t*) calloc(1, sizeof(kstring_t)),
+                               [](kstring_t* s) { if (s->s) free(s->s); free(s); });
+    while (true) {
+        int64_t block_address = bgzf->block_address;
+        int block_offset = bgzf->block_offset;
+        int c = bgzf_getline(bgzf, '\n', line.get());
+        if (c == -1) {
+            return -1;
+        } else if (c < -1) {
+            throw runtime_error("Error reading VCF file, code " + to_string(c));
+        }
+        if (line->l > 0 && line->s[0] != '#') {
+            if (block_address == 0 || block_offset != 0) {
+                throw runtime_error("You must recompress this file using bgzip_lines. (First record must begin in a new BGZF block)");
+            }
+            return block_address;
+        }
+    }
+}
+
+// Enumerate the addresses of the BGZF blocks from offset until the end of the
+// file, reading only the block headers. Also returns the file size.
+vector<int64_t> enumerate_bgzf_blocks(const char* filename, int64_t offset, int64_t& file_size) {
+    shared_ptr<int> fd(new int(open(filename, O_RDONLY)), [](int* fd) { if (*fd >= 0) close(*fd); delete fd; });
+    if (*fd < 0) {
+        throw runtime_error("opening " + string(filename));
+    }
+    posix_fadvise(*fd, 0, 0, POSIX_FADV_RANDOM);
+
+    vector<int64_t> ans;
+    unsigned char hdr[18];
+    while (true) {
+        ssize_t n = pread(*fd, hdr, sizeof(hdr), offset);
+        if (n == 0) {
+            break;
+        }
+        int64_t bsize = n == sizeof(hdr) ? bgzf_block_size(hdr) : 0;
+        if (!bsize) {
+            throw runtime_error("Unexpected BGZF block header at byte offset " + to_string(offset));
+        }
+        ans.push_back(offset);
+        offset += bsize;
+    }
+    file_size = offset;
+    return ans;
+}
+
+// true if the uncompressed BGZF block at the given address ends with a newline
+bool bgzf_block_ends_line(BGZF* bgzf, int64_t block_address) {
+    if (bgzf_seek(bgzf, block_address << 16, SEEK_SET) < 0 || bgzf_read_block(bgzf)) {
+        throw runtime_error("Error reading BGZF block at byte offset " + to_string(block_address));
+    }
+    return bgzf->block_length == 0 || ((const char*) bgzf->uncompressed_block)[bgzf->block_length-1] == '\n';
+}
+
+// Scan the VCF records using multiple threads. A first pass reads only the BGZF
+// block headers to enumerate the blocks following the VCF header; these are
+// divided into contiguous ranges of similar compressed size, each of which is
+// scanned on its own thread. Finally the index entries from each range are
+// stitched together, checking the sort order across range boundaries. If
+// resume is positive, the blocks before it are skipped.
+unsigned vcf_block_index_parallel(sqlite3_stmt* insert_block_stmt, int64_t file_id,
+                                  const char* filename, const string& io,
+                                  bcf_hdr_t* header, const vector<string>& seqnames,
+                                  unsigned threads, int64_t resume) {
+    int64_t data_lo = resume > 0 ? resume : find_first_record_block(open_vcf_bgzf(filename, io).get());
+    if (data_lo < 0) {
+        return 0;
+    }
+    int64_t data_hi = 0;
+    vector<int64_t> blocks = enumerate_bgzf_blocks(filename, data_lo, data_hi);
+
+    // choose range boundaries at the first block starting after each 1/n-th
+    // of the compressed data
+    vector<size_t> range_starts;
+    for (unsigned k = 0; k < threads; k++) {
+        int64_t target = data_lo + (data_hi - data_lo) * k / threads;
+        size_t i = lower_bound(blocks.begin(), blocks.end(), target) - blocks.begin();
+        if (i < blocks.size() && (range_starts.empty() || i > range_starts.back())) {
+            range_starts.push_back(i);
+        }
+    }
+
+    struct range_result {
+        vector<tuple<int64_t,int64_t,int,int,int>> entries;
+        unsigned record_count = 0;
+        int first_rid = -1, last_rid = -1;
+        exception_ptr error;
+    };
+    vector<range_result> results(range_starts.size());
+    vector<thread> workers;
+    for (size_t k = 0; k < range_starts.size(); k++) {
+        workers.push_back(thread([&, k]() {
+            try {
+                auto bgzf = open_vcf_bgzf(filename, io);
+                shared_ptr<bcf_hdr_t> hdr(bcf_hdr_dup(header), [](bcf_hdr_t* h) { bcf_hdr_destroy(h); });
+                if (!hdr) {
+                    throw runtime_error("copying VCF header");
+                }
+
+                size_t i = range_starts[k];
+                int64_t range_lo = blocks[i];
+                int64_t range_hi = k+1 < range_starts.size() ? blocks[range_starts[k+1]] : INT64_MAX;
+                // does the range begin in the middle of a line (spanning
+                // multiple BGZF blocks)?
+                bool partial = i > 0 && !bgzf_block_ends_line(bgzf.get(), blocks[i-1]);
+                if (bgzf_seek(bgzf.get(), range_lo << 16, SEEK_SET) < 0) {
+                    throw runtime_error("Error seeking to BGZF block at byte offset " + to_string(range_lo));
+                }
+
+                auto& r = results[k];
+                r.record_count = scan_vcf_blocks(bgzf.get(), hdr.get(), seqnames.size(),
+                                                 range_lo, range_hi, partial,
+                                                 [&r](int64_t block_lo, int64_t block_hi, int rid, int lo, int hi) {
+                                                     r.entries.push_back(make_tuple(block_lo, block_hi, rid, lo, hi));
+                                                 },
+                                                 r.first_rid, r.last_rid);
+            } catch (...) {
+                results[k].error = current_exception();
+            }
+        }));
+    }
+    for (auto& t : workers) {
+        t.join();
+    }
+
+    // stitch the results together
+    unsigned record_count = 0;
+    int last_rid = -1;
+    for (size_t k = 0; k < results.size(); k++) {
+        const auto& r = results[k];
+        if (r.error) {
+            rethrow_exception(r.error);
+        }
+        if (r.first_rid != -1) {
+            if (r.first_rid < last_rid) {
+                throw runtime_error("VCF not sorted (by sequence) after byte offset " + to_string(blocks[range_starts[k]]));
+            }
+            last_rid = r.last_rid;
+        }
+        for (const auto& e : r.entries) {
+            insert_block_index_entry(insert_block_stmt, file_id, seqnames,
+                                     get<0>(e), get<1>(e), get<2>(e), get<3>(e), get<4>(e),
+                                     string(), string());
+        }
+        record_count += r.record_count;
+    }
+
+    return record_count;
+}
+
+// populate the block-level index for the VCF file (htsfiles_blocks_meta and
+// htsfiles_blocks), scanning with the given number of threads. If append is
+// set, the file is already indexed, and we resume scanning after the last
+// indexed block. The header fragment is compressed at the given level.
+unsigned vcf_block_index(sqlite3* dbh, const char* reference, int64_t file_id, const char* filename,
+                         const string& io, unsigned threads, bool append, int level) {
+    // read the header. The sequential scan then carries on from the same
+    // handle, so that it's a single pass, as needed for standard input.
+    shared_ptr<bcf_hdr_t> header;
+    shared_ptr<vcfFile> vcffile = open_vcf(filename, io, header);
+
+    int nseqs = -1;
+    shared_ptr<const char*> _seqnames(bcf_hdr_seqnames(header.get(), &nseqs), free);
+    if (!_seqnames || nseqs <= 0) {
+        throw runtime_error("reading sequence names " + string(filename));
+    }
+    vector<string> seqnames;
+    vector<int64_t> seqlens;
+    for (int i = 0; i < nseqs; i++) {
+        const char* seqname_i = _seqnames.get()[i];
+        seqnames.push_back(string(seqname_i));
+        // contig length from the ##contig header line, if given
+        uint32_t len = header->id[BCF_DT_CTG][i].val->info[0];
+        seqlens.push_back(len > 0 ? (int64_t) len : -1);
+    }
+
+    string vcf_header_txt = generate_vcf_header(header.get());
+
+    int64_t resume = 0;
+    if (append) {
+        resume = find_append_offset(dbh, file_id, reference, vcf_header_txt);
+    } else {
+        // insert the htsfiles_blocks_meta entry
+        insert_block_index_meta(dbh, reference, file_id, vcf_header_txt,
+                                bgzf_compress(vcf_header_txt, level), bgzf_eof());
+        insert_seqs(dbh, file_id, seqnames, seqlens);
+    }
+
+    auto insert_block_stmt = prepare_insert_block(dbh);
+    unsigned record_count;
+    if (threads > 1) {
+        vcffile.reset();
+        record_count = vcf_block_index_parallel(insert_block_stmt.get(), file_id, filename, io,
+                                                header.get(), seqnames, threads, resume);
+    } else {
+        // Now scan the VCF file to populate the block index, starting with the
+        // first record, which bgzip_lines began in a new BGZF block (or else
+        // with the first block not yet indexed)
+        BGZF* bgzf = vcffile->fp.bgzf;
+        if (resume > 0 && bgzf_seek(bgzf, resume << 16, SEEK_SET) < 0) {
+            throw runtime_error("Error seeking to BGZF block at byte offset " + to_string(resume));
+        }
+        if (bgzf->block_offset != 0) {
+            throw runtime_error("You must recompress this file using bgzip_lines. (First record must begin in a new BGZF block)");
+        }
+        int first_rid, last_rid;
+        record_count = scan_vcf_blocks(bgzf, header.get(), seqnames.size(), bgzf->block_address, INT64_MAX, false,
+                                       [&](int64_t block_lo, int64_t block_hi, int rid, int lo, int hi) {
+                                           insert_block_index_entry(insert_block_stmt.get(), file_id, seqnames,
+                                                                    block_lo, block_hi, rid, lo, hi,
+                                                                    string(), string());
+                                       },
+                                       first_rid, last_rid);
+    }
+
+    if (append) {
+        check_append_order(dbh, file_id, resume);
+    }
     return record_count;
 }
 
@@ -256,7 +510,8 @@ const char* usage =
     "  index.db    SQLite3 database (will be created if nonexistent)\n"
     "  namespace   accession namespace\n"
     "  accession   accession identifier\n"
-    "  local_file  filename to local copy of VCF\n"
+    "  local_file  filename to local copy of VCF, or - to read it from standard\n"
+    "              input (e.g. as it's being downloaded)\n"
     "  url         VCF URL to serve to clients\n"
     "The VCF file is added to the database (without a block-level range index)\n"
     "based on the above information.\n"
@@ -264,22 +519,90 @@ const char* usage =
     "  --reference <id>  generate the block-level range index and associate it with\n"
     "                    this (arbitrary, server-specific) reference genome ID.\n"
     "                    The file must be compressed using bgzip_lines.\n"
+    "  --io <backend>    input file access method: hfile (htslib default),\n"
+    "                    mmap, or direct\n"
+    "  --chunk-size <n>  with --reference, also record chunk boundaries dividing the\n"
+    "                    file into pieces of about this many bytes, which the server\n"
+    "                    uses to split tickets for parallel download (default: 1GiB)\n"
+    "  --tee <file>      with local_file -, also write the input to this file\n"
+    "  --append          if the file is already indexed, assume it has since grown\n"
+    "                    by appending, and index only the new data\n"
+    "  --follow <pid>    local_file is still being written by process pid (e.g. a\n"
+    "                    download); index it as it grows until pid exits (not\n"
+    "                    with --io)\n"
+    "  --threads <n>     scan the file using this many threads (default: 1; not\n"
+    "                    with local_file - or --follow)\n"
+    "  --level <n>       compression level for the BGZF header served ahead of the\n"
+    "                    file's blocks, 0-9, or up to 12 if built with libdeflate\n"
+    "                    (default: 6)\n"
 ;
 
 int main(int argc, char* argv[]) {
     static struct option long_options[] = {
         {"help", no_argument, 0, 'h'},
-        {"reference", required_argument, 0, 'r'}
+        {"reference", required_argument, 0, 'r'},
+        {"io", required_argument, 0, 'i'},
+        {"chunk-size", required_argument, 0, 'k'},
+        {"tee", required_argument, 0, 'T'},
+        {"append", no_argument, 0, 'a'},
+        {"follow", required_argument, 0, 'f'},
+        {"threads", required_argument, 0, 't'},
+        {"level", required_argument, 0, 'l'},
+        {0, 0, 0, 0}
     };
 
     string reference;
+    string io = "hfile";
+    int64_t chunk_size = 1073741824;
+    string tee;
+    bool append = false;
+    pid_t follow = 0;
+    int threads = 1;
+    int level = -1;
 
     int c;
-    while (-1 != (c = getopt_long(argc, argv, "hr:", long_options, 0))) {
+    while (-1 != (c = getopt_long(argc, argv, "hr:i:t:k:T:af:l:", long_options, 0))) {
         switch (c) {
             case 'r':
                 reference = optarg;
                 break;
+            case 'i':
+                io = optarg;
+                break;
+            case 'k':
+                chunk_size = atoll(optarg);
+                if (chunk_size <= 0) {
+                    cout << usage << endl;
+                    return 1;
+                }
+                break;
+            case 't':
+                threads = atoi(optarg);
+                if (threads <= 0) {
+                    cout << usage << endl;
+                    return 1;
+                }
+                break;
+            case 'T':
+                tee = optarg;
+                break;
+            case 'a':
+                append = true;
+                break;
+            case 'f':
+                follow = atoi(optarg);
+                if (follow <= 0) {
+                    cout << usage << endl;
+                    return 1;
+                }
+                break;
+            case 'l':
+                level = atoi(optarg);
+                if (level < 0 || level > bgzf_max_level()) {
+                    cout << usage << endl;
+                    return 1;
+                }
+                break;
             default:
                 cout << usage << endl;
                 return 1;
@@ -296,10 +619,22 @@ int main(int argc, char* argv[]) {
                *fn = argv[optind+3],
                *url = argv[optind+4];
 
-    // get the file size
+    bool stream = string(fn) == "-";
+    if ((!tee.empty() && !stream) || (follow && (stream || io != "hfile")) ||
+        ((stream || follow) && threads > 1) || (append && (stream || reference.empty()))) {
+        cout << usage << endl;
+        return 1;
+    }
+
+    // get the file size (or, reading standard input or following a growing
+    // file, record it once we've read through to the end)
     ssize_t file_size = -1;
     struct stat fnstat;
-    if (stat(fn, &fnstat) == 0) {
+    if (stream) {
+        tee_stdin(tee);
+    } else if (follow) {
+        follow_input(follow);
+    } else if (stat(fn, &fnstat) == 0) {
         file_size = fnstat.st_size;
     } else {
         cerr << "WARNING: couldn't open " << fn << ", recording unknown file size." << endl;
@@ -316,12 +651,26 @@ int main(int argc, char* argv[]) {
         throw runtime_error("failed to begin transaction...");
     }
 
-    // insert the basic htsfiles entry
-    insert_htsfile(dbh.get(), dbid.c_str(), "vcf", name_space, accession, url, file_size);
+    // insert the basic htsfiles entry, unless we're appending to the index of
+    // a file already in the database
+    int64_t file_id = append ? find_append_file(dbh.get(), dbid) : -1;
+    if (file_id < 0) {
+        append = false;
+        file_id = insert_htsfile(dbh.get(), dbid.c_str(), "vcf", name_space, accession, url, file_size);
+    } else {
+        update_htsfile_size(dbh.get(), file_id, file_size);
+    }
 
     if (!reference.empty()) {
         // build the block-level range index
-        vcf_block_index(dbh.get(), reference.c_str(), dbid.c_str(), fn);
+        vcf_block_index(dbh.get(), reference.c_str(), file_id, fn, io, threads, append, level);
+        insert_chunks(dbh.get(), file_id, chunk_size);
+        insert_blocks_summary(dbh.get(), file_id);
+    }
+    if (stream) {
+        update_htsfile_size(dbh.get(), file_id, finish_stdin());
+    } else if (follow) {
+        update_htsfile_size(dbh.get(), file_id, finish_follow(fn));
     }
 
     // commit the master transaction
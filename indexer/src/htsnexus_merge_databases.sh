@@ -17,10 +17,43 @@ if ! [ -f "$2" ]; then
     exit 1
 fi
 
+source_version=$(sqlite3 -batch "$1" "pragma user_version")
+destination_version=$(sqlite3 -batch "$2" "pragma user_version")
+if [ "$source_version" != "$destination_version" ]; then
+    echo "schema versions differ ($source_version vs. $destination_version); upgrade with htsnexus_migrate_database.sh"
+    exit 1
+fi
+
+# Databases generated by older indexer versions lack the per-sequence block
+# summaries; the servers do without them.
+summary_sql=""
+if [ "$(sqlite3 -batch "$1" "select count(*) from sqlite_master where type = 'table' and name = 'htsfiles_blocks_summary'")" = "1" ]; then
+    summary_sql="create table if not exists htsfiles_blocks_summary (file_id integer not null, tid integer not null check(tid >= -1), \
+    blocks integer not null check(blocks >= 0), seqLo integer, seqHi integer, byteLo integer, byteHi integer, \
+    contiguous integer not null, bin_size integer, occupancy blob, \
+    primary key(file_id,tid), foreign key(file_id) references htsfiles_blocks_meta(file_id));
+insert into htsfiles_blocks_summary select new_id, tid, blocks, seqLo, seqHi, byteLo, byteHi, contiguous, bin_size, occupancy \
+    from toMerge.htsfiles_blocks_summary join file_ids on old_id = file_id;"
+fi
+
+# The source files get new file_ids in the destination, following its
+# existing ones, and the rows of the other tables are remapped accordingly.
 sqlite3 -batch -bail "$2" "attach '$1' as toMerge;
 begin;
-insert into htsfiles select * from toMerge.htsfiles;
-insert into htsfiles_blocks_meta select * from toMerge.htsfiles_blocks_meta;
-insert into htsfiles_blocks select * from toMerge.htsfiles_blocks;
+insert into htsfiles(_dbid,format,namespace,accession,url,file_size) \
+    select _dbid, format, namespace, accession, url, file_size from toMerge.htsfiles order by file_id;
+create temp table file_ids (old_id integer primary key, new_id integer not null);
+insert into file_ids select s.file_id, d.file_id from toMerge.htsfiles s join main.htsfiles d using (_dbid);
+insert into htsfiles_blocks_meta select new_id, reference, header, slice_prefix, slice_suffix \
+    from toMerge.htsfiles_blocks_meta join file_ids on old_id = file_id;
+insert into htsfiles_seqs select new_id, tid, name, length \
+    from toMerge.htsfiles_seqs join file_ids on old_id = file_id;
+insert into htsfiles_blocks select new_id, byteLo, byteHi, tid, seqLo, seqHi, block_prefix, block_suffix \
+    from toMerge.htsfiles_blocks join file_ids on old_id = file_id;
+insert into htsfiles_coverage select new_id, tid, binLo, binHi, reads, bases, bytes \
+    from toMerge.htsfiles_coverage join file_ids on old_id = file_id;
+insert into htsfiles_chunks select new_id, byteLo, byteHi \
+    from toMerge.htsfiles_chunks join file_ids on old_id = file_id;
+$summary_sql
 commit;
 detach toMerge"
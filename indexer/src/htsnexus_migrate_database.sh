@@ -0,0 +1,145 @@
+#!/bin/bash
+# Upgrade an htsnexus index database created by an older version of the
+# indexer to the current schema version (see schema_version in
+# htsnexus_index_util.cc), applying each step in turn.
+set -e -o pipefail
+
+if [ $# -ne 1 ]; then
+    echo "Usage: htsnexus_migrate_database.sh index.db"
+    echo ""
+    echo "index.db is modified in-place!"
+    exit 1
+fi
+
+if ! [ -f "$1" ]; then
+    echo "does not exist: $1"
+    exit 1
+fi
+
+version=$(sqlite3 -batch "$1" "pragma user_version")
+
+if [ "$version" -lt 1 ]; then
+    # Version 1: sequence names move to htsfiles_seqs, and htsfiles_blocks and
+    # htsfiles_coverage refer to them by integer tid (-1 for unmapped blocks).
+    # The original header tids aren't known, so tids are assigned in order of
+    # first appearance in each file, and lengths are left null.
+    sqlite3 -batch -bail "$1" "begin;
+create table if not exists htsfiles_coverage (_dbid text not null, seq text not null, \
+    binLo integer not null, binHi integer not null, reads integer not null, bases integer not null, \
+    bytes integer not null);
+create table if not exists htsfiles_chunks (_dbid text not null, \
+    byteLo integer not null check(byteLo >= 0), byteHi integer not null check(byteHi > byteLo), \
+    foreign key(_dbid) references htsfiles(_dbid));
+create index if not exists htsfiles_chunks_index on htsfiles_chunks(_dbid,byteLo);
+
+create temp table seqs_v0 (_dbid text not null, name text not null);
+insert into seqs_v0 select _dbid, seq from \
+    (select _dbid, seq, byteLo from htsfiles_blocks where seq is not null \
+     union all select _dbid, seq, null from htsfiles_coverage) \
+    group by _dbid, seq order by _dbid, min(byteLo) is null, min(byteLo), seq;
+create table htsfiles_seqs (_dbid text not null, tid integer not null check(tid >= 0), \
+    name text not null, length integer check(length is null or length >= 0), \
+    primary key(_dbid,tid), foreign key(_dbid) references htsfiles(_dbid));
+create unique index htsfiles_seqs_name on htsfiles_seqs(_dbid,name);
+insert into htsfiles_seqs select _dbid, rowid - (select min(rowid) from seqs_v0 f where f._dbid = s._dbid), name, null \
+    from seqs_v0 s order by rowid;
+
+create table htsfiles_blocks_v1 (_dbid text not null, \
+    byteLo integer not null check(byteLo >= 0), byteHi integer not null check(byteHi > byteLo), \
+    tid integer not null check(tid >= 0 or (tid = -1 and seqLo is null and seqHi is null)), \
+    seqLo integer check(tid = -1 or (seqLo is not null and seqLo >= 0)), \
+    seqHi integer check(tid = -1 or (seqHi is not null and seqHi >= seqLo)), \
+    block_prefix blob, block_suffix blob, foreign key(_dbid) references htsfiles_index_meta(_dbid));
+insert into htsfiles_blocks_v1 select b._dbid, byteLo, byteHi, coalesce(s.tid, -1), seqLo, seqHi, block_prefix, block_suffix \
+    from htsfiles_blocks b left join htsfiles_seqs s on s._dbid = b._dbid and s.name = b.seq;
+drop table htsfiles_blocks;
+alter table htsfiles_blocks_v1 rename to htsfiles_blocks;
+create index htsfiles_blocks_index1 on htsfiles_blocks(_dbid,tid,seqLo,seqHi);
+create index htsfiles_blocks_index2 on htsfiles_blocks(_dbid,tid,seqHi);
+
+create table htsfiles_coverage_v1 (_dbid text not null, tid integer not null check(tid >= 0), \
+    binLo integer not null check(binLo >= 0), binHi integer not null check(binHi > binLo), \
+    reads integer not null check(reads >= 0), bases integer not null check(bases >= 0), \
+    bytes integer not null check(bytes >= 0), foreign key(_dbid) references htsfiles(_dbid));
+insert into htsfiles_coverage_v1 select c._dbid, s.tid, binLo, binHi, reads, bases, bytes \
+    from htsfiles_coverage c join htsfiles_seqs s on s._dbid = c._dbid and s.name = c.seq;
+drop table htsfiles_coverage;
+alter table htsfiles_coverage_v1 rename to htsfiles_coverage;
+create index htsfiles_coverage_index on htsfiles_coverage(_dbid,tid,binLo);
+
+pragma user_version = 1;
+commit;
+vacuum"
+    version=1
+fi
+
+if [ "$version" -lt 2 ]; then
+    # Version 2: each file gets an integer file_id (rowid alias) in htsfiles,
+    # by which the other tables refer to it instead of the text _dbid.
+    sqlite3 -batch -bail "$1" "begin;
+create table htsfiles_v2 (file_id integer primary key, _dbid text not null unique, \
+    format text not null, namespace text not null, accession text not null, url text not null, \
+    file_size integer check(file_size is null or file_size > 0));
+insert into htsfiles_v2(_dbid,format,namespace,accession,url,file_size) \
+    select _dbid, format, namespace, accession, url, file_size from htsfiles order by _dbid;
+
+create table htsfiles_blocks_meta_v2 (file_id integer primary key, reference text not null, \
+    header text not null, slice_prefix blob, slice_suffix blob, \
+    foreign key(file_id) references htsfiles(file_id));
+insert into htsfiles_blocks_meta_v2 select file_id, reference, header, slice_prefix, slice_suffix \
+    from htsfiles_blocks_meta join htsfiles_v2 using (_dbid);
+
+create table htsfiles_seqs_v2 (file_id integer not null, tid integer not null check(tid >= 0), \
+    name text not null, length integer check(length is null or length >= 0), \
+    primary key(file_id,tid), foreign key(file_id) references htsfiles(file_id));
+insert into htsfiles_seqs_v2 select file_id, tid, name, length \
+    from htsfiles_seqs join htsfiles_v2 using (_dbid);
+
+create table htsfiles_blocks_v2 (file_id integer not null, \
+    byteLo integer not null check(byteLo >= 0), byteHi integer not null check(byteHi > byteLo), \
+    tid integer not null check(tid >= 0 or (tid = -1 and seqLo is null and seqHi is null)), \
+    seqLo integer check(tid = -1 or (seqLo is not null and seqLo >= 0)), \
+    seqHi integer check(tid = -1 or (seqHi is not null and seqHi >= seqLo)), \
+    block_prefix blob, block_suffix blob, foreign key(file_id) references htsfiles_blocks_meta(file_id));
+insert into htsfiles_blocks_v2 select file_id, byteLo, byteHi, tid, seqLo, seqHi, block_prefix, block_suffix \
+    from htsfiles_blocks join htsfiles_v2 using (_dbid) order by file_id, byteLo;
+
+create table htsfiles_coverage_v2 (file_id integer not null, tid integer not null check(tid >= 0), \
+    binLo integer not null check(binLo >= 0), binHi integer not null check(binHi > binLo), \
+    reads integer not null check(reads >= 0), bases integer not null check(bases >= 0), \
+    bytes integer not null check(bytes >= 0), foreign key(file_id) references htsfiles(file_id));
+insert into htsfiles_coverage_v2 select file_id, tid, binLo, binHi, reads, bases, bytes \
+    from htsfiles_coverage join htsfiles_v2 using (_dbid);
+
+create table htsfiles_chunks_v2 (file_id integer not null, \
+    byteLo integer not null check(byteLo >= 0), byteHi integer not null check(byteHi > byteLo), \
+    foreign key(file_id) references htsfiles(file_id));
+insert into htsfiles_chunks_v2 select file_id, byteLo, byteHi \
+    from htsfiles_chunks join htsfiles_v2 using (_dbid);
+
+drop table htsfiles_chunks;
+drop table htsfiles_coverage;
+drop table htsfiles_blocks;
+drop table htsfiles_seqs;
+drop table htsfiles_blocks_meta;
+drop table htsfiles;
+alter table htsfiles_v2 rename to htsfiles;
+alter table htsfiles_blocks_meta_v2 rename to htsfiles_blocks_meta;
+alter table htsfiles_seqs_v2 rename to htsfiles_seqs;
+alter table htsfiles_blocks_v2 rename to htsfiles_blocks;
+alter table htsfiles_coverage_v2 rename to htsfiles_coverage;
+alter table htsfiles_chunks_v2 rename to htsfiles_chunks;
+create unique index htsfiles_namespace_accession on htsfiles(namespace,accession,format);
+create unique index htsfiles_seqs_name on htsfiles_seqs(file_id,name);
+create index htsfiles_blocks_index1 on htsfiles_blocks(file_id,tid,seqLo,seqHi);
+create index htsfiles_blocks_index2 on htsfiles_blocks(file_id,tid,seqHi);
+create index htsfiles_coverage_index on htsfiles_coverage(file_id,tid,binLo);
+create index htsfiles_chunks_index on htsfiles_chunks(file_id,byteLo);
+
+pragma user_version = 2;
+commit;
+vacuum"
+    version=2
+fi
+
+echo "$1: schema version $version"
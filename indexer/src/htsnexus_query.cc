@@ -0,0 +1,136 @@
+// Batch genomic range query against the block-level range index: given a BED
+// file of regions, print the (coalesced) byte ranges of an indexed file
+// holding all the records overlapping any of them, answering all the regions
+// in one sweep over the index rather than a separate ticket request each.
+
+#include <iostream>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <tuple>
+#include <sstream>
+#include <stdlib.h>
+#include <getopt.h>
+#include "sqlite3.h"
+
+using namespace std;
+
+/*************************************************************************************************/
+
+// htsnexus_index_util.cc prototypes
+shared_ptr<sqlite3> open_database_readonly(const char* db);
+string derive_dbid(const char* name_space, const char* accession, const char* format, const char* fn, const char* url);
+int64_t find_indexed_file(sqlite3* dbh, const string& dbid);
+vector<tuple<int64_t,int64_t,string,string>> query_byte_ranges(sqlite3* dbh, int64_t file_id,
+                                                               const vector<tuple<string,int64_t,int64_t>>& regions,
+                                                               int64_t gap);
+string base64_encode(const void* data, size_t len);
+
+/*************************************************************************************************/
+
+// read the regions (chrom, start, end) from a BED file, skipping header lines
+vector<tuple<string,int64_t,int64_t>> read_bed(istream& in, const string& filename) {
+    vector<tuple<string,int64_t,int64_t>> ans;
+    string line;
+    for (int lineno = 1; getline(in, line); lineno++) {
+        if (line.empty() || line[0] == '#' || line.compare(0, 5, "track") == 0 || line.compare(0, 7, "browser") == 0) {
+            continue;
+        }
+        istringstream fields(line);
+        string chrom;
+        int64_t start = -1, end = -1;
+        if (!(fields >> chrom >> start >> end) || start < 0 || end < start) {
+            throw runtime_error("invalid BED line " + to_string(lineno) + " in " + filename);
+        }
+        ans.push_back(make_tuple(chrom, start, end));
+    }
+    if (in.bad()) {
+        throw runtime_error("error reading " + filename);
+    }
+    return ans;
+}
+
+/*************************************************************************************************/
+
+const char* usage =
+    "htsnexus_query [options] <index.db> <namespace> <accession> <regions.bed>\n"
+    "  index.db     SQLite3 database\n"
+    "  namespace    accession namespace\n"
+    "  accession    accession identifier of indexed file\n"
+    "  regions.bed  BED file of genomic regions, or - for standard input; use\n"
+    "               chromosome * for the unmapped reads\n"
+    "Prints the byte ranges of the file holding the records overlapping any of the\n"
+    "regions, one per line (byteLo and byteHi, tab-separated, byteHi exclusive), in\n"
+    "file order. Ranges which must be framed by their own prefix and suffix (such\n"
+    "as CRAM slices indexed with --slices) have these in two more columns,\n"
+    "base64-encoded (possibly empty); they're never coalesced with others. The\n"
+    "slice header/footer are not included.\n"
+    "Options:\n"
+    "  --format <fmt>    format of the indexed file: bam, cram, or vcf (default: bam)\n"
+    "  --coalesce-gap <bytes>\n"
+    "                    merge byte ranges separated by no more than this many\n"
+    "                    bytes; -1 for a single range (default: 1048576)\n"
+;
+
+int main(int argc, char* argv[]) {
+    static struct option long_options[] = {
+        {"help", no_argument, 0, 'h'},
+        {"format", required_argument, 0, 'f'},
+        {"coalesce-gap", required_argument, 0, 'g'},
+        {0, 0, 0, 0}
+    };
+
+    string format = "bam";
+    int64_t gap = 1048576;
+
+    int c;
+    while (-1 != (c = getopt_long(argc, argv, "hf:g:", long_options, 0))) {
+        switch (c) {
+            case 'f':
+                format = optarg;
+                break;
+            case 'g':
+                gap = atoll(optarg);
+                break;
+            default:
+                cout << usage << endl;
+                return 1;
+        }
+    }
+
+    if (argc-optind != 4 || (format != "bam" && format != "cram" && format != "vcf")) {
+        cout << usage << endl;
+        return 1;
+    }
+    const char *db = argv[optind],
+               *name_space = argv[optind+1],
+               *accession = argv[optind+2],
+               *bedfile = argv[optind+3];
+
+    vector<tuple<string,int64_t,int64_t>> regions;
+    if (string(bedfile) == "-") {
+        regions = read_bed(cin, "standard input");
+    } else {
+        ifstream bed(bedfile);
+        if (!bed.is_open()) {
+            throw runtime_error("opening " + string(bedfile));
+        }
+        regions = read_bed(bed, bedfile);
+    }
+
+    string dbid = derive_dbid(name_space, accession, format.c_str(), 0, 0);
+    shared_ptr<sqlite3> dbh = open_database_readonly(db);
+    int64_t file_id = find_indexed_file(dbh.get(), dbid);
+
+    for (const auto& r : query_byte_ranges(dbh.get(), file_id, regions, gap)) {
+        cout << get<0>(r) << "\t" << get<1>(r);
+        if (!get<2>(r).empty() || !get<3>(r).empty()) {
+            cout << "\t" << base64_encode(get<2>(r).data(), get<2>(r).size())
+                 << "\t" << base64_encode(get<3>(r).data(), get<3>(r).size());
+        }
+        cout << "\n";
+    }
+
+    return 0;
+}
@@ -0,0 +1,938 @@
+// Native htsnexus ticket server. Answers the same /v1/reads and /v1/variants
+// (and /dxjob/...) requests as the Node.js server in server/, producing the
+// same JSON tickets, but from an in-memory copy of the index database loaded
+// at startup: the htsfiles_blocks_meta rows, with the slice prefix/suffix
+// already base64-encoded, and per-file, per-sequence block arrays sorted by
+// seqLo. Slice tickets list the coalesced byte ranges of the matching blocks,
+// skipping large gaps. Each worker thread runs its own epoll loop on its own
+// SO_REUSEPORT listening socket, so ticket requests never touch SQLite or take
+// a lock.
+// The database is read once; restart the server to pick up index changes.
+
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <tuple>
+#include <thread>
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "sqlite3.h"
+
+using namespace std;
+
+/*************************************************************************************************/
+
+// htsnexus_index_util.cc prototypes
+shared_ptr<sqlite3> open_database_readonly(const char* db);
+vector<pair<int64_t,int64_t>> coalesce_byte_ranges(vector<pair<int64_t,int64_t>> ranges, int64_t gap);
+string base64_encode(const void* data, size_t len);
+
+/*************************************************************************************************/
+
+string json_string(const string& s) {
+    string ans = "\"";
+    for (char c : s) {
+        switch (c) {
+            case '"': ans += "\\\""; break;
+            case '\\': ans += "\\\\"; break;
+            case '\n': ans += "\\n"; break;
+            case '\r': ans += "\\r"; break;
+            case '\t': ans += "\\t"; break;
+            default:
+                if ((unsigned char) c < 0x20) {
+                    char buf[8];
+                    snprintf(buf, sizeof(buf), "\\u%04x", (unsigned) c);
+                    ans += buf;
+                } else {
+                    ans += c;
+                }
+        }
+    }
+    return ans + "\"";
+}
+
+// like JavaScript's encodeURIComponent
+string uri_encode(const string& s) {
+    static const char* hex = "0123456789ABCDEF";
+    string ans;
+    for (unsigned char c : s) {
+        if (isalnum(c) || strchr("-_.!~*'()", c)) {
+            ans += c;
+        } else {
+            ans += '%';
+            ans += hex[c >> 4];
+            ans += hex[c & 15];
+        }
+    }
+    return ans;
+}
+
+string uri_decode(const string& s, bool plus_is_space) {
+    string ans;
+    for (size_t i = 0; i < s.size(); i++) {
+        if (s[i] == '%' && i+2 < s.size() && isxdigit(s[i+1]) && isxdigit(s[i+2])) {
+            ans += (char) strtol(s.substr(i+1, 2).c_str(), 0, 16);
+            i += 2;
+        } else if (plus_is_space && s[i] == '+') {
+            ans += ' ';
+        } else {
+            ans += s[i];
+        }
+    }
+    return ans;
+}
+
+/*************************************************************************************************/
+
+// in-memory index
+
+struct block_entry {
+    int64_t seq_lo, seq_hi, byte_lo, byte_hi;
+    int framing;    // index into htsfile::framings, or -1 if none
+};
+
+struct seq_blocks {
+    vector<block_entry> blocks;     // sorted by seq_lo
+    vector<int64_t> max_seq_hi;     // running maximum of seq_hi over blocks
+
+    // from htsfiles_blocks_summary, if the indexer recorded it: the combined
+    // extent of the blocks (which can stand in for all of them if they're
+    // contiguous), and the bitmap of genomic bins they overlap
+    bool summarized = false, contiguous = false;
+    block_entry extent;
+    int64_t bin_size = 0;
+    string occupancy;
+
+    // false if the summary shows that no block overlaps [lo,hi]
+    bool may_overlap(int64_t lo, int64_t hi) const {
+        if (!summarized) {
+            return true;
+        }
+        if (hi < extent.seq_lo || lo > extent.seq_hi) {
+            return false;
+        }
+        if (bin_size <= 0) {
+            return true;
+        }
+        int64_t bin_hi = min(hi, extent.seq_hi) / bin_size;
+        for (int64_t bin = max(lo, extent.seq_lo) / bin_size; bin <= bin_hi; bin++) {
+            if (size_t(bin / 8) >= occupancy.size() || (occupancy[bin / 8] >> (bin % 8)) & 1) {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+struct htsfile {
+    string dbid, format, name_space, accession, url;
+    int64_t file_size = -1;
+
+    bool indexed = false;
+    string reference;
+    bool has_slice_prefix = false, has_slice_suffix = false;
+    string slice_prefix_b64, slice_suffix_b64;
+
+    unordered_map<string,seq_blocks> seqs;
+    vector<block_entry> unmapped;
+
+    // distinct base64-encoded (block_prefix, block_suffix) of blocks which
+    // have them (e.g. CRAM slices)
+    vector<pair<string,string>> framings;
+
+    vector<int64_t> chunks;         // sorted byteLo of htsfiles_chunks
+};
+
+// htsget protocol errors, cf. server/src/protocol._js
+class protocol_error : public runtime_error {
+public:
+    int status;
+    string type;
+    protocol_error(int status_, const string& type_, const string& msg)
+        : runtime_error(msg), status(status_), type(type_) {}
+};
+
+// prepare a statement, or return nullptr if a table it refers to doesn't
+// exist (databases from older indexer versions)
+shared_ptr<sqlite3_stmt> prepare_query(sqlite3* dbh, const char* sql) {
+    sqlite3_stmt *raw = 0;
+    if (sqlite3_prepare_v2(dbh, sql, -1, &raw, 0)) {
+        if (string(sqlite3_errmsg(dbh)).find("no such table") == 0) {
+            return nullptr;
+        }
+        throw runtime_error(string("Failed to prepare statement: ") + sqlite3_errmsg(dbh));
+    }
+    return shared_ptr<sqlite3_stmt>(raw, &sqlite3_finalize);
+}
+
+string column_string(sqlite3_stmt* stmt, int i) {
+    const void* p = sqlite3_column_blob(stmt, i);
+    return p ? string((const char*) p, sqlite3_column_bytes(stmt, i)) : string();
+}
+
+class ticket_index {
+    map<tuple<string,string,string>,htsfile> files_; // keyed by (format, namespace, accession)
+
+    template<class F> void for_each_row(sqlite3* dbh, const char* sql, F f) {
+        auto stmt = prepare_query(dbh, sql);
+        if (!stmt) {
+            return;
+        }
+        int c;
+        while ((c = sqlite3_step(stmt.get())) == SQLITE_ROW) {
+            f(stmt.get());
+        }
+        if (c != SQLITE_DONE) {
+            throw runtime_error(string("Error reading database: ") + sqlite3_errmsg(dbh));
+        }
+    }
+
+public:
+    ticket_index(sqlite3* dbh) {
+        map<int64_t,htsfile*> by_file_id;
+        for_each_row(dbh, "select file_id, _dbid, format, namespace, accession, url, file_size from htsfiles", [&](sqlite3_stmt* stmt) {
+            htsfile f;
+            f.dbid = column_string(stmt, 1);
+            f.format = column_string(stmt, 2);
+            f.name_space = column_string(stmt, 3);
+            f.accession = column_string(stmt, 4);
+            f.url = column_string(stmt, 5);
+            if (sqlite3_column_type(stmt, 6) != SQLITE_NULL) {
+                f.file_size = sqlite3_column_int64(stmt, 6);
+            }
+            auto& slot = files_[make_tuple(f.format, f.name_space, f.accession)];
+            slot = move(f);
+            by_file_id[sqlite3_column_int64(stmt, 0)] = &slot;
+        });
+
+        for_each_row(dbh, "select file_id, reference, slice_prefix, slice_suffix from htsfiles_blocks_meta", [&](sqlite3_stmt* stmt) {
+            auto p = by_file_id.find(sqlite3_column_int64(stmt, 0));
+            if (p == by_file_id.end()) {
+                return;
+            }
+            htsfile& f = *(p->second);
+            f.indexed = true;
+            f.reference = column_string(stmt, 1);
+            if (sqlite3_column_type(stmt, 2) != SQLITE_NULL) {
+                f.has_slice_prefix = true;
+                f.slice_prefix_b64 = base64_encode(sqlite3_column_blob(stmt, 2), sqlite3_column_bytes(stmt, 2));
+            }
+            if (sqlite3_column_type(stmt, 3) != SQLITE_NULL) {
+                f.has_slice_suffix = true;
+                f.slice_suffix_b64 = base64_encode(sqlite3_column_blob(stmt, 3), sqlite3_column_bytes(stmt, 3));
+            }
+        });
+
+        map<tuple<htsfile*,string,string>,int> framing_ids;
+        for_each_row(dbh, "select file_id, tid, name, seqLo, seqHi, byteLo, byteHi, block_prefix, block_suffix \
+                           from htsfiles_blocks left join htsfiles_seqs using (file_id, tid) order by file_id, tid, seqLo", [&](sqlite3_stmt* stmt) {
+            auto p = by_file_id.find(sqlite3_column_int64(stmt, 0));
+            if (p == by_file_id.end()) {
+                return;
+            }
+            htsfile& f = *(p->second);
+            block_entry b = { sqlite3_column_int64(stmt, 3), sqlite3_column_int64(stmt, 4),
+                              sqlite3_column_int64(stmt, 5), sqlite3_column_int64(stmt, 6), -1 };
+            if (sqlite3_column_type(stmt, 7) != SQLITE_NULL || sqlite3_column_type(stmt, 8) != SQLITE_NULL) {
+                auto key = make_tuple(&f, column_string(stmt, 7), column_string(stmt, 8));
+                auto q = framing_ids.find(key);
+                if (q == framing_ids.end()) {
+                    q = framing_ids.insert(make_pair(key, (int) f.framings.size())).first;
+                    f.framings.push_back(make_pair(base64_encode(get<1>(key).data(), get<1>(key).size()),
+                                                   base64_encode(get<2>(key).data(), get<2>(key).size())));
+                }
+                b.framing = q->second;
+            }
+            if (sqlite3_column_int(stmt, 1) == -1) {
+                // unmapped reads
+                f.unmapped.push_back(b);
+            } else {
+                if (sqlite3_column_type(stmt, 2) == SQLITE_NULL) {
+                    throw runtime_error("htsfiles_blocks entry of " + f.dbid + " refers to tid " +
+                                        to_string(sqlite3_column_int(stmt, 1)) + " missing from htsfiles_seqs");
+                }
+                auto& sb = f.seqs[column_string(stmt, 2)];
+                sb.blocks.push_back(b);
+                sb.max_seq_hi.push_back(sb.max_seq_hi.empty() ? b.seq_hi : max(sb.max_seq_hi.back(), b.seq_hi));
+            }
+        });
+
+        for_each_row(dbh, "select file_id, name, seqLo, seqHi, byteLo, byteHi, contiguous, bin_size, occupancy \
+                           from htsfiles_blocks_summary join htsfiles_seqs using (file_id, tid) where blocks > 0", [&](sqlite3_stmt* stmt) {
+            auto p = by_file_id.find(sqlite3_column_int64(stmt, 0));
+            if (p == by_file_id.end()) {
+                return;
+            }
+            auto q = p->second->seqs.find(column_string(stmt, 1));
+            if (q == p->second->seqs.end()) {
+                return;
+            }
+            seq_blocks& sb = q->second;
+            sb.summarized = true;
+            sb.extent = { sqlite3_column_int64(stmt, 2), sqlite3_column_int64(stmt, 3),
+                          sqlite3_column_int64(stmt, 4), sqlite3_column_int64(stmt, 5), -1 };
+            sb.contiguous = sqlite3_column_int(stmt, 6) != 0;
+            if (sqlite3_column_type(stmt, 7) != SQLITE_NULL) {
+                sb.bin_size = sqlite3_column_int64(stmt, 7);
+                sb.occupancy = column_string(stmt, 8);
+            }
+        });
+
+        for_each_row(dbh, "select file_id, byteLo from htsfiles_chunks order by file_id, byteLo", [&](sqlite3_stmt* stmt) {
+            auto p = by_file_id.find(sqlite3_column_int64(stmt, 0));
+            if (p != by_file_id.end()) {
+                p->second->chunks.push_back(sqlite3_column_int64(stmt, 1));
+            }
+        });
+    }
+
+    size_t size() const { return files_.size(); }
+
+    const htsfile* find(const string& format, const string& name_space, const string& accession) const {
+        auto p = files_.find(make_tuple(format, name_space, accession));
+        return p != files_.end() ? &(p->second) : nullptr;
+    }
+};
+
+/*************************************************************************************************/
+
+// ticket generation, mirroring server/src/htsfiles_routes._js
+
+struct ticket_request {
+    bool dxjob;
+    string name_space, accession, referer;
+    map<string,string> query;
+
+    const string* param(const char* k) const {
+        auto p = query.find(k);
+        return p != query.end() ? &(p->second) : nullptr;
+    }
+};
+
+const int64_t MAX_SAFE_INTEGER = 9007199254740991LL;
+
+// like JavaScript's parseInt
+bool parse_int(const string& s, int64_t& ans) {
+    const char* p = s.c_str();
+    while (isspace(*p)) p++;
+    const char* digits = p + ((*p == '-' || *p == '+') ? 1 : 0);
+    if (!isdigit(*digits)) {
+        return false;
+    }
+    ans = strtoll(p, 0, 10);
+    return true;
+}
+
+void resolve_genomic_range(const ticket_request& req, string& seq, int64_t& lo, int64_t& hi) {
+    seq = *req.param("referenceName");
+    lo = 0;
+    hi = MAX_SAFE_INTEGER;
+    auto start = req.param("start"), end = req.param("end");
+    if ((start && !parse_int(*start, lo)) || (end && !parse_int(*end, hi))) {
+        throw protocol_error(422, "InvalidInput", "invalid positions in genomic range");
+    }
+    if (lo < 0 || hi < lo) {
+        throw protocol_error(422, "InvalidInput", "invalid genomic range; end<start");
+    }
+}
+
+string url_json(const string& url, const string& referer, int64_t lo, int64_t hi) {
+    ostringstream ans;
+    ans << "{\"url\":" << json_string(url) << ",\"headers\":{\"referer\":" << json_string(referer);
+    if (lo >= 0) {
+        // HTTP byte range header (fully closed)
+        ans << ",\"range\":\"bytes=" << lo << "-" << (hi-1) << "\"";
+    }
+    ans << "}}";
+    return ans.str();
+}
+
+// split the byte range [lo,hi) at the precomputed chunk boundaries
+void chunk_urls(const htsfile& f, const string& url, const string& referer, int64_t lo, int64_t hi, vector<string>& urls) {
+    auto p = upper_bound(f.chunks.begin(), f.chunks.end(), lo);
+    for (; p != f.chunks.end() && *p < hi; p++) {
+        urls.push_back(url_json(url, referer, lo, *p));
+        lo = *p;
+    }
+    urls.push_back(url_json(url, referer, lo, hi));
+}
+
+string htsfiles_common(const ticket_index& idx, const ticket_request& req, const string& format, int64_t coalesce_gap) {
+    const htsfile* f = idx.find(format, req.name_space, req.accession);
+    if (!f) {
+        throw protocol_error(404, "NotFound", "");
+    }
+
+    string data_url = f->url;
+    if (req.dxjob) {
+        // Optimization for requests from DNAnexus jobs: rewrite
+        // https://dl.dnanex.us/ URL to address local proxy
+        auto p = data_url.find("https://dl.dnanex.us/");
+        if (p != string::npos) {
+            data_url.replace(p, strlen("https://dl.dnanex.us/"), "http://10.0.3.1:8090/");
+        }
+    }
+    if (data_url.find(".blob.core.windows.net/") != string::npos) {
+        throw protocol_error(406, "Unable", "Azure blob URLs can only be signed by the Node.js server.");
+    }
+
+    string format_upper = format;
+    transform(format_upper.begin(), format_upper.end(), format_upper.begin(), ::toupper);
+
+    vector<string> urls;
+    const string* reference = nullptr;
+
+    if (!req.param("referenceName")) {
+        if (f->file_size > 0) {
+            chunk_urls(*f, data_url, req.referer, 0, f->file_size, urls);
+        } else {
+            urls.push_back(url_json(data_url, req.referer, -1, -1));
+        }
+    } else {
+        // genomic range slicing
+        string seq;
+        int64_t lo, hi;
+        resolve_genomic_range(req, seq, lo, hi);
+        if (!f->indexed) {
+            throw protocol_error(406, "Unable", "No genomic range index available for the requested file.");
+        }
+        reference = &(f->reference);
+
+        // matching blocks
+        vector<const block_entry*> matches;
+        if (seq != "*") {
+            auto p = f->seqs.find(seq);
+            if (p != f->seqs.end()) {
+                // the blocks overlapping [lo,hi] lie between the first whose
+                // running max seqHi reaches lo, and the last with seqLo <= hi
+                // (skipping the search if the summary shows that none do, or
+                // that they all do, and are contiguous)
+                const seq_blocks& sb = p->second;
+                if (sb.summarized && sb.contiguous && lo <= sb.extent.seq_lo && hi >= sb.extent.seq_hi) {
+                    matches.push_back(&sb.extent);
+                } else if (sb.may_overlap(lo, hi)) {
+                    size_t i = lower_bound(sb.max_seq_hi.begin(), sb.max_seq_hi.end(), lo) - sb.max_seq_hi.begin();
+                    for (; i < sb.blocks.size() && sb.blocks[i].seq_lo <= hi; i++) {
+                        const block_entry& b = sb.blocks[i];
+                        if (b.seq_hi >= lo) {
+                            matches.push_back(&b);
+                        }
+                    }
+                }
+            }
+        } else {
+            // unmapped reads
+            for (const auto& b : f->unmapped) {
+                matches.push_back(&b);
+            }
+        }
+
+        // Blocks with their own prefix/suffix (e.g. CRAM slices, which need a
+        // synthesized container header) are served individually, framed by
+        // those; multi-ref blocks have one entry per reference. The others
+        // are coalesced.
+        vector<pair<int64_t,int64_t>> plain;
+        map<pair<int64_t,int64_t>,int> framed;
+        for (const block_entry* b : matches) {
+            if (b->framing < 0) {
+                plain.push_back(make_pair(b->byte_lo, b->byte_hi));
+            } else {
+                framed[make_pair(b->byte_lo, b->byte_hi)] = b->framing;
+            }
+        }
+        vector<tuple<int64_t,int64_t,int>> ranges;
+        for (const auto& r : coalesce_byte_ranges(move(plain), coalesce_gap)) {
+            ranges.push_back(make_tuple(r.first, r.second, -1));
+        }
+        for (const auto& r : framed) {
+            ranges.push_back(make_tuple(r.first.first, r.first.second, r.second));
+        }
+        sort(ranges.begin(), ranges.end());
+
+        if (f->has_slice_prefix && !req.param("noHeaderPrefix")) {
+            urls.push_back("{\"url\":\"data:application/octet-stream;base64," + f->slice_prefix_b64 + "\"}");
+        }
+        for (const auto& r : ranges) {
+            const pair<string,string>* framing = get<2>(r) >= 0 ? &(f->framings[get<2>(r)]) : nullptr;
+            if (framing && !framing->first.empty()) {
+                urls.push_back("{\"url\":\"data:application/octet-stream;base64," + framing->first + "\"}");
+            }
+            chunk_urls(*f, data_url, req.referer, get<0>(r), get<1>(r), urls);
+            if (framing && !framing->second.empty()) {
+                urls.push_back("{\"url\":\"data:application/octet-stream;base64," + framing->second + "\"}");
+            }
+        }
+        if (f->has_slice_suffix) {
+            urls.push_back("{\"url\":\"data:application/octet-stream;base64," + f->slice_suffix_b64 + "\"}");
+        }
+    }
+
+    string ans = "{\"htsget\":{\"namespace\":" + json_string(req.name_space) +
+                 ",\"accession\":" + json_string(req.accession) +
+                 ",\"format\":" + json_string(format_upper) + ",\"urls\":[";
+    for (size_t i = 0; i < urls.size(); i++) {
+        if (i) ans += ",";
+        ans += urls[i];
+    }
+    ans += "]";
+    if (reference) {
+        ans += ",\"reference\":" + json_string(*reference);
+    }
+    return ans + "}}";
+}
+
+// special handling for the "lh3bamsvr" namespace, which we redirect to
+// Heng Li's bamsvr
+string lh3bamsvr(const ticket_request& req) {
+    string url = "http://bamsvr.herokuapp.com/get?ac=" + uri_encode(req.accession);
+    if (req.param("referenceName")) {
+        string seq;
+        int64_t lo, hi;
+        resolve_genomic_range(req, seq, lo, hi);
+        url += "&seq=" + uri_encode(seq) + "&start=" + to_string(lo) + "&end=" + to_string(hi);
+    }
+    return "{\"htsget\":{\"namespace\":" + json_string(req.name_space) +
+           ",\"accession\":" + json_string(req.accession) +
+           ",\"urls\":[{\"url\":" + json_string(url) + "}],\"format\":\"BAM\"}}";
+}
+
+// route a request target (path & query string); returns the JSON response
+// body or throws protocol_error
+string route(const ticket_index& idx, const string& target, const string& host, int64_t coalesce_gap) {
+    size_t q = target.find('?');
+    string path = target.substr(0, q);
+
+    ticket_request req;
+    req.referer = "http://" + host + target;
+    req.dxjob = false;
+    if (path.compare(0, 7, "/dxjob/") == 0) {
+        req.dxjob = true;
+        path = path.substr(6);
+    }
+
+    bool reads;
+    if (path.compare(0, 10, "/v1/reads/") == 0) {
+        reads = true;
+        path = path.substr(10);
+    } else if (path.compare(0, 13, "/v1/variants/") == 0) {
+        reads = false;
+        path = path.substr(13);
+    } else {
+        throw protocol_error(404, "NotFound", "");
+    }
+    size_t slash = path.find('/');
+    if (slash == string::npos || slash == 0 || slash+1 == path.size() || path.find('/', slash+1) != string::npos) {
+        throw protocol_error(404, "NotFound", "");
+    }
+    req.name_space = uri_decode(path.substr(0, slash), false);
+    req.accession = uri_decode(path.substr(slash+1), false);
+
+    if (q != string::npos) {
+        istringstream qs(target.substr(q+1));
+        string kv;
+        while (getline(qs, kv, '&')) {
+            if (kv.empty()) continue;
+            size_t eq = kv.find('=');
+            string k = uri_decode(kv.substr(0, eq), true);
+            string v = eq == string::npos ? string() : uri_decode(kv.substr(eq+1), true);
+            req.query.insert(make_pair(k, v));
+        }
+    }
+
+    auto format = req.param("format");
+    if (reads) {
+        if (!format || *format == "BAM") {
+            if (req.name_space == "lh3bamsvr") {
+                return lh3bamsvr(req);
+            }
+            return htsfiles_common(idx, req, "bam", coalesce_gap);
+        } else if (*format == "CRAM") {
+            return htsfiles_common(idx, req, "cram", coalesce_gap);
+        }
+    } else if (!format || *format == "VCF") {
+        return htsfiles_common(idx, req, "vcf", coalesce_gap);
+    }
+    throw protocol_error(409, "UnsupportedFormat", "Unrecognized/unsupported format: " + *format);
+}
+
+/*************************************************************************************************/
+
+// HTTP/1.1 event loop
+
+const size_t MAX_REQUEST_HEADER = 65536;
+
+struct connection {
+    string in, out;
+    size_t out_pos = 0;
+    bool closing = false, want_write = false;
+};
+
+class http_worker {
+    const ticket_index& idx_;
+    int64_t coalesce_gap_;
+    int listen_fd_, epoll_fd_;
+    unordered_map<int,connection> conns_;
+
+    void close_conn(int fd) {
+        epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, 0);
+        close(fd);
+        conns_.erase(fd);
+    }
+
+    void respond(connection& conn, int status, const string& body, bool keep_alive) {
+        const char* reason = "OK";
+        switch (status) {
+            case 400: reason = "Bad Request"; break;
+            case 404: reason = "Not Found"; break;
+            case 406: reason = "Not Acceptable"; break;
+            case 409: reason = "Conflict"; break;
+            case 422: reason = "Unprocessable Entity"; break;
+            case 500: reason = "Internal Server Error"; break;
+        }
+        ostringstream hdr;
+        hdr << "HTTP/1.1 " << status << " " << reason << "\r\n"
+            << "Content-Type: application/vnd.ga4gh.htsget.v0.2rc+json\r\n"
+            << "Access-Control-Allow-Origin: *\r\n"
+            << "Content-Length: " << body.size() << "\r\n"
+            << "Connection: " << (keep_alive ? "keep-alive" : "close") << "\r\n\r\n";
+        conn.out += hdr.str();
+        conn.out += body;
+        if (!keep_alive) {
+            conn.closing = true;
+        }
+    }
+
+    string error_body(const string& type, const string& message) {
+        string ans = "{\"htsget\":{\"error\":{\"type\":" + json_string(type);
+        if (!message.empty()) {
+            ans += ",\"message\":" + json_string(message);
+        }
+        return ans + "}}}";
+    }
+
+    // parse and answer each complete request in the input buffer
+    void process(connection& conn) {
+        size_t pos = 0;
+        while (!conn.closing) {
+            size_t end = conn.in.find("\r\n\r\n", pos);
+            if (end == string::npos) {
+                if (conn.in.size() - pos > MAX_REQUEST_HEADER) {
+                    respond(conn, 400, error_body("InvalidInput", "request header too large"), false);
+                }
+                break;
+            }
+
+            // request line
+            size_t eol = conn.in.find("\r\n", pos);
+            istringstream line(conn.in.substr(pos, eol-pos));
+            string method, target, version;
+            line >> method >> target >> version;
+            if (method.empty() || target.empty() || version.compare(0, 5, "HTTP/") != 0) {
+                respond(conn, 400, error_body("InvalidInput", "malformed request"), false);
+                break;
+            }
+
+            // headers of interest
+            string host = "localhost";
+            bool keep_alive = version != "HTTP/1.0";
+            int64_t content_length = 0;
+            for (size_t h = eol+2; h < end; ) {
+                size_t h_end = conn.in.find("\r\n", h);
+                size_t colon = conn.in.find(':', h);
+                if (colon < h_end) {
+                    string name = conn.in.substr(h, colon-h), value = conn.in.substr(colon+1, h_end-colon-1);
+                    transform(name.begin(), name.end(), name.begin(), ::tolower);
+                    value.erase(0, value.find_first_not_of(" \t"));
+                    value.erase(value.find_last_not_of(" \t")+1);
+                    if (name == "host") {
+                        host = value;
+                    } else if (name == "connection") {
+                        transform(value.begin(), value.end(), value.begin(), ::tolower);
+                        if (value == "close") {
+                            keep_alive = false;
+                        } else if (value == "keep-alive") {
+                            keep_alive = true;
+                        }
+                    } else if (name == "content-length") {
+                        content_length = atoll(value.c_str());
+                    }
+                }
+                h = h_end+2;
+            }
+
+            // skip any request body
+            if (content_length < 0) {
+                respond(conn, 400, error_body("InvalidInput", "malformed request"), false);
+                break;
+            }
+            if (conn.in.size() - (end+4) < (size_t) content_length) {
+                break;
+            }
+            pos = end + 4 + content_length;
+
+            int status = 200;
+            string body;
+            if (method != "GET") {
+                status = 404;
+                body = error_body("NotFound", "");
+            } else {
+                try {
+                    body = route(idx_, target, host, coalesce_gap_);
+                } catch (protocol_error& exn) {
+                    status = exn.status;
+                    body = error_body(exn.type, exn.what());
+                } catch (exception& exn) {
+                    status = 500;
+                    body = error_body("InternalError", exn.what());
+                    cerr << "{\"path\":" << json_string(target) << ",\"statusCode\":500,\"message\":" << json_string(exn.what()) << "}" << endl;
+                }
+            }
+            respond(conn, status, body, keep_alive);
+        }
+        conn.in.erase(0, pos);
+    }
+
+    // write as much pending output as possible; returns false if the
+    // connection should be closed
+    bool flush(int fd, connection& conn) {
+        while (conn.out_pos < conn.out.size()) {
+            ssize_t n = send(fd, conn.out.data() + conn.out_pos, conn.out.size() - conn.out_pos, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                return false;
+            }
+            conn.out_pos += n;
+        }
+        if (conn.out_pos == conn.out.size()) {
+            conn.out.clear();
+            conn.out_pos = 0;
+            if (conn.closing) {
+                return false;
+            }
+        }
+        bool want_write = !conn.out.empty();
+        if (want_write != conn.want_write) {
+            struct epoll_event ev;
+            memset(&ev, 0, sizeof(ev));
+            ev.events = EPOLLIN | EPOLLRDHUP | (want_write ? EPOLLOUT : 0);
+            ev.data.fd = fd;
+            epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, fd, &ev);
+            conn.want_write = want_write;
+        }
+        return true;
+    }
+
+    void accept_all() {
+        while (true) {
+            int fd = accept4(listen_fd_, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                return; // EAGAIN, or e.g. EMFILE: retry on the next event
+            }
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            struct epoll_event ev;
+            memset(&ev, 0, sizeof(ev));
+            ev.events = EPOLLIN | EPOLLRDHUP;
+            ev.data.fd = fd;
+            if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev)) {
+                close(fd);
+                continue;
+            }
+            conns_[fd];
+        }
+    }
+
+    void on_readable(int fd, connection& conn) {
+        char buf[16384];
+        while (true) {
+            ssize_t n = recv(fd, buf, sizeof(buf), 0);
+            if (n > 0) {
+                conn.in.append(buf, n);
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            // EOF or error: answer anything already received, then close
+            conn.closing = true;
+            break;
+        }
+        bool eof = conn.closing;
+        conn.closing = false;
+        process(conn);
+        if (eof) {
+            conn.closing = true;
+        }
+        if (!flush(fd, conn)) {
+            close_conn(fd);
+        }
+    }
+
+public:
+    http_worker(const ticket_index& idx, int64_t coalesce_gap, const string& bind_addr, int port)
+        : idx_(idx), coalesce_gap_(coalesce_gap) {
+        listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listen_fd_ < 0) {
+            throw runtime_error(string("socket: ") + strerror(errno));
+        }
+        int one = 1;
+        setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one))) {
+            throw runtime_error(string("SO_REUSEPORT: ") + strerror(errno));
+        }
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        if (inet_pton(AF_INET, bind_addr.c_str(), &addr.sin_addr) != 1) {
+            throw runtime_error("invalid bind address: " + bind_addr);
+        }
+        if (::bind(listen_fd_, (struct sockaddr*) &addr, sizeof(addr)) || listen(listen_fd_, 1024)) {
+            throw runtime_error("couldn't listen on " + bind_addr + ":" + to_string(port) + ": " + strerror(errno));
+        }
+
+        epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd_ < 0) {
+            throw runtime_error(string("epoll_create1: ") + strerror(errno));
+        }
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = listen_fd_;
+        if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_fd_, &ev)) {
+            throw runtime_error(string("epoll_ctl: ") + strerror(errno));
+        }
+    }
+
+    void run() {
+        struct epoll_event events[256];
+        while (true) {
+            int n = epoll_wait(epoll_fd_, events, 256, -1);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                throw runtime_error(string("epoll_wait: ") + strerror(errno));
+            }
+            for (int i = 0; i < n; i++) {
+                int fd = events[i].data.fd;
+                if (fd == listen_fd_) {
+                    accept_all();
+                    continue;
+                }
+                auto p = conns_.find(fd);
+                if (p == conns_.end()) {
+                    continue;
+                }
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                    on_readable(fd, p->second);
+                } else if ((events[i].events & EPOLLOUT) && !flush(fd, p->second)) {
+                    close_conn(fd);
+                }
+            }
+        }
+    }
+};
+
+/*************************************************************************************************/
+
+const char* usage =
+    "htsnexus_serve [options] <index.db>\n"
+    "  index.db    SQLite3 database\n"
+    "Serves htsget tickets for the files in the database, like the Node.js server.\n"
+    "The database is loaded into memory at startup.\n"
+    "Options:\n"
+    "  --bind <addr>     interface to bind; set 0.0.0.0 to bind all (default: 127.0.0.1)\n"
+    "  --port <port>     port to listen on (default: 48444)\n"
+    "  --threads <n>     number of event loop threads (default: number of CPUs)\n"
+    "  --coalesce-gap <bytes>\n"
+    "                    in slice tickets, merge the byte ranges of matching blocks\n"
+    "                    separated by no more than this many bytes, and skip larger\n"
+    "                    gaps; -1 to always return one range (default: 1048576)\n"
+;
+
+int main(int argc, char* argv[]) {
+    static struct option long_options[] = {
+        {"help", no_argument, 0, 'h'},
+        {"bind", required_argument, 0, 'b'},
+        {"port", required_argument, 0, 'p'},
+        {"threads", required_argument, 0, 't'},
+        {"coalesce-gap", required_argument, 0, 'g'},
+        {0, 0, 0, 0}
+    };
+
+    string bind_addr = "127.0.0.1";
+    int port = 48444;
+    int threads = max(1U, thread::hardware_concurrency());
+    int64_t coalesce_gap = 1048576;
+
+    int c;
+    while (-1 != (c = getopt_long(argc, argv, "hb:p:t:g:", long_options, 0))) {
+        switch (c) {
+            case 'b':
+                bind_addr = optarg;
+                break;
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 't':
+                threads = atoi(optarg);
+                break;
+            case 'g':
+                coalesce_gap = atoll(optarg);
+                break;
+            default:
+                cout << usage << endl;
+                return 1;
+        }
+    }
+
+    if (argc-optind != 1 || port <= 0 || port > 65535 || threads <= 0) {
+        cout << usage << endl;
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    unique_ptr<ticket_index> idx;
+    {
+        shared_ptr<sqlite3> dbh = open_database_readonly(argv[optind]);
+        idx.reset(new ticket_index(dbh.get()));
+    }
+
+    // bind all the sockets before starting any thread, so that errors are
+    // reported up front
+    vector<unique_ptr<http_worker>> workers;
+    for (int i = 0; i < threads; i++) {
+        workers.emplace_back(new http_worker(*idx, coalesce_gap, bind_addr, port));
+    }
+
+    cout << "{\"message\":" << json_string("Server running at: http://" + bind_addr + ":" + to_string(port))
+         << ",\"files\":" << idx->size() << ",\"threads\":" << threads << "}" << endl;
+
+    vector<thread> pool;
+    for (auto& w : workers) {
+        http_worker* wp = w.get();
+        pool.emplace_back([wp]() { wp->run(); });
+    }
+    for (auto& t : pool) {
+        t.join();
+    }
+
+    return 0;
+}
@@ -0,0 +1,211 @@
+// Split one or more indexed files into genomic regions ("shards") with roughly
+// equal compressed byte counts, based on the block-level range index in the
+// htsnexus database. Each region boundary falls on the genomic start of some
+// indexed block, and no region spans more than one reference sequence. The
+// requested number of shards is apportioned among the sequences by their byte
+// counts, and each sequence is divided into that many contiguous regions,
+// which together cover it from its start to the end of its last block. The
+// output is one region per line (seq:lo-hi, one-based and fully closed), as
+// expected by e.g. samtools and freebayes --region.
+
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <map>
+#include <tuple>
+#include <algorithm>
+#include <sstream>
+#include <stdlib.h>
+#include <getopt.h>
+#include "sqlite3.h"
+
+using namespace std;
+
+/*************************************************************************************************/
+
+// htsnexus_index_util.cc prototypes
+shared_ptr<sqlite3> open_database_readonly(const char* db);
+string derive_dbid(const char* name_space, const char* accession, const char* format, const char* fn, const char* url);
+int64_t find_indexed_file(sqlite3* dbh, const string& dbid);
+
+/*************************************************************************************************/
+
+// prepare a statement with one integer parameter bound
+shared_ptr<sqlite3_stmt> prepare_query(sqlite3* dbh, const char* sql, int64_t param) {
+    sqlite3_stmt *raw = 0;
+    if (sqlite3_prepare_v2(dbh, sql, -1, &raw, 0)) {
+        throw runtime_error(string("Failed to prepare statement: ") + sqlite3_errmsg(dbh));
+    }
+    shared_ptr<sqlite3_stmt> stmt(raw, &sqlite3_finalize);
+    if (sqlite3_bind_int64(stmt.get(), 1, param)) {
+        throw runtime_error(string("Failed to bind: ") + sql);
+    }
+    return stmt;
+}
+
+// compute the shards for the given files, returning (seq, lo, hi) with lo
+// zero-based and hi exclusive
+vector<tuple<string,int64_t,int64_t>> compute_shards(sqlite3* dbh, const vector<int64_t>& file_ids, unsigned shards) {
+    // determine the order of the reference sequences, as they appear in the
+    // (sorted) files
+    vector<string> seqs;
+    map<string,int> seq_ranks;
+    for (auto file_id : file_ids) {
+        auto stmt = prepare_query(dbh, "select name, min(byteLo) from htsfiles_blocks join htsfiles_seqs using (file_id, tid) where file_id = ? group by tid order by min(byteLo)", file_id);
+        int c;
+        while ((c = sqlite3_step(stmt.get())) == SQLITE_ROW) {
+            string seq((const char*) sqlite3_column_text(stmt.get(), 0));
+            if (seq_ranks.find(seq) == seq_ranks.end()) {
+                seq_ranks[seq] = seqs.size();
+                seqs.push_back(seq);
+            }
+        }
+        if (c != SQLITE_DONE) {
+            throw runtime_error(string("Error reading htsfiles_blocks: ") + sqlite3_errmsg(dbh));
+        }
+    }
+
+    // load the block index entries as (seq rank, seqLo, bytes)
+    vector<tuple<int,int64_t,int64_t>> blocks;
+    vector<int64_t> seq_ends(seqs.size(), 0), seq_bytes(seqs.size(), 0);
+    for (auto file_id : file_ids) {
+        auto stmt = prepare_query(dbh, "select name, seqLo, seqHi, byteHi - byteLo from htsfiles_blocks join htsfiles_seqs using (file_id, tid) where file_id = ?", file_id);
+        int c;
+        while ((c = sqlite3_step(stmt.get())) == SQLITE_ROW) {
+            int rank = seq_ranks.at(string((const char*) sqlite3_column_text(stmt.get(), 0)));
+            int64_t seq_lo = sqlite3_column_int64(stmt.get(), 1),
+                    seq_hi = sqlite3_column_int64(stmt.get(), 2),
+                    bytes = sqlite3_column_int64(stmt.get(), 3);
+            blocks.push_back(make_tuple(rank, seq_lo, bytes));
+            seq_ends[rank] = max(seq_ends[rank], seq_hi);
+            seq_bytes[rank] += bytes;
+        }
+        if (c != SQLITE_DONE) {
+            throw runtime_error(string("Error reading htsfiles_blocks: ") + sqlite3_errmsg(dbh));
+        }
+    }
+    sort(blocks.begin(), blocks.end());
+
+    // the candidate cut points on each sequence: the distinct block starts
+    // after the first, with the bytes of the blocks starting before each
+    vector<vector<pair<int64_t,int64_t>>> cuts(seqs.size());
+    int64_t before = 0;
+    for (size_t i = 0; i < blocks.size(); i++) {
+        int rank = get<0>(blocks[i]);
+        if (i == 0 || get<0>(blocks[i-1]) != rank) {
+            before = 0;
+        } else if (get<1>(blocks[i-1]) < get<1>(blocks[i])) {
+            cuts[rank].push_back(make_pair(get<1>(blocks[i]), before));
+        }
+        before += get<2>(blocks[i]);
+    }
+
+    // apportion the shards among the sequences, one each to begin with, then
+    // repeatedly another to the sequence with the most bytes per shard (as
+    // far as its cut points allow)
+    vector<size_t> counts(seqs.size(), 1);
+    for (size_t n = seqs.size(); n < shards; n++) {
+        int best = -1;
+        for (size_t r = 0; r < seqs.size(); r++) {
+            if (counts[r] <= cuts[r].size() &&
+                (best < 0 || seq_bytes[r] * (int64_t) counts[best] > seq_bytes[best] * (int64_t) counts[r])) {
+                best = r;
+            }
+        }
+        if (best < 0) {
+            break;
+        }
+        counts[best]++;
+    }
+
+    // divide each sequence at the cut points nearest each k-th of its bytes
+    vector<tuple<string,int64_t,int64_t>> ans;
+    for (size_t r = 0; r < seqs.size(); r++) {
+        const auto& rcuts = cuts[r];
+        size_t k = counts[r], i = 0;
+        int64_t shard_lo = 0;
+        for (size_t j = 1; j < k; j++) {
+            int64_t target = seq_bytes[r] * j / k;
+            // leave enough cut points for the remaining shards
+            size_t first = i, last = rcuts.size() - k + j;
+            while (i < last && rcuts[i].second < target) {
+                i++;
+            }
+            if (i > first && target - rcuts[i-1].second < rcuts[i].second - target) {
+                i--;
+            }
+            ans.push_back(make_tuple(seqs[r], shard_lo, rcuts[i].first));
+            shard_lo = rcuts[i].first;
+            i++;
+        }
+        ans.push_back(make_tuple(seqs[r], shard_lo, seq_ends[r]));
+    }
+
+    return ans;
+}
+
+/*************************************************************************************************/
+
+const char* usage =
+    "htsnexus_shard [options] <index.db> <namespace> <accession> [<accession> ...]\n"
+    "  index.db    SQLite3 database\n"
+    "  namespace   accession namespace\n"
+    "  accession   accession identifier(s) of indexed file(s); multiple files are\n"
+    "              sharded jointly, balancing their combined byte counts\n"
+    "Prints genomic regions (seq:lo-hi), one per line, splitting the files into\n"
+    "the requested number of shards, of roughly equal compressed size. Region\n"
+    "boundaries fall on indexed block boundaries, and regions never span multiple\n"
+    "reference sequences, so there's at least one region per sequence (and there\n"
+    "may be fewer regions if the blocks don't allow as many boundaries).\n"
+    "Options:\n"
+    "  --shards <n>      desired number of shards (default: 100)\n"
+    "  --format <fmt>    format of the indexed files: bam, cram, or vcf (default: bam)\n"
+;
+
+int main(int argc, char* argv[]) {
+    static struct option long_options[] = {
+        {"help", no_argument, 0, 'h'},
+        {"shards", required_argument, 0, 'n'},
+        {"format", required_argument, 0, 'f'},
+        {0, 0, 0, 0}
+    };
+
+    int shards = 100;
+    string format = "bam";
+
+    int c;
+    while (-1 != (c = getopt_long(argc, argv, "hn:f:", long_options, 0))) {
+        switch (c) {
+            case 'n':
+                shards = atoi(optarg);
+                break;
+            case 'f':
+                format = optarg;
+                break;
+            default:
+                cout << usage << endl;
+                return 1;
+        }
+    }
+
+    if (argc-optind < 3 || shards <= 0 || (format != "bam" && format != "cram" && format != "vcf")) {
+        cout << usage << endl;
+        return 1;
+    }
+    const char *db = argv[optind],
+               *name_space = argv[optind+1];
+
+    shared_ptr<sqlite3> dbh = open_database_readonly(db);
+
+    vector<int64_t> file_ids;
+    for (int i = optind+2; i < argc; i++) {
+        file_ids.push_back(find_indexed_file(dbh.get(), derive_dbid(name_space, argv[i], format.c_str(), 0, 0)));
+    }
+
+    for (const auto& shard : compute_shards(dbh.get(), file_ids, shards)) {
+        cout << get<0>(shard) << ":" << (get<1>(shard)+1) << "-" << get<2>(shard) << "\n";
+    }
+
+    return 0;
+}
@@ -0,0 +1,542 @@
+// Verify the block-level range index of a file against a local copy of it.
+// For a sample of random genomic ranges, the slice the servers would serve is
+// assembled from the local file (the slice prefix, the matching blocks with
+// any block prefixes/suffixes, and the slice suffix), decoded with htslib,
+// and checked to hold every record overlapping the range, as found by one full
+// scan of the file. The slices are checked on a pool of threads while the
+// full scan proceeds.
+
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <map>
+#include <tuple>
+#include <algorithm>
+#include <sstream>
+#include <random>
+#include <thread>
+#include <atomic>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include "sqlite3.h"
+#include "htslib/hfile.h"
+#include "htslib/sam.h"
+#include "htslib/vcf.h"
+
+using namespace std;
+
+/*************************************************************************************************/
+
+// htsnexus_index_util.cc prototypes
+shared_ptr<sqlite3> open_database_readonly(const char* db);
+string derive_dbid(const char* name_space, const char* accession, const char* format, const char* fn, const char* url);
+int64_t find_indexed_file(sqlite3* dbh, const string& dbid);
+vector<pair<int64_t,int64_t>> coalesce_byte_ranges(vector<pair<int64_t,int64_t>> ranges, int64_t gap);
+
+// htsnexus_hfile.cc prototypes
+hFILE* hopen_concat(const char* fn, const vector<tuple<string,int64_t,int64_t>>& pieces);
+
+/*************************************************************************************************/
+
+// FNV-1a hash, which can be continued from a previous value h
+uint64_t fnv1a(const void* data, size_t n, uint64_t h = 14695981039346656037ULL) {
+    for (size_t i = 0; i < n; i++) {
+        h = (h ^ ((const unsigned char*) data)[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+// Reads the records of a BAM, CRAM or VCF file through htslib, reporting for
+// each its sequence (tid), its range [pos,end), and a hash of its content by
+// which the same record can be recognized when decoded from a slice.
+class record_reader {
+    string fn;
+    shared_ptr<htsFile> fp;
+    shared_ptr<bam_hdr_t> sam_header;
+    shared_ptr<bam1_t> bam;
+    shared_ptr<bcf_hdr_t> vcf_header;
+    shared_ptr<bcf1_t> bcf;
+
+public:
+    // sequence names, by tid
+    vector<string> names;
+
+    // read the file from hf (which is closed in any case) as the given format
+    record_reader(hFILE* hf, const char* fn_, const string& format) : fn(fn_) {
+        if (!hf) {
+            throw runtime_error("opening " + fn);
+        }
+        htsFile* raw = hts_hopen(hf, fn.c_str(), "r");
+        if (!raw) {
+            hclose(hf);
+            throw runtime_error("opening " + fn);
+        }
+        fp.reset(raw, [](htsFile* f) { hts_close(f); });
+
+        if (format == "vcf") {
+            vcf_header.reset(bcf_hdr_read(fp.get()), [](bcf_hdr_t* h) { bcf_hdr_destroy(h); });
+            if (!vcf_header) {
+                throw runtime_error("reading VCF header from " + fn);
+            }
+            int nseqs = 0;
+            const char** seqnames = bcf_hdr_seqnames(vcf_header.get(), &nseqs);
+            for (int i = 0; i < nseqs; i++) {
+                names.push_back(seqnames[i]);
+            }
+            free(seqnames);
+            bcf.reset(bcf_init(), [](bcf1_t* b) { bcf_destroy(b); });
+        } else {
+            if (fp->is_cram) {
+                // as in the CRAM indexer, decode just enough to identify the
+                // records, which needs no reference sequences
+                if (hts_set_opt(fp.get(), CRAM_OPT_REQUIRED_FIELDS,
+                                SAM_QNAME | SAM_FLAG | SAM_RNAME | SAM_POS | SAM_MAPQ | SAM_CIGAR) ||
+                    hts_set_opt(fp.get(), CRAM_OPT_DECODE_MD, 0)) {
+                    throw runtime_error("setting CRAM decoding options");
+                }
+            }
+            sam_header.reset(sam_hdr_read(fp.get()), [](bam_hdr_t* h) { bam_hdr_destroy(h); });
+            if (!sam_header) {
+                throw runtime_error("reading header from " + fn);
+            }
+            for (int i = 0; i < sam_header->n_targets; i++) {
+                names.push_back(sam_header->target_name[i]);
+            }
+            bam.reset(bam_init1(), [](bam1_t* b) { bam_destroy1(b); });
+        }
+    }
+
+    // read the next record, returning false at the end of the file
+    bool next(int& tid, int64_t& pos, int64_t& end, uint64_t& hash) {
+        if (bcf) {
+            int c = bcf_read(fp.get(), vcf_header.get(), bcf.get());
+            if (c == -1) {
+                return false;
+            } else if (c < -1 || bcf->errcode) {
+                throw runtime_error("Error reading VCF records from " + fn);
+            }
+            tid = bcf->rid;
+            pos = bcf->pos;
+            end = bcf->pos + bcf->rlen;
+            hash = fnv1a(&bcf->rid, sizeof(bcf->rid));
+            hash = fnv1a(&bcf->pos, sizeof(bcf->pos), hash);
+            hash = fnv1a(bcf->shared.s, bcf->shared.l, hash);
+            hash = fnv1a(bcf->indiv.s, bcf->indiv.l, hash);
+        } else {
+            int c = sam_read1(fp.get(), sam_header.get(), bam.get());
+            if (c == -1) {
+                return false;
+            } else if (c < -1) {
+                throw runtime_error("Error reading records from " + fn + ", code " + to_string(c));
+            }
+            const bam1_core_t& core = bam->core;
+            tid = core.tid;
+            pos = core.pos;
+            end = bam_endpos(bam.get());
+            hash = fnv1a(bam_get_qname(bam.get()), core.l_qname);
+            hash = fnv1a(&core.tid, sizeof(core.tid), hash);
+            hash = fnv1a(&core.pos, sizeof(core.pos), hash);
+            hash = fnv1a(&core.flag, sizeof(core.flag), hash);
+            hash = fnv1a(&core.qual, sizeof(core.qual), hash);
+            hash = fnv1a(bam_get_cigar(bam.get()), 4*core.n_cigar, hash);
+        }
+        return true;
+    }
+};
+
+/*************************************************************************************************/
+
+// one genomic range to check, as in a ticket request: records overlapping
+// [lo,hi] on seq, or all the unmapped reads if seq is "*"
+struct region {
+    string seq;
+    int64_t lo = 0, hi = 0;
+
+    // the slice, as pieces for hopen_concat, and the bytes of the file in it
+    vector<tuple<string,int64_t,int64_t>> pieces;
+    int64_t bytes = 0;
+
+    // from the full scan: the records overlapping the range (count, and sum
+    // of their hashes)
+    uint64_t expected = 0, expected_digest = 0;
+
+    // from decoding the slice: all its records, and those overlapping the range
+    uint64_t records = 0, found = 0, found_digest = 0;
+    string error;
+};
+
+// prepare a statement with one integer parameter bound
+shared_ptr<sqlite3_stmt> prepare_query(sqlite3* dbh, const char* sql, int64_t param) {
+    sqlite3_stmt *raw = 0;
+    if (sqlite3_prepare_v2(dbh, sql, -1, &raw, 0)) {
+        throw runtime_error(string("Failed to prepare statement: ") + sqlite3_errmsg(dbh));
+    }
+    shared_ptr<sqlite3_stmt> stmt(raw, &sqlite3_finalize);
+    if (sqlite3_bind_int64(stmt.get(), 1, param)) {
+        throw runtime_error(string("Failed to bind: ") + sql);
+    }
+    return stmt;
+}
+
+string column_blob(sqlite3_stmt* stmt, int i) {
+    const void* blob = sqlite3_column_blob(stmt, i);
+    return blob ? string((const char*) blob, sqlite3_column_bytes(stmt, i)) : string();
+}
+
+// Choose random genomic ranges on the indexed sequences, each sequence (and
+// the unmapped reads, if indexed) being equally likely, with lengths up to
+// region_size.
+vector<region> sample_regions(sqlite3* dbh, int64_t file_id, unsigned count, int64_t region_size, uint64_t seed) {
+    vector<pair<string,int64_t>> seqs;
+    auto stmt = prepare_query(dbh, "select name, max(seqHi) from htsfiles_blocks join htsfiles_seqs using (file_id, tid) where file_id = ? group by tid order by tid", file_id);
+    int c;
+    while ((c = sqlite3_step(stmt.get())) == SQLITE_ROW) {
+        seqs.push_back(make_pair(string((const char*) sqlite3_column_text(stmt.get(), 0)), sqlite3_column_int64(stmt.get(), 1)));
+    }
+    if (c != SQLITE_DONE) {
+        throw runtime_error(string("Error reading htsfiles_blocks: ") + sqlite3_errstr(c));
+    }
+    stmt = prepare_query(dbh, "select count(*) from htsfiles_blocks where file_id = ? and tid = -1", file_id);
+    if (sqlite3_step(stmt.get()) != SQLITE_ROW) {
+        throw runtime_error("Error reading htsfiles_blocks");
+    }
+    if (sqlite3_column_int64(stmt.get(), 0) > 0) {
+        seqs.push_back(make_pair(string("*"), int64_t(0)));
+    }
+    if (seqs.empty()) {
+        throw runtime_error("No indexed blocks");
+    }
+
+    mt19937_64 rng(seed);
+    vector<region> ans(count);
+    for (auto& r : ans) {
+        const auto& seq = seqs[uniform_int_distribution<size_t>(0, seqs.size()-1)(rng)];
+        r.seq = seq.first;
+        if (r.seq != "*") {
+            r.lo = uniform_int_distribution<int64_t>(0, max(seq.second-1, int64_t(0)))(rng);
+            r.hi = r.lo + uniform_int_distribution<int64_t>(0, region_size-1)(rng);
+        }
+    }
+    return ans;
+}
+
+// Assemble the slice for each region from the index, as the servers do:
+// blocks with their own prefix/suffix are served individually, framed by
+// those, while the others are coalesced.
+void assemble_slices(sqlite3* dbh, int64_t file_id, int64_t coalesce_gap, vector<region>& regions) {
+    auto meta_stmt = prepare_query(dbh, "select slice_prefix, slice_suffix from htsfiles_blocks_meta where file_id = ?", file_id);
+    if (sqlite3_step(meta_stmt.get()) != SQLITE_ROW) {
+        throw runtime_error("Error reading htsfiles_blocks_meta");
+    }
+    string slice_prefix = column_blob(meta_stmt.get(), 0), slice_suffix = column_blob(meta_stmt.get(), 1);
+
+    auto seq_stmt = prepare_query(dbh, "select byteLo, byteHi, block_prefix, block_suffix from htsfiles_blocks \
+        join htsfiles_seqs using (file_id, tid) where file_id = ? and name = ? and seqLo <= ? and seqHi >= ?", file_id);
+    auto unmapped_stmt = prepare_query(dbh, "select byteLo, byteHi, block_prefix, block_suffix from htsfiles_blocks \
+        where file_id = ? and tid = -1", file_id);
+
+    for (auto& r : regions) {
+        sqlite3_stmt* stmt = unmapped_stmt.get();
+        sqlite3_reset(stmt);
+        if (r.seq != "*") {
+            stmt = seq_stmt.get();
+            sqlite3_reset(stmt);
+            if (sqlite3_bind_text(stmt, 2, r.seq.c_str(), -1, SQLITE_TRANSIENT) ||
+                sqlite3_bind_int64(stmt, 3, r.hi) || sqlite3_bind_int64(stmt, 4, r.lo)) {
+                throw runtime_error("Failed to bind: select from htsfiles_blocks...");
+            }
+        }
+
+        vector<pair<int64_t,int64_t>> plain;
+        map<pair<int64_t,int64_t>,pair<string,string>> framed;
+        int c;
+        while ((c = sqlite3_step(stmt)) == SQLITE_ROW) {
+            auto range = make_pair(sqlite3_column_int64(stmt, 0), sqlite3_column_int64(stmt, 1));
+            string prefix = column_blob(stmt, 2), suffix = column_blob(stmt, 3);
+            if (prefix.empty() && suffix.empty()) {
+                plain.push_back(range);
+            } else {
+                framed[range] = make_pair(prefix, suffix);
+            }
+        }
+        if (c != SQLITE_DONE) {
+            throw runtime_error(string("Error reading htsfiles_blocks: ") + sqlite3_errstr(c));
+        }
+
+        vector<tuple<int64_t,int64_t,const pair<string,string>*>> ranges;
+        for (const auto& p : coalesce_byte_ranges(move(plain), coalesce_gap)) {
+            ranges.push_back(make_tuple(p.first, p.second, (const pair<string,string>*) nullptr));
+        }
+        for (const auto& p : framed) {
+            ranges.push_back(make_tuple(p.first.first, p.first.second, &p.second));
+        }
+        sort(ranges.begin(), ranges.end());
+
+        r.pieces.push_back(make_tuple(slice_prefix, 0, 0));
+        for (const auto& p : ranges) {
+            const pair<string,string>* framing = get<2>(p);
+            r.pieces.push_back(make_tuple(framing ? framing->first : string(), get<0>(p), get<1>(p)));
+            if (framing) {
+                r.pieces.push_back(make_tuple(framing->second, 0, 0));
+            }
+            r.bytes += get<1>(p) - get<0>(p);
+        }
+        r.pieces.push_back(make_tuple(slice_suffix, 0, 0));
+    }
+}
+
+// decode the region's slice, counting its records and those overlapping the
+// range. Errors are recorded in the region rather than thrown.
+void check_slice(const char* fn, const string& format, region& r) {
+    try {
+        record_reader reader(hopen_concat(fn, r.pieces), fn, format);
+        int want = -1;
+        if (r.seq != "*") {
+            auto p = find(reader.names.begin(), reader.names.end(), r.seq);
+            want = p != reader.names.end() ? p - reader.names.begin() : -2;
+        }
+        int tid;
+        int64_t pos, end;
+        uint64_t hash;
+        while (reader.next(tid, pos, end, hash)) {
+            r.records++;
+            if (tid == want && (want == -1 || (pos <= r.hi && end >= r.lo))) {
+                r.found++;
+                r.found_digest += hash;
+            }
+        }
+    } catch (exception& exn) {
+        r.error = exn.what();
+    }
+}
+
+// Scan the whole file once, finding the records overlapping each region.
+// Since the records on each sequence come in order of position, the regions
+// (sorted by lo) are activated as the scan reaches them and retired once it
+// passes them; a record also overlaps the not-yet-active regions starting
+// at or before its end.
+void full_scan(const char* fn, const string& format, vector<region>& regions) {
+    record_reader reader(hopen(fn, "r"), fn, format);
+
+    map<int,vector<region*>> by_tid;
+    vector<region*> unmapped;
+    for (auto& r : regions) {
+        if (r.seq == "*") {
+            unmapped.push_back(&r);
+            continue;
+        }
+        auto p = find(reader.names.begin(), reader.names.end(), r.seq);
+        if (p != reader.names.end()) {
+            by_tid[p - reader.names.begin()].push_back(&r);
+        }
+    }
+    for (auto& it : by_tid) {
+        sort(it.second.begin(), it.second.end(), [](const region* a, const region* b) { return a->lo < b->lo; });
+    }
+
+    const vector<region*> none;
+    const vector<region*>* candidates = &none;
+    vector<region*> active;
+    size_t next = 0;
+    int tid, last_tid = -2;
+    int64_t pos, end, last_pos = -1;
+    uint64_t hash;
+    for (uint64_t n = 0; reader.next(tid, pos, end, hash); n++) {
+        if (tid == -1) {
+            for (region* r : unmapped) {
+                r->expected++;
+                r->expected_digest += hash;
+            }
+            continue;
+        }
+        if (tid != last_tid) {
+            auto p = by_tid.find(tid);
+            candidates = p != by_tid.end() ? &(p->second) : &none;
+            active.clear();
+            next = 0;
+            last_tid = tid;
+            last_pos = -1;
+        }
+        if (pos < last_pos) {
+            throw runtime_error("file not sorted at record " + to_string(n));
+        }
+        last_pos = pos;
+
+        while (next < candidates->size() && (*candidates)[next]->lo <= pos) {
+            active.push_back((*candidates)[next++]);
+        }
+        active.erase(remove_if(active.begin(), active.end(), [pos](const region* r) { return r->hi < pos; }), active.end());
+        for (region* r : active) {
+            r->expected++;
+            r->expected_digest += hash;
+        }
+        for (size_t i = next; i < candidates->size() && (*candidates)[i]->lo <= end; i++) {
+            (*candidates)[i]->expected++;
+            (*candidates)[i]->expected_digest += hash;
+        }
+    }
+}
+
+/*************************************************************************************************/
+
+const char* usage =
+    "htsnexus_verify [options] <index.db> <namespace> <accession> <local_file>\n"
+    "  index.db    SQLite3 database\n"
+    "  namespace   accession namespace\n"
+    "  accession   accession identifier of indexed file\n"
+    "  local_file  local copy of the indexed file\n"
+    "For a sample of random genomic ranges, assembles the slice the servers would\n"
+    "serve from the local file, decodes it, and checks that it holds every record\n"
+    "overlapping the range (as found by a full scan of the file). Prints, for each\n"
+    "range: the range, the bytes of the file in the slice, the number of records\n"
+    "in the slice, the number of records overlapping the range expected and found\n"
+    "in the slice, the estimated over-fetch in bytes, and OK or the problem found.\n"
+    "Exits with status 1 if any check fails.\n"
+    "Options:\n"
+    "  --format <fmt>    format of the indexed file: bam, cram, or vcf (default: bam)\n"
+    "  --regions <n>     number of random ranges to check (default: 100)\n"
+    "  --region-size <bp>\n"
+    "                    maximum length of the ranges (default: 1000000)\n"
+    "  --seed <n>        random seed (default: 1)\n"
+    "  --coalesce-gap <bytes>\n"
+    "                    as the server's setting (default: 1048576)\n"
+    "  --threads <n>     number of threads checking slices, alongside the full\n"
+    "                    scan (default: 4)\n"
+;
+
+int main(int argc, char* argv[]) {
+    static struct option long_options[] = {
+        {"help", no_argument, 0, 'h'},
+        {"format", required_argument, 0, 'f'},
+        {"regions", required_argument, 0, 'n'},
+        {"region-size", required_argument, 0, 'l'},
+        {"seed", required_argument, 0, 's'},
+        {"coalesce-gap", required_argument, 0, 'g'},
+        {"threads", required_argument, 0, 't'},
+        {0, 0, 0, 0}
+    };
+
+    string format = "bam";
+    int regions_count = 100;
+    int64_t region_size = 1000000;
+    uint64_t seed = 1;
+    int64_t coalesce_gap = 1048576;
+    int threads = 4;
+
+    int c;
+    while (-1 != (c = getopt_long(argc, argv, "hf:n:l:s:g:t:", long_options, 0))) {
+        switch (c) {
+            case 'f':
+                format = optarg;
+                break;
+            case 'n':
+                regions_count = atoi(optarg);
+                if (regions_count <= 0) {
+                    cout << usage << endl;
+                    return 1;
+                }
+                break;
+            case 'l':
+                region_size = atoll(optarg);
+                if (region_size <= 0) {
+                    cout << usage << endl;
+                    return 1;
+                }
+                break;
+            case 's':
+                seed = strtoull(optarg, nullptr, 10);
+                break;
+            case 'g':
+                coalesce_gap = atoll(optarg);
+                break;
+            case 't':
+                threads = atoi(optarg);
+                if (threads <= 0) {
+                    cout << usage << endl;
+                    return 1;
+                }
+                break;
+            default:
+                cout << usage << endl;
+                return 1;
+        }
+    }
+
+    if (argc-optind != 4 || (format != "bam" && format != "cram" && format != "vcf")) {
+        cout << usage << endl;
+        return 1;
+    }
+    const char *db = argv[optind],
+               *name_space = argv[optind+1],
+               *accession = argv[optind+2],
+               *fn = argv[optind+3];
+
+    vector<region> regions;
+    {
+        string dbid = derive_dbid(name_space, accession, format.c_str(), 0, 0);
+        shared_ptr<sqlite3> dbh = open_database_readonly(db);
+        int64_t file_id = find_indexed_file(dbh.get(), dbid);
+        regions = sample_regions(dbh.get(), file_id, regions_count, region_size, seed);
+        assemble_slices(dbh.get(), file_id, coalesce_gap, regions);
+    }
+
+    // check the slices on worker threads while scanning the whole file
+    atomic<size_t> next_region(0);
+    vector<thread> workers;
+    for (int i = 0; i < threads; i++) {
+        workers.push_back(thread([&]() {
+            size_t j;
+            while ((j = next_region++) < regions.size()) {
+                check_slice(fn, format, regions[j]);
+            }
+        }));
+    }
+    string scan_error;
+    try {
+        full_scan(fn, format, regions);
+    } catch (exception& exn) {
+        scan_error = exn.what();
+    }
+    for (auto& t : workers) {
+        t.join();
+    }
+    if (!scan_error.empty()) {
+        throw runtime_error(scan_error);
+    }
+
+    unsigned failures = 0;
+    int64_t total_bytes = 0;
+    double total_overfetch = 0;
+    for (const auto& r : regions) {
+        // apportion the slice's bytes among its records, as the coverage
+        // histograms apportion each block's bytes
+        double overfetch = r.records ? double(r.bytes) * (r.records - r.found) / r.records : r.bytes;
+        string status = "OK";
+        if (!r.error.empty()) {
+            status = "ERROR: " + r.error;
+        } else if (r.found < r.expected) {
+            status = "MISSING " + to_string(r.expected - r.found);
+        } else if (r.found != r.expected || r.found_digest != r.expected_digest) {
+            status = "MISMATCH";
+        }
+        if (status != "OK") {
+            failures++;
+        }
+        total_bytes += r.bytes;
+        total_overfetch += overfetch;
+
+        cout << r.seq;
+        if (r.seq != "*") {
+            cout << ":" << r.lo << "-" << r.hi;
+        }
+        cout << "\t" << r.bytes << "\t" << r.records << "\t" << r.expected << "\t" << r.found
+             << "\t" << int64_t(overfetch) << "\t" << status << "\n";
+    }
+    cout.flush();
+
+    cerr << regions.size() << " ranges checked, " << failures << " failed; "
+         << total_bytes << " bytes fetched, of which about " << int64_t(total_overfetch) << " over-fetched" << endl;
+    return failures ? 1 : 0;
+}
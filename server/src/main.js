@@ -13,6 +13,7 @@ program
     .option('-b, --bind [bind]', 'interface to bind; set 0.0.0.0 to bind all [127.0.0.1]', '127.0.0.1')
     .option('-p, --port [port]', 'port to listen on [48444]', 48444)
     .option('--credentials [creds.json]', 'cloud service credentials')
+    .option('--coalesce-gap [bytes]', 'in slice tickets, merge byte ranges of matching blocks separated by at most this many bytes; -1 for a single range [1048576]', 1048576)
     .parse(process.argv);
 if (program.args.length != 1) {
     program.help();
@@ -26,6 +27,7 @@ if (program.credentials) {
 var config = {
     bind: program.bind,
     port: parseInt(program.port),
+    coalesceGap: parseInt(program.coalesceGap),
     db: new sqlite3.Database(program.args[0], sqlite3.OPEN_READONLY)
 }
 
@@ -0,0 +1,49 @@
+#!/usr/bin/env python3
+# Checks the BGZF blocking of a BCF file as written by bgzip_records, for the
+# integration tests: the header must end on a block boundary, and so must every
+# record (none here are too large for one block). Prints the number of blocks
+# holding records of more than one reference sequence.
+# Usage: bcf_blocks.py <file.bcf>
+import struct, sys, zlib
+
+with open(sys.argv[1], 'rb') as f:
+    data = f.read()
+
+# decompress the BGZF blocks, noting the uncompressed offset at which each
+# begins
+text = bytearray()
+boundaries = []
+pos = 0
+while pos < len(data):
+    xlen, = struct.unpack('<H', data[pos+10:pos+12])
+    bsize, = struct.unpack('<H', data[pos+16:pos+18])
+    assert data[pos:pos+4] == b'\x1f\x8b\x08\x04' and xlen == 6 and data[pos+12:pos+14] == b'BC'
+    boundaries.append(len(text))
+    text += zlib.decompress(data[pos+18:pos+bsize+1-8], -15)
+    pos += bsize + 1
+boundaries.append(len(text))
+boundaries = sorted(set(boundaries))
+
+assert text[:5] == b'BCF\x02\x02', 'not BCF 2.2'
+l_text, = struct.unpack('<I', text[5:9])
+pos = 9 + l_text
+if pos not in boundaries:
+    sys.exit('header doesn\'t end on a BGZF block boundary')
+
+# the reference sequence of each record, by the block in which it begins
+block_seqs = {}
+records = 0
+block = boundaries.index(pos)
+while pos < len(text):
+    l_shared, l_indiv, chrom = struct.unpack('<IIi', text[pos:pos+12])
+    while boundaries[block+1] <= pos:
+        block += 1
+    block_seqs.setdefault(block, set()).add(chrom)
+    records += 1
+    pos += 8 + l_shared + l_indiv
+    if pos > boundaries[block+1]:
+        sys.exit('record %d straddles a BGZF block boundary' % records)
+if records == 0:
+    sys.exit('no records')
+
+print(sum(1 for seqs in block_seqs.values() if len(seqs) > 1))
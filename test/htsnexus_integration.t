@@ -4,7 +4,10 @@ set -o pipefail
 cd "${HTSNEXUS_HOME}"
 source test/bash-tap-bootstrap
 
-plan tests 69
+plan tests 181
+
+samtools=indexer/external/src/samtools/samtools
+bcftools=indexer/external/src/bcftools/bcftools
 
 # use htsnexus_index_bam to build the test database
 DBFN="${TMPDIR}/htsnexus_integration_test.db"
@@ -15,19 +18,67 @@ is "$?" "0" "add unindexed BAM"
 find "$DBFN" -type f > /dev/null
 is "$?" "0" "generate database"
 
-indexer/htsnexus_index_bam --reference GRCh37 "$DBFN" htsnexus_test NA12878 test/htsnexus_test_NA12878.bam "https://dl.dnanex.us/F/D/pjZ1Z8fpYzKj5Z8v3qXzVfffV1XzkXk4Kg4KzGBY/htsnexus_test_NA12878.bam"
+indexer/htsnexus_index_bam --reference GRCh37 --coverage 16384 --chunk-size 1048576 "$DBFN" htsnexus_test NA12878 test/htsnexus_test_NA12878.bam "https://dl.dnanex.us/F/D/pjZ1Z8fpYzKj5Z8v3qXzVfffV1XzkXk4Kg4KzGBY/htsnexus_test_NA12878.bam"
 is "$?" "0" "index BAM"
+is "$(sqlite3 "$DBFN" "select sum(reads) from htsfiles_coverage join htsfiles using (file_id) where _dbid = 'htsnexus_test:NA12878:bam'")" "27443" "BAM coverage histogram - placed read count"
+is "$(sqlite3 "$DBFN" "select sum(bytes) from htsfiles_coverage join htsfiles using (file_id) where _dbid = 'htsnexus_test:NA12878:bam'")" \
+   "$(sqlite3 "$DBFN" "select sum(byteHi - byteLo) from (select distinct byteLo, byteHi from htsfiles_blocks join htsfiles using (file_id) where _dbid = 'htsnexus_test:NA12878:bam' and tid >= 0)")" \
+   "BAM coverage histogram - bytes of the blocks with placed reads"
+# aligned bases in the bin 20:5996544-6012928, from the CIGARs of the mapped
+# reads overlapping it
+is "$(sqlite3 "$DBFN" "select bases from htsfiles_coverage join htsfiles_seqs using (file_id, tid) join htsfiles using (file_id) where _dbid = 'htsnexus_test:NA12878:bam' and name = '20' and binLo = 5996544")" \
+   "$($samtools view -F 4 test/htsnexus_test_NA12878.bam 20:5996545-6012928 | awk -v lo=5996544 -v hi=6012928 '
+        { pos = $4 - 1; len = 0; cigar = $6
+          while (match(cigar, /^[0-9]+[MIDNSHP=X]/)) {
+              op = substr(cigar, RLENGTH, 1)
+              if (op ~ /[MDN=X]/) len += substr(cigar, 1, RLENGTH - 1)
+              cigar = substr(cigar, RLENGTH + 1)
+          }
+          if (len == 0) len = 1
+          s = pos > lo ? pos : lo; e = pos + len < hi ? pos + len : hi
+          if (e > s) bases += e - s }
+        END { print bases }')" \
+   "BAM coverage histogram - aligned bases in one bin"
+is "$(sqlite3 "$DBFN" "select count(*) from htsfiles_chunks join htsfiles using (file_id) where _dbid = 'htsnexus_test:NA12878:bam'")" "3" "BAM chunk boundaries"
+is "$(sqlite3 "$DBFN" "select name, length from htsfiles_seqs join htsfiles using (file_id) where _dbid = 'htsnexus_test:NA12878:bam' and tid = 19")" "20|63025520" "BAM sequence dictionary"
+
+cp "$DBFN" "${DBFN}.v0"
+sqlite3 "${DBFN}.v0" "pragma user_version = 0"
+indexer/htsnexus_index_bam "${DBFN}.v0" ENCODE ENCFF621SXF xxx "https://www.encodeproject.org/files/ENCFF621SXF/@@download/ENCFF621SXF.bam" 2> /dev/null
+isnt "$?" "0" "reject database with old schema version"
+rm -f "${DBFN}.v0"
+
+output=$(indexer/htsnexus_shard --shards 4 "$DBFN" htsnexus_test NA12878)
+is "$?" "0" "shard BAM"
+is "$(echo "$output" | egrep -c "^[^:]+:[0-9]+-[0-9]+$")" "4" "shard BAM - region count"
+is "$(echo "$output" | awk -F '[:-]' '{ if ($2 != (($1 in expect) ? expect[$1] : 1)) print "gap", $0; expect[$1] = $3 + 1 } END { for (s in expect) print s, expect[s] - 1 }' | sort)" \
+   "$(sqlite3 -separator ' ' "$DBFN" "select name, max(seqHi) from htsfiles_blocks join htsfiles_seqs using (file_id, tid) join htsfiles using (file_id) where _dbid = 'htsnexus_test:NA12878:bam' group by name" | sort)" \
+   "shard BAM - regions disjoint and covering each sequence"
+shard_bytes=$(echo "$output" | awk -F '[:-]' '{ printf "select coalesce(sum(bytes), 0) from htsfiles_coverage join htsfiles_seqs using (file_id, tid) join htsfiles using (file_id) where _dbid = '\''htsnexus_test:NA12878:bam'\'' and name = '\''%s'\'' and binLo >= %d and binLo < %d;\n", $1, $2-1, $3 }' | sqlite3 "$DBFN" | sort -n)
+is "$(echo "$shard_bytes" | awk 'NR == 1 { lo = $1 } { hi = $1 } END { print (lo > 0 && hi <= 1.5*lo) }')" "1" "shard BAM - balanced byte sizes"
+
+printf "20\t0\t100000000\n" > "${TMPDIR}/htsnexus_integration_test.bed"
+is "$(indexer/htsnexus_query "$DBFN" htsnexus_test NA12878 "${TMPDIR}/htsnexus_integration_test.bed")" \
+   "$(sqlite3 -separator $'\t' "$DBFN" "select min(byteLo), max(byteHi) from htsfiles_blocks join htsfiles_seqs using (file_id, tid) join htsfiles using (file_id) where _dbid = 'htsnexus_test:NA12878:bam' and name = '20'")" \
+   "batch query BAM - whole chromosome"
+printf "11\t5005000\t5006000\n20\t6000000\t6001000\n20\t6000500\t6002000\n" > "${TMPDIR}/htsnexus_integration_test.bed"
+is "$(indexer/htsnexus_query --coalesce-gap 0 "$DBFN" htsnexus_test NA12878 "${TMPDIR}/htsnexus_integration_test.bed" | wc -l)" "2" "batch query BAM - disjoint ranges"
 
 indexer/src/htsnexus_downsample_index.py "$DBFN"
 is "$?" "0" "downsample index"
 
 # start the server
 server_pid=""
+serve_pids=""
 function cleanup {
 	if [ -n "$server_pid" ]; then
 		echo "killing htsnexus test server pid=$server_pid"
 		pkill -P $server_pid || true
 	fi
+	if [ -n "$serve_pids" ]; then
+		echo "killing htsnexus_serve pids=$serve_pids"
+		kill $serve_pids || true
+	fi
 }
 trap cleanup EXIT
 
@@ -38,12 +89,11 @@ sleep 2
 ps -p $server_pid
 is "$?" "0" "server startup"
 
-samtools=indexer/external/src/samtools/samtools
-
 # perform some queries
 output=$(client/htsnexus.py -v -s http://localhost:48444/v1/reads htsnexus_test NA12878 | $samtools view -c -)
 is "$?" "0" "read entire BAM"
 is "$output" "39918" "read entire BAM - record count"
+is "$(client/htsnexus.py -v -s http://localhost:48444/v1/reads htsnexus_test NA12878 2>&1 > /dev/null | grep -c '"range": "bytes=')" "3" "read entire BAM - chunked ticket"
 
 output=$(client/htsnexus.py -v -s http://localhost:48444/v1/reads -r 20 htsnexus_test NA12878 | $samtools view -c -)
 is "$?" "0" "read BAM chromosome slice"
@@ -102,6 +152,16 @@ is "$?" "0" "DNAnexus-optimized URL rewrite"
 indexer/htsnexus_index_cram --reference GRCh37 "$DBFN" htsnexus_test NA12878 test/htsnexus_test_NA12878.cram "https://dl.dnanex.us/F/D/fkx3bPPfXP8F0z61bfGJ8JkjZ05fBpyyyZy8jf1Z/htsnexus_test_NA12878.cram"
 is "$?" "0" "index CRAM"
 
+# reading the input through the mmap backend
+MMAPDBFN="${TMPDIR}/htsnexus_integration_test_mmap.db"
+rm -f "$MMAPDBFN"
+indexer/htsnexus_index_cram --reference GRCh37 --io mmap "$MMAPDBFN" htsnexus_test NA12878 test/htsnexus_test_NA12878.cram "https://dl.dnanex.us/F/D/fkx3bPPfXP8F0z61bfGJ8JkjZ05fBpyyyZy8jf1Z/htsnexus_test_NA12878.cram"
+is "$?" "0" "index CRAM with --io mmap"
+mmap_blocks_sql="select byteLo, byteHi, tid, seqLo, seqHi from htsfiles_blocks join htsfiles using (file_id) where _dbid = 'htsnexus_test:NA12878:cram' order by byteLo, tid"
+is "$(sqlite3 "$MMAPDBFN" "$mmap_blocks_sql; select hex(header), hex(slice_prefix) from htsfiles_blocks_meta")" \
+   "$(sqlite3 "$DBFN" "$mmap_blocks_sql; select hex(header), hex(slice_prefix) from htsfiles_blocks_meta join htsfiles using (file_id) where _dbid = 'htsnexus_test:NA12878:cram'")" \
+   "index CRAM with --io mmap - same block index and header"
+
 output=$((client/htsnexus.py -s http://localhost:48444/v1/reads htsnexus_test NA12878 cram || true) | head -c 4)
 is "$?" "0" "get CRAM (CalledProcessError above is normal)"
 is "$output" "CRAM" "get CRAM"
@@ -161,6 +221,25 @@ gunzip -dc test/htsnexus_test_1000G.vcf.gz | indexer/bgzip_lines > "${TMPDIR}/ht
 indexer/htsnexus_index_vcf --reference GRCh37 "$DBFN" htsnexus_test 1000genomes "${TMPDIR}/htsnexus_test_1000G.vcf.gz" "https://dl.dnanex.us/F/D/fQVjxXPJPbK76QBB8jzvG3F6PBqbj0YY8q277qXK/htsnexus_test_1000G.vcf.gz"
 is "$?" "0" "index VCF"
 
+VCFDBFN="${TMPDIR}/htsnexus_integration_test_vcf.db"
+rm -f "$VCFDBFN"
+indexer/htsnexus_index_vcf --reference GRCh37 --threads 4 "$VCFDBFN" htsnexus_test 1000genomes "${TMPDIR}/htsnexus_test_1000G.vcf.gz" "https://dl.dnanex.us/F/D/fQVjxXPJPbK76QBB8jzvG3F6PBqbj0YY8q277qXK/htsnexus_test_1000G.vcf.gz"
+is "$?" "0" "index VCF with multiple threads"
+vcf_blocks_sql="select byteLo, byteHi, tid, seqLo, seqHi from htsfiles_blocks join htsfiles using (file_id) where _dbid = 'htsnexus_test:1000genomes:vcf' order by byteLo, tid"
+is "$(sqlite3 "$VCFDBFN" "$vcf_blocks_sql")" \
+   "$(sqlite3 "$DBFN" "$vcf_blocks_sql")" \
+   "index VCF with multiple threads - same index"
+
+# reading the input with O_DIRECT (or, where the filesystem doesn't support it,
+# the buffered fallback)
+DIRECTDBFN="${TMPDIR}/htsnexus_integration_test_direct.db"
+rm -f "$DIRECTDBFN"
+indexer/htsnexus_index_vcf --reference GRCh37 --io direct "$DIRECTDBFN" htsnexus_test 1000genomes "${TMPDIR}/htsnexus_test_1000G.vcf.gz" "https://dl.dnanex.us/F/D/fQVjxXPJPbK76QBB8jzvG3F6PBqbj0YY8q277qXK/htsnexus_test_1000G.vcf.gz"
+is "$?" "0" "index VCF with --io direct"
+is "$(sqlite3 "$DIRECTDBFN" "$vcf_blocks_sql")" \
+   "$(sqlite3 "$DBFN" "$vcf_blocks_sql")" \
+   "index VCF with --io direct - same index"
+
 # the following url says 'reads' intentionally, to test client compatibility hack.
 output=$((client/htsnexus.py -s http://localhost:48444/v1/reads htsnexus_test 1000genomes VCF || true) | gzip -dc | wc -l)
 is "$?" "0" "read entire VCF"
@@ -182,3 +261,356 @@ client/htsnexus.py -v -s http://localhost:48444/v1/variants -r 20 htsnexus_test
 is "$?" "0" "read VCF empty range slice"
 is "$(cat "${VCFFN}" | wc -l)" "253" "read VCF empty range slice - line count"
 is "$(egrep -v "^#" "${VCFFN}" | wc -l)" "0" "read VCF empty range slice - record count"
+
+##################
+# native server #
+##################
+
+indexer/htsnexus_serve --port 48445 --threads 2 "$DBFN" &
+serve_pid=$!
+serve_pids="$serve_pids $serve_pid"
+
+sleep 1
+ps -p $serve_pid
+is "$?" "0" "native server startup"
+
+output=$(client/htsnexus.py -s http://localhost:48445/v1/reads htsnexus_test NA12878 | $samtools view -c -)
+is "$output" "39918" "native server - read entire BAM - record count"
+
+output=$(client/htsnexus.py -s http://localhost:48445/v1/reads -r 20 htsnexus_test NA12878 | $samtools view -c -)
+is "$output" "14955" "native server - read BAM chromosome slice - record count"
+
+output=$(client/htsnexus.py -s http://localhost:48445/v1/reads -r 20 htsnexus_test NA12878 cram | $samtools view -c -)
+is "$output" "14545" "native server - read CRAM chromosome slice - record count"
+
+is "$(client/htsnexus.py -s http://localhost:48445/v1/variants -r 22:16000000-16300000 htsnexus_test 1000genomes VCF | gzip -dc | md5sum)" \
+   "$(client/htsnexus.py -s http://localhost:48444/v1/variants -r 22:16000000-16300000 htsnexus_test 1000genomes VCF | gzip -dc | md5sum)" \
+   "native server - VCF range slice same as Node.js server"
+
+# slice-level CRAM index, with each slice served as a standalone container
+SLICEDBFN="${TMPDIR}/htsnexus_integration_test_slices.db"
+rm -f "$SLICEDBFN"
+indexer/htsnexus_index_cram --reference GRCh37 --slices "$SLICEDBFN" htsnexus_test NA12878 test/htsnexus_test_NA12878.cram "https://dl.dnanex.us/F/D/fkx3bPPfXP8F0z61bfGJ8JkjZ05fBpyyyZy8jf1Z/htsnexus_test_NA12878.cram"
+is "$?" "0" "index CRAM slices"
+is "$(sqlite3 "$SLICEDBFN" "select count(*) from htsfiles_blocks where block_prefix is null")" "0" "index CRAM slices - container header prefixes"
+
+indexer/htsnexus_serve --port 48446 --threads 1 "$SLICEDBFN" &
+serve_pids="$serve_pids $!"
+sleep 1
+output=$(client/htsnexus.py -s http://localhost:48446/v1/reads -r 20 htsnexus_test NA12878 cram | $samtools view -c -)
+is "$output" "14545" "read CRAM chromosome slice from slice-level index - record count"
+
+# batch query of the slice-level index: reassemble the framed slices from its
+# output, as the servers would, and decode them
+function unhex {
+	python3 -c "import sys, binascii; sys.stdout.buffer.write(binascii.unhexlify(sys.stdin.read().strip()))"
+}
+function assemble_query_slice {
+	local meta_sql="from htsfiles_blocks_meta join htsfiles using (file_id) where _dbid = 'htsnexus_test:NA12878:cram'"
+	sqlite3 "$1" "select hex(slice_prefix) $meta_sql" | unhex
+	indexer/htsnexus_query --format cram "$1" htsnexus_test NA12878 "$2" | while IFS=$'\t' read lo hi prefix suffix; do
+		echo -n "$prefix" | base64 -d
+		tail -c +$(( lo + 1 )) test/htsnexus_test_NA12878.cram | head -c $(( hi - lo ))
+		echo -n "$suffix" | base64 -d
+	done
+	sqlite3 "$1" "select hex(slice_suffix) $meta_sql" | unhex
+}
+printf "20\t6000000\t6001000\n" > "${TMPDIR}/htsnexus_integration_test.bed"
+is "$(indexer/htsnexus_query --format cram "$SLICEDBFN" htsnexus_test NA12878 "${TMPDIR}/htsnexus_integration_test.bed" | awk -F '\t' 'NF != 4' | wc -l)" "0" \
+   "batch query CRAM slices - framed ranges with prefixes"
+is "$(assemble_query_slice "$SLICEDBFN" "${TMPDIR}/htsnexus_integration_test.bed" | $samtools view -c -)" \
+   "$(client/htsnexus.py -s http://localhost:48446/v1/reads -r 20:6000000-6001000 htsnexus_test NA12878 cram | $samtools view -c -)" \
+   "batch query CRAM slices - decodable, same records as the server's slice"
+
+# CRAM indexing offline (no reference lookups), populating and then reusing the
+# multi-ref slice cache
+CACHEDBFN="${TMPDIR}/htsnexus_integration_test_cache.db"
+SLICECACHEFN="${TMPDIR}/htsnexus_integration_test_slice_cache.db"
+rm -f "$CACHEDBFN" "$SLICECACHEFN"
+REF_PATH=/nonexistent REF_CACHE=/nonexistent indexer/htsnexus_index_cram --reference GRCh37 --slice-cache "$SLICECACHEFN" "$CACHEDBFN" htsnexus_test NA12878 test/htsnexus_test_NA12878.cram "https://dl.dnanex.us/F/D/fkx3bPPfXP8F0z61bfGJ8JkjZ05fBpyyyZy8jf1Z/htsnexus_test_NA12878.cram"
+is "$?" "0" "index CRAM offline with slice cache"
+blocks_sql="select byteLo, byteHi, tid, seqLo, seqHi from htsfiles_blocks join htsfiles using (file_id) where _dbid = 'htsnexus_test:NA12878:cram' order by byteLo, tid"
+is "$(sqlite3 "$CACHEDBFN" "$blocks_sql")" "$(sqlite3 "$DBFN" "$blocks_sql")" "index CRAM offline with slice cache - same block index"
+
+# a CRAM fixture made of small multi-ref slices (as htslib writes for sparse
+# data), which must be decoded to index
+MULTIREFCRAMFN="${TMPDIR}/htsnexus_integration_test_multiref.cram"
+$samtools view -C --output-fmt-option no_ref=1 --output-fmt-option multi_seq_per_slice=1 \
+    --output-fmt-option seqs_per_slice=500 --output-fmt-option slices_per_container=4 \
+    test/htsnexus_test_NA12878.cram > "$MULTIREFCRAMFN"
+is "$?" "0" "make multi-ref CRAM fixture"
+MULTIREFDBFN="${TMPDIR}/htsnexus_integration_test_multiref.db"
+rm -f "$MULTIREFDBFN" "$CACHEDBFN" "$SLICECACHEFN"
+REF_PATH=/nonexistent REF_CACHE=/nonexistent indexer/htsnexus_index_cram --reference GRCh37 "$MULTIREFDBFN" htsnexus_test NA12878 "$MULTIREFCRAMFN" "https://example.com/htsnexus_test_multiref.cram"
+is "$?" "0" "index multi-ref CRAM"
+span_sql="select tid, min(seqLo), max(seqHi) from htsfiles_blocks join htsfiles using (file_id) where _dbid = 'htsnexus_test:NA12878:cram' group by tid order by tid"
+is "$(sqlite3 "$MULTIREFDBFN" "$span_sql")" "$(sqlite3 "$DBFN" "$span_sql")" "index multi-ref CRAM - same sequence spans as the original CRAM"
+# the same, encoded against the reference (hs37d5, as fetched above): its
+# multi-ref slices can't be fully decoded without the reference, but indexing
+# them mustn't need it
+MULTIREFREFCRAMFN="${TMPDIR}/htsnexus_integration_test_multiref_ref.cram"
+MULTIREFREFDBFN="${TMPDIR}/htsnexus_integration_test_multiref_ref.db"
+rm -f "$MULTIREFREFDBFN"
+$samtools view -C --output-fmt-option multi_seq_per_slice=1 \
+    --output-fmt-option seqs_per_slice=500 --output-fmt-option slices_per_container=4 \
+    test/htsnexus_test_NA12878.cram > "$MULTIREFREFCRAMFN"
+is "$?" "0" "make reference-based multi-ref CRAM fixture"
+REF_PATH=/nonexistent REF_CACHE=/nonexistent $samtools view -c "$MULTIREFREFCRAMFN" > /dev/null 2>&1
+isnt "$?" "0" "reference-based multi-ref CRAM fixture - needs the reference to read"
+REF_PATH=/nonexistent REF_CACHE=/nonexistent indexer/htsnexus_index_cram --reference GRCh37 "$MULTIREFREFDBFN" htsnexus_test NA12878 "$MULTIREFREFCRAMFN" "https://example.com/htsnexus_test_multiref_ref.cram"
+is "$?" "0" "index reference-based multi-ref CRAM offline"
+is "$(sqlite3 "$MULTIREFREFDBFN" "$span_sql")" "$(sqlite3 "$MULTIREFDBFN" "$span_sql")" \
+   "index reference-based multi-ref CRAM offline - same sequence spans as without the reference"
+
+# populate the slice cache from the multi-ref slices, and re-index from it
+REF_PATH=/nonexistent REF_CACHE=/nonexistent indexer/htsnexus_index_cram --reference GRCh37 --slice-cache "$SLICECACHEFN" "$CACHEDBFN" htsnexus_test NA12878 "$MULTIREFCRAMFN" "https://example.com/htsnexus_test_multiref.cram"
+multiref_blocks_sql="select byteLo, byteHi, tid, seqLo, seqHi from htsfiles_blocks join htsfiles using (file_id) where _dbid = 'htsnexus_test:NA12878:cram' order by byteLo, tid"
+is "$(sqlite3 "$CACHEDBFN" "$multiref_blocks_sql")" "$(sqlite3 "$MULTIREFDBFN" "$multiref_blocks_sql")" "index multi-ref CRAM with slice cache - same block index"
+slice_cache_rows=$(sqlite3 "$SLICECACHEFN" "select count(*) from slice_ranges")
+is "$(( slice_cache_rows > 0 ))" "1" "index multi-ref CRAM with slice cache - slice ranges cached"
+rm -f "$CACHEDBFN"
+REF_PATH=/nonexistent REF_CACHE=/nonexistent indexer/htsnexus_index_cram --reference GRCh37 --slice-cache "$SLICECACHEFN" "$CACHEDBFN" htsnexus_test NA12878 "$MULTIREFCRAMFN" "https://example.com/htsnexus_test_multiref.cram"
+is "$(sqlite3 "$CACHEDBFN" "$multiref_blocks_sql")" "$(sqlite3 "$MULTIREFDBFN" "$multiref_blocks_sql")" "re-index multi-ref CRAM from slice cache - same block index"
+is "$(sqlite3 "$SLICECACHEFN" "select count(*) from slice_ranges")" "$slice_cache_rows" "re-index multi-ref CRAM from slice cache - no new entries"
+# the ranges really come from the cache: doctor them, and they show up in the
+# re-index...
+sqlite3 "$SLICECACHEFN" "update slice_ranges set lo = 0 where tid >= 0"
+rm -f "$CACHEDBFN"
+REF_PATH=/nonexistent REF_CACHE=/nonexistent indexer/htsnexus_index_cram --reference GRCh37 --slice-cache "$SLICECACHEFN" "$CACHEDBFN" htsnexus_test NA12878 "$MULTIREFCRAMFN" "https://example.com/htsnexus_test_multiref.cram"
+is "$(sqlite3 "$CACHEDBFN" "select count(*) from htsfiles_blocks where tid >= 0 and seqLo <> 0")" "0" \
+   "re-index multi-ref CRAM from slice cache - ranges read from cache"
+# ...but not in a different file with the same slices (only its CRAM file ID
+# differs)
+MULTIREFCOPYFN="${TMPDIR}/htsnexus_integration_test_multiref_copy.cram"
+(head -c 6 "$MULTIREFCRAMFN"; echo -n "htsnexus_test_copy__"; tail -c +27 "$MULTIREFCRAMFN") > "$MULTIREFCOPYFN"
+rm -f "$CACHEDBFN"
+REF_PATH=/nonexistent REF_CACHE=/nonexistent indexer/htsnexus_index_cram --reference GRCh37 --slice-cache "$SLICECACHEFN" "$CACHEDBFN" htsnexus_test NA12878 "$MULTIREFCOPYFN" "https://example.com/htsnexus_test_multiref.cram"
+is "$(sqlite3 "$CACHEDBFN" "$multiref_blocks_sql")" "$(sqlite3 "$MULTIREFDBFN" "$multiref_blocks_sql")" \
+   "index copy of multi-ref CRAM with slice cache - other file's entries unused"
+
+# decoding multi-ref slices on multiple threads
+THREADSDBFN="${TMPDIR}/htsnexus_integration_test_threads.db"
+rm -f "$THREADSDBFN"
+REF_PATH=/nonexistent REF_CACHE=/nonexistent indexer/htsnexus_index_cram --reference GRCh37 --threads 4 "$THREADSDBFN" htsnexus_test NA12878 test/htsnexus_test_NA12878.cram "https://dl.dnanex.us/F/D/fkx3bPPfXP8F0z61bfGJ8JkjZ05fBpyyyZy8jf1Z/htsnexus_test_NA12878.cram"
+is "$?" "0" "index CRAM with multiple threads"
+is "$(sqlite3 "$THREADSDBFN" "$blocks_sql")" "$(sqlite3 "$DBFN" "$blocks_sql")" "index CRAM with multiple threads - same block index"
+rm -f "$THREADSDBFN"
+cat test/htsnexus_test_NA12878.cram | indexer/htsnexus_index_cram --reference GRCh37 --slices --threads 4 "$THREADSDBFN" htsnexus_test NA12878 - "https://dl.dnanex.us/F/D/fkx3bPPfXP8F0z61bfGJ8JkjZ05fBpyyyZy8jf1Z/htsnexus_test_NA12878.cram"
+is "$(sqlite3 "$THREADSDBFN" "select byteLo, byteHi, tid, seqLo, seqHi, hex(block_prefix) from htsfiles_blocks join htsfiles using (file_id) where _dbid = 'htsnexus_test:NA12878:cram' order by byteLo, tid")" \
+   "$(sqlite3 "$SLICEDBFN" "select byteLo, byteHi, tid, seqLo, seqHi, hex(block_prefix) from htsfiles_blocks join htsfiles using (file_id) where _dbid = 'htsnexus_test:NA12878:cram' order by byteLo, tid")" \
+   "index CRAM slices from standard input with multiple threads - same slice index"
+# ...and on the multi-ref CRAM, where there are slices to decode
+rm -f "$THREADSDBFN"
+REF_PATH=/nonexistent REF_CACHE=/nonexistent indexer/htsnexus_index_cram --reference GRCh37 --threads 4 "$THREADSDBFN" htsnexus_test NA12878 "$MULTIREFCRAMFN" "https://example.com/htsnexus_test_multiref.cram"
+is "$?" "0" "index multi-ref CRAM with multiple threads"
+is "$(sqlite3 "$THREADSDBFN" "$multiref_blocks_sql")" "$(sqlite3 "$MULTIREFDBFN" "$multiref_blocks_sql")" "index multi-ref CRAM with multiple threads - same block index"
+THREADSSLICEDBFN="${TMPDIR}/htsnexus_integration_test_threads_slices.db"
+rm -f "$THREADSDBFN" "$THREADSSLICEDBFN"
+REF_PATH=/nonexistent REF_CACHE=/nonexistent indexer/htsnexus_index_cram --reference GRCh37 --slices --threads 1 "$THREADSSLICEDBFN" htsnexus_test NA12878 "$MULTIREFCRAMFN" "https://example.com/htsnexus_test_multiref.cram"
+REF_PATH=/nonexistent REF_CACHE=/nonexistent indexer/htsnexus_index_cram --reference GRCh37 --slices --threads 4 "$THREADSDBFN" htsnexus_test NA12878 "$MULTIREFCRAMFN" "https://example.com/htsnexus_test_multiref.cram"
+is "$?" "0" "index multi-ref CRAM slices with multiple threads"
+multiref_slices_sql="select byteLo, byteHi, tid, seqLo, seqHi, hex(block_prefix) from htsfiles_blocks join htsfiles using (file_id) where _dbid = 'htsnexus_test:NA12878:cram' order by byteLo, tid"
+is "$(sqlite3 "$THREADSDBFN" "$multiref_slices_sql")" "$(sqlite3 "$THREADSSLICEDBFN" "$multiref_slices_sql")" "index multi-ref CRAM slices with multiple threads - same slice index"
+is "$(sqlite3 "$THREADSDBFN" "select count(*) > 1 from htsfiles_blocks")" "1" "index multi-ref CRAM slices with multiple threads - nonempty"
+
+# indexing from standard input, teeing the bytes to a local file
+STREAMDBFN="${TMPDIR}/htsnexus_integration_test_stream.db"
+TEEFN="${TMPDIR}/htsnexus_integration_test_tee"
+rm -f "$STREAMDBFN" "$TEEFN"
+cat test/htsnexus_test_NA12878.bam | indexer/htsnexus_index_bam --reference GRCh37 --tee "$TEEFN" "$STREAMDBFN" htsnexus_test NA12878 - "https://dl.dnanex.us/F/D/pjZ1Z8fpYzKj5Z8v3qXzVfffV1XzkXk4Kg4KzGBY/htsnexus_test_NA12878.bam"
+is "$?" "0" "index BAM from standard input"
+bam_blocks_sql="select byteLo, byteHi, tid, seqLo, seqHi from htsfiles_blocks join htsfiles using (file_id) where _dbid = 'htsnexus_test:NA12878:bam' order by byteLo, tid"
+is "$(sqlite3 "$STREAMDBFN" "$bam_blocks_sql")" "$(sqlite3 "$DBFN" "$bam_blocks_sql")" "index BAM from standard input - same block index"
+cmp -s "$TEEFN" test/htsnexus_test_NA12878.bam
+is "$?" "0" "index BAM from standard input - tee output"
+is "$(sqlite3 "$STREAMDBFN" "select file_size from htsfiles where _dbid = 'htsnexus_test:NA12878:bam'")" "$(stat -c %s test/htsnexus_test_NA12878.bam)" "index BAM from standard input - file size"
+cat test/htsnexus_test_NA12878.cram | indexer/htsnexus_index_cram --reference GRCh37 --slices "$STREAMDBFN" htsnexus_test NA12878 - "https://dl.dnanex.us/F/D/fkx3bPPfXP8F0z61bfGJ8JkjZ05fBpyyyZy8jf1Z/htsnexus_test_NA12878.cram"
+is "$(sqlite3 "$STREAMDBFN" "select byteLo, hex(block_prefix) from htsfiles_blocks join htsfiles using (file_id) where _dbid = 'htsnexus_test:NA12878:cram' order by byteLo, tid")" \
+   "$(sqlite3 "$SLICEDBFN" "select byteLo, hex(block_prefix) from htsfiles_blocks join htsfiles using (file_id) where _dbid = 'htsnexus_test:NA12878:cram' order by byteLo, tid")" \
+   "index CRAM slices from standard input - same slice prefixes"
+indexer/htsnexus_index_vcf --reference GRCh37 "$STREAMDBFN" htsnexus_test 1000genomes - "https://dl.dnanex.us/F/D/fQVjxXPJPbK76QBB8jzvG3F6PBqbj0YY8q277qXK/htsnexus_test_1000G.vcf.gz" < "${TMPDIR}/htsnexus_test_1000G.vcf.gz"
+is "$(sqlite3 "$STREAMDBFN" "$vcf_blocks_sql")" "$(sqlite3 "$DBFN" "$vcf_blocks_sql")" "index VCF from standard input - same block index"
+
+# append-mode indexing: index a prefix of each file (ending on a block
+# boundary), then let it "grow" to the full file and index just the remainder
+APPENDDBFN="${TMPDIR}/htsnexus_integration_test_append.db"
+GROWINGFN="${TMPDIR}/htsnexus_integration_test_growing"
+rm -f "$APPENDDBFN"
+head -c "$(sqlite3 "$DBFN" "select byteHi from htsfiles_blocks join htsfiles using (file_id) where _dbid = 'htsnexus_test:NA12878:bam' order by byteLo limit 1 offset 20")" test/htsnexus_test_NA12878.bam > "${GROWINGFN}.bam"
+indexer/htsnexus_index_bam --reference GRCh37 --chunk-size 1048576 "$APPENDDBFN" htsnexus_test NA12878 "${GROWINGFN}.bam" "https://dl.dnanex.us/F/D/pjZ1Z8fpYzKj5Z8v3qXzVfffV1XzkXk4Kg4KzGBY/htsnexus_test_NA12878.bam" 2> /dev/null
+is "$?" "0" "index partial BAM"
+cp test/htsnexus_test_NA12878.bam "${GROWINGFN}.bam"
+indexer/htsnexus_index_bam --reference GRCh37 --chunk-size 1048576 --append "$APPENDDBFN" htsnexus_test NA12878 "${GROWINGFN}.bam" "https://dl.dnanex.us/F/D/pjZ1Z8fpYzKj5Z8v3qXzVfffV1XzkXk4Kg4KzGBY/htsnexus_test_NA12878.bam"
+is "$?" "0" "append to BAM index"
+is "$(sqlite3 "$APPENDDBFN" "$bam_blocks_sql")" "$(sqlite3 "$DBFN" "$bam_blocks_sql")" "append to BAM index - same block index"
+bam_chunks_sql="select byteLo, byteHi from htsfiles_chunks join htsfiles using (file_id) where _dbid = 'htsnexus_test:NA12878:bam' order by byteLo"
+is "$(sqlite3 "$APPENDDBFN" "$bam_chunks_sql")" "$(sqlite3 "$DBFN" "$bam_chunks_sql")" "append to BAM index - same chunks"
+is "$(sqlite3 "$APPENDDBFN" "select file_size from htsfiles where _dbid = 'htsnexus_test:NA12878:bam'")" "$(stat -c %s test/htsnexus_test_NA12878.bam)" "append to BAM index - file size"
+head -c "$(sqlite3 "$DBFN" "select byteHi from htsfiles_blocks join htsfiles using (file_id) where _dbid = 'htsnexus_test:1000genomes:vcf' order by byteLo limit 1 offset 5")" "${TMPDIR}/htsnexus_test_1000G.vcf.gz" > "${GROWINGFN}.vcf.gz"
+indexer/htsnexus_index_vcf --reference GRCh37 "$APPENDDBFN" htsnexus_test 1000genomes "${GROWINGFN}.vcf.gz" "https://dl.dnanex.us/F/D/fQVjxXPJPbK76QBB8jzvG3F6PBqbj0YY8q277qXK/htsnexus_test_1000G.vcf.gz"
+cp "${TMPDIR}/htsnexus_test_1000G.vcf.gz" "${GROWINGFN}.vcf.gz"
+indexer/htsnexus_index_vcf --reference GRCh37 --append --threads 2 "$APPENDDBFN" htsnexus_test 1000genomes "${GROWINGFN}.vcf.gz" "https://dl.dnanex.us/F/D/fQVjxXPJPbK76QBB8jzvG3F6PBqbj0YY8q277qXK/htsnexus_test_1000G.vcf.gz"
+is "$?" "0" "append to VCF index"
+is "$(sqlite3 "$APPENDDBFN" "$vcf_blocks_sql")" "$(sqlite3 "$DBFN" "$vcf_blocks_sql")" "append to VCF index - same block index"
+head -c "$(sqlite3 "$DBFN" "select distinct byteHi from htsfiles_blocks join htsfiles using (file_id) where _dbid = 'htsnexus_test:NA12878:cram' order by byteHi limit 1 offset 2")" test/htsnexus_test_NA12878.cram > "${GROWINGFN}.cram"
+indexer/htsnexus_index_cram --reference GRCh37 "$APPENDDBFN" htsnexus_test NA12878 "${GROWINGFN}.cram" "https://dl.dnanex.us/F/D/fkx3bPPfXP8F0z61bfGJ8JkjZ05fBpyyyZy8jf1Z/htsnexus_test_NA12878.cram" 2> /dev/null
+is "$?" "0" "index partial CRAM"
+cp test/htsnexus_test_NA12878.cram "${GROWINGFN}.cram"
+indexer/htsnexus_index_cram --reference GRCh37 --append "$APPENDDBFN" htsnexus_test NA12878 "${GROWINGFN}.cram" "https://dl.dnanex.us/F/D/fkx3bPPfXP8F0z61bfGJ8JkjZ05fBpyyyZy8jf1Z/htsnexus_test_NA12878.cram"
+is "$?" "0" "append to CRAM index"
+is "$(sqlite3 "$APPENDDBFN" "$blocks_sql")" "$(sqlite3 "$DBFN" "$blocks_sql")" "append to CRAM index - same block index"
+is "$(sqlite3 "$APPENDDBFN" "select file_size from htsfiles where _dbid = 'htsnexus_test:NA12878:cram'")" "$(stat -c %s test/htsnexus_test_NA12878.cram)" "append to CRAM index - file size"
+# the same for the slices of the multi-ref CRAM, with the slice cache, against
+# indexing the whole file at once
+MULTIREFSLICEDBFN="${TMPDIR}/htsnexus_integration_test_multiref_slices.db"
+MULTIREFSLICECACHEFN="${TMPDIR}/htsnexus_integration_test_multiref_slice_cache.db"
+APPENDSLICECACHEFN="${TMPDIR}/htsnexus_integration_test_append_slice_cache.db"
+rm -f "$APPENDDBFN" "$MULTIREFSLICEDBFN" "$MULTIREFSLICECACHEFN" "$APPENDSLICECACHEFN"
+indexer/htsnexus_index_cram --reference GRCh37 --slices --slice-cache "$MULTIREFSLICECACHEFN" "$MULTIREFSLICEDBFN" htsnexus_test NA12878 "$MULTIREFCRAMFN" "https://example.com/htsnexus_test_multiref.cram"
+head -c "$(sqlite3 "$MULTIREFDBFN" "select distinct byteHi from htsfiles_blocks order by byteHi limit 1 offset 5")" "$MULTIREFCRAMFN" > "${GROWINGFN}.cram"
+indexer/htsnexus_index_cram --reference GRCh37 --slices --slice-cache "$APPENDSLICECACHEFN" "$APPENDDBFN" htsnexus_test NA12878 "${GROWINGFN}.cram" "https://example.com/htsnexus_test_multiref.cram" 2> /dev/null
+cp "$MULTIREFCRAMFN" "${GROWINGFN}.cram"
+indexer/htsnexus_index_cram --reference GRCh37 --append "$APPENDDBFN" htsnexus_test NA12878 "${GROWINGFN}.cram" "https://example.com/htsnexus_test_multiref.cram"
+isnt "$?" "0" "append to CRAM slice index - reject without --slices"
+indexer/htsnexus_index_cram --reference GRCh37 --append --slices --slice-cache "$APPENDSLICECACHEFN" "$APPENDDBFN" htsnexus_test NA12878 "${GROWINGFN}.cram" "https://example.com/htsnexus_test_multiref.cram"
+is "$?" "0" "append to CRAM slice index"
+slices_sql="select byteLo, byteHi, tid, seqLo, seqHi, hex(block_prefix) from htsfiles_blocks join htsfiles using (file_id) where _dbid = 'htsnexus_test:NA12878:cram' order by byteLo, tid"
+is "$(sqlite3 "$APPENDDBFN" "$slices_sql")" "$(sqlite3 "$MULTIREFSLICEDBFN" "$slices_sql")" "append to CRAM slice index - same slice index"
+slice_cache_sql="select slice_offset, header_crc32, tid, lo, hi from slice_ranges order by slice_offset, header_crc32, tid"
+is "$(sqlite3 "$APPENDSLICECACHEFN" "$slice_cache_sql")" "$(sqlite3 "$MULTIREFSLICECACHEFN" "$slice_cache_sql")" "append to CRAM slice index - same slice cache"
+
+# indexing files while they're being written, as by a download
+FOLLOWDBFN="${TMPDIR}/htsnexus_integration_test_follow.db"
+FOLLOWFN="${TMPDIR}/htsnexus_integration_test_following"
+rm -f "$FOLLOWDBFN" "${FOLLOWFN}.bam" "${FOLLOWFN}.cram"
+function slow_copy {
+	# copy $1 to $2 in three pieces, pausing before each
+	local third=$(( $(stat -c %s "$1") / 3 ))
+	{ sleep 1; head -c $third "$1"; sleep 1; tail -c +$(( third + 1 )) "$1" | head -c $third; sleep 1; tail -c +$(( 2*third + 1 )) "$1"; } > "$2"
+}
+slow_copy test/htsnexus_test_NA12878.bam "${FOLLOWFN}.bam" &
+indexer/htsnexus_index_bam --reference GRCh37 --follow $! "$FOLLOWDBFN" htsnexus_test NA12878 "${FOLLOWFN}.bam" "https://dl.dnanex.us/F/D/pjZ1Z8fpYzKj5Z8v3qXzVfffV1XzkXk4Kg4KzGBY/htsnexus_test_NA12878.bam"
+is "$?" "0" "index BAM while it's being written"
+is "$(sqlite3 "$FOLLOWDBFN" "$bam_blocks_sql")" "$(sqlite3 "$DBFN" "$bam_blocks_sql")" "index BAM while it's being written - same block index"
+is "$(sqlite3 "$FOLLOWDBFN" "select file_size from htsfiles where _dbid = 'htsnexus_test:NA12878:bam'")" "$(stat -c %s test/htsnexus_test_NA12878.bam)" "index BAM while it's being written - file size"
+slow_copy test/htsnexus_test_NA12878.cram "${FOLLOWFN}.cram" &
+indexer/htsnexus_index_cram --reference GRCh37 --follow $! "$FOLLOWDBFN" htsnexus_test NA12878 "${FOLLOWFN}.cram" "https://dl.dnanex.us/F/D/fkx3bPPfXP8F0z61bfGJ8JkjZ05fBpyyyZy8jf1Z/htsnexus_test_NA12878.cram"
+cram_blocks_sql="select byteLo, byteHi, tid, seqLo, seqHi from htsfiles_blocks join htsfiles using (file_id) where _dbid = 'htsnexus_test:NA12878:cram' order by byteLo, tid"
+is "$(sqlite3 "$FOLLOWDBFN" "$cram_blocks_sql")" "$(sqlite3 "$DBFN" "$cram_blocks_sql")" "index CRAM while it's being written - same block index"
+
+# index verification against the local files
+indexer/htsnexus_verify --regions 50 --region-size 5000000 "$DBFN" htsnexus_test NA12878 test/htsnexus_test_NA12878.bam > /dev/null
+is "$?" "0" "verify BAM index"
+indexer/htsnexus_verify --format cram --regions 50 --region-size 5000000 "$DBFN" htsnexus_test NA12878 test/htsnexus_test_NA12878.cram > /dev/null
+is "$?" "0" "verify CRAM index"
+indexer/htsnexus_verify --format cram --regions 50 --region-size 5000000 "$SLICEDBFN" htsnexus_test NA12878 test/htsnexus_test_NA12878.cram > /dev/null
+is "$?" "0" "verify CRAM slice index"
+indexer/htsnexus_verify --format vcf --regions 50 --region-size 5000000 "$DBFN" htsnexus_test 1000genomes "${TMPDIR}/htsnexus_test_1000G.vcf.gz" > /dev/null
+is "$?" "0" "verify VCF index"
+cp "$DBFN" "${DBFN}.broken"
+sqlite3 "${DBFN}.broken" "delete from htsfiles_blocks where rowid % 2 = 0"
+indexer/htsnexus_verify --regions 50 --region-size 5000000 "${DBFN}.broken" htsnexus_test NA12878 test/htsnexus_test_NA12878.bam > /dev/null 2>&1
+isnt "$?" "0" "verify BAM index - detect missing blocks"
+
+# re-blocking a BAM file
+REBLOCKEDFN="${TMPDIR}/htsnexus_integration_test_reblocked.bam"
+REBLOCKEDDBFN="${TMPDIR}/htsnexus_integration_test_reblocked.db"
+rm -f "$REBLOCKEDDBFN"
+indexer/bgzip_records --block-size 16384 --level 6 --threads 2 < test/htsnexus_test_NA12878.bam > "$REBLOCKEDFN"
+is "$($samtools view -h "$REBLOCKEDFN" | md5sum)" "$($samtools view -h test/htsnexus_test_NA12878.bam | md5sum)" "re-block BAM - same records"
+indexer/htsnexus_index_bam --reference GRCh37 "$REBLOCKEDDBFN" htsnexus_test NA12878 "$REBLOCKEDFN" "https://dl.dnanex.us/F/D/pjZ1Z8fpYzKj5Z8v3qXzVfffV1XzkXk4Kg4KzGBY/htsnexus_test_NA12878.bam"
+is "$?" "0" "index re-blocked BAM"
+is "$(sqlite3 "$REBLOCKEDDBFN" "select count(*) from (select byteLo from htsfiles_blocks group by byteLo having count(*) > 1)")" "0" "re-block BAM - one sequence per block"
+indexer/htsnexus_verify --regions 50 --region-size 5000000 "$REBLOCKEDDBFN" htsnexus_test NA12878 "$REBLOCKEDFN" > /dev/null
+is "$?" "0" "verify re-blocked BAM index"
+
+# re-blocking a BCF file (converted from the test VCF)
+BCFFN="${TMPDIR}/htsnexus_integration_test.bcf"
+REBLOCKEDBCFFN="${TMPDIR}/htsnexus_integration_test_reblocked.bcf"
+$bcftools view --no-version -O b -o "$BCFFN" test/htsnexus_test_1000G.vcf.gz
+is "$?" "0" "convert VCF to BCF"
+indexer/bgzip_records --block-size 16384 --threads 2 < "$BCFFN" > "$REBLOCKEDBCFFN"
+is "$?" "0" "re-block BCF"
+is "$($bcftools view --no-version "$REBLOCKEDBCFFN" | md5sum)" "$($bcftools view --no-version "$BCFFN" | md5sum)" "re-block BCF - same records"
+is "$(python3 test/bcf_blocks.py "$REBLOCKEDBCFFN" 2>&1)" "0" "re-block BCF - one sequence per block"
+
+# compression levels for bgzip_lines and the BGZF header fragments
+LEVELDBFN="${TMPDIR}/htsnexus_integration_test_level.db"
+rm -f "$LEVELDBFN"
+gunzip -dc test/htsnexus_test_1000G.vcf.gz | indexer/bgzip_lines --level 1 > "${TMPDIR}/htsnexus_test_1000G_level1.vcf.gz"
+gunzip -dc test/htsnexus_test_1000G.vcf.gz | indexer/bgzip_lines --level 9 > "${TMPDIR}/htsnexus_test_1000G_level9.vcf.gz"
+is "$(gzip -dc "${TMPDIR}/htsnexus_test_1000G_level9.vcf.gz" | md5sum)" "$(gzip -dc test/htsnexus_test_1000G.vcf.gz | md5sum)" "bgzip_lines --level 9 - same lines"
+is "$(( $(stat -c %s "${TMPDIR}/htsnexus_test_1000G_level9.vcf.gz") < $(stat -c %s "${TMPDIR}/htsnexus_test_1000G_level1.vcf.gz") ))" "1" "bgzip_lines --level 9 - smaller than --level 1"
+indexer/bgzip_lines --level 13 < /dev/null > /dev/null
+isnt "$?" "0" "bgzip_lines - reject invalid level"
+indexer/htsnexus_index_vcf --reference GRCh37 --level 9 "$LEVELDBFN" htsnexus_test 1000genomes "${TMPDIR}/htsnexus_test_1000G_level9.vcf.gz" "https://dl.dnanex.us/F/D/fQVjxXPJPbK76QBB8jzvG3F6PBqbj0YY8q277qXK/htsnexus_test_1000G.vcf.gz" \
+    && indexer/htsnexus_verify --format vcf --regions 50 --region-size 5000000 "$LEVELDBFN" htsnexus_test 1000genomes "${TMPDIR}/htsnexus_test_1000G_level9.vcf.gz" > /dev/null
+is "$?" "0" "index and verify VCF with header --level 9"
+indexer/htsnexus_index_bam --reference GRCh37 --level 0 "$LEVELDBFN" htsnexus_test NA12878 test/htsnexus_test_NA12878.bam "https://dl.dnanex.us/F/D/pjZ1Z8fpYzKj5Z8v3qXzVfffV1XzkXk4Kg4KzGBY/htsnexus_test_NA12878.bam" \
+    && indexer/htsnexus_verify --regions 50 --region-size 5000000 "$LEVELDBFN" htsnexus_test NA12878 test/htsnexus_test_NA12878.bam > /dev/null
+is "$?" "0" "index and verify BAM with uncompressed header (--level 0)"
+
+# read-optimized snapshot export
+SNAPSHOTFN="${TMPDIR}/htsnexus_integration_test_snapshot.db"
+rm -f "$SNAPSHOTFN" "${SNAPSHOTFN}.gz"
+indexer/src/htsnexus_export_snapshot.sh "$DBFN" "$SNAPSHOTFN"
+is "$?" "0" "export snapshot"
+is "$(sqlite3 "$SNAPSHOTFN" "pragma page_size; select count(*) from sqlite_master where name = 'htsfiles_blocks' and sql like '%without rowid'; select count(*) > 0 from sqlite_stat1")" \
+   "$(printf "65536\n1\n1")" \
+   "export snapshot - page size, WITHOUT ROWID blocks, statistics"
+is "$(stat -c %A "$SNAPSHOTFN" | tr -d -c w)" "" "export snapshot - read-only"
+printf "11\t5005000\t5006000\n20\t6000000\t6001000\n20\t6000500\t6002000\n" > "${TMPDIR}/htsnexus_integration_test.bed"
+is "$(indexer/htsnexus_query "$SNAPSHOTFN" htsnexus_test NA12878 "${TMPDIR}/htsnexus_integration_test.bed")" \
+   "$(indexer/htsnexus_query "$DBFN" htsnexus_test NA12878 "${TMPDIR}/htsnexus_integration_test.bed")" \
+   "export snapshot - same batch query results"
+indexer/htsnexus_verify --format vcf --regions 50 --region-size 5000000 "$SNAPSHOTFN" htsnexus_test 1000genomes "${TMPDIR}/htsnexus_test_1000G.vcf.gz" > /dev/null
+is "$?" "0" "export snapshot - verify VCF index"
+indexer/src/htsnexus_export_snapshot.sh --gzip --page-size 4096 "$DBFN" "${SNAPSHOTFN}.gz"
+is "$(gzip -dc "${SNAPSHOTFN}.gz" > "${SNAPSHOTFN}.4k" && sqlite3 "${SNAPSHOTFN}.4k" "pragma page_size; pragma integrity_check")" \
+   "$(printf "4096\nok")" \
+   "export gzipped snapshot"
+is "$(stat -c %A "${SNAPSHOTFN}.gz" | tr -d -c w)" "" "export gzipped snapshot - read-only"
+rm -f "${SNAPSHOTFN}.4k"
+
+# per-sequence block summaries: the native server's tickets should be the same
+# without them
+bam_summary_sql="select count(*), sum(blocks) from htsfiles_blocks_summary join htsfiles using (file_id) where _dbid = 'htsnexus_test:NA12878:bam'"
+is "$(sqlite3 "$DBFN" "$bam_summary_sql")" \
+   "$(sqlite3 "$DBFN" "select (select count(*) + 1 from htsfiles_seqs join htsfiles using (file_id) where _dbid = 'htsnexus_test:NA12878:bam'), \
+                              (select count(*) from htsfiles_blocks join htsfiles using (file_id) where _dbid = 'htsnexus_test:NA12878:bam')")" \
+   "block summaries - every sequence, all blocks"
+is "$(sqlite3 "$DBFN" "select count(*) from htsfiles_blocks_summary where tid >= 0 and blocks > 0 and (occupancy is null or bin_size is null)")" "0" "block summaries - occupancy bitmaps"
+cp "$DBFN" "${DBFN}.nosummary"
+sqlite3 "${DBFN}.nosummary" "drop table htsfiles_blocks_summary"
+indexer/htsnexus_serve --port 48449 --threads 1 "${DBFN}.nosummary" &
+serve_pids="$serve_pids $!"
+sleep 1
+for range in 20 20:6000000-6001000 11:1-1000; do
+    is "$(client/htsnexus.py -s http://localhost:48445/v1/reads -r "$range" htsnexus_test NA12878 | md5sum)" \
+       "$(client/htsnexus.py -s http://localhost:48449/v1/reads -r "$range" htsnexus_test NA12878 | md5sum)" \
+       "block summaries - same BAM slice $range"
+done
+
+# parallel fetch client, against a local HTTP server for the data files
+FETCHDBFN="${TMPDIR}/htsnexus_integration_test_fetch.db"
+rm -f "$FETCHDBFN"
+test/range_http_server.py 48447 test &
+serve_pids="$serve_pids $!"
+indexer/htsnexus_index_bam --reference GRCh37 --chunk-size 262144 "$FETCHDBFN" htsnexus_test NA12878 test/htsnexus_test_NA12878.bam http://localhost:48447/htsnexus_test_NA12878.bam
+indexer/htsnexus_index_cram --reference GRCh37 --chunk-size 262144 "$FETCHDBFN" htsnexus_test NA12878 test/htsnexus_test_NA12878.cram http://localhost:48447/htsnexus_test_NA12878.cram
+indexer/htsnexus_serve --port 48448 --threads 2 "$FETCHDBFN" &
+serve_pids="$serve_pids $!"
+sleep 1
+
+indexer/htsnexus_fetch --server http://localhost:48448/v1/reads --validate --part-size 65536 htsnexus_test NA12878 | cmp - test/htsnexus_test_NA12878.bam
+is "$?" "0" "fetch entire BAM in parallel"
+is "$(indexer/htsnexus_fetch --server http://localhost:48448/v1/reads --validate --part-size 65536 -r 20 htsnexus_test NA12878 | md5sum)" \
+   "$(client/htsnexus.py -s http://localhost:48448/v1/reads -r 20 htsnexus_test NA12878 | md5sum)" \
+   "fetch BAM chromosome slice in parallel"
+is "$(indexer/htsnexus_fetch --server http://localhost:48448/v1/reads --validate --connections 3 -r 20 htsnexus_test NA12878 cram | md5sum)" \
+   "$(client/htsnexus.py -s http://localhost:48448/v1/reads -r 20 htsnexus_test NA12878 cram | md5sum)" \
+   "fetch CRAM chromosome slice in parallel"
+output=$(indexer/htsnexus_fetch --server http://localhost:48448/v1/reads --validate --part-size 65536 -r 11:5005000-5006000 htsnexus_test NA12878 | $samtools view -c - 11:5005000-5006000)
+is "$output" "32" "fetch BAM range slice in parallel - exact record count"
+indexer/htsnexus_fetch --server http://localhost:48448/v1/reads htsnexus_test NA12879 > /dev/null 2>&1
+isnt "$?" "0" "fetch nonexistent accession"
@@ -0,0 +1,38 @@
+#!/usr/bin/env python3
+# Minimal static file server supporting single HTTP byte ranges, used by the
+# integration tests to serve the test data files locally, to several
+# concurrent connections (as from htsnexus_fetch).
+# Usage: range_http_server.py <port> <directory>
+import http.server, os, re, sys
+
+class RangeRequestHandler(http.server.SimpleHTTPRequestHandler):
+    def do_GET(self):
+        path = self.translate_path(self.path.split('?')[0])
+        if not os.path.isfile(path):
+            self.send_error(404)
+            return
+        with open(path, 'rb') as f:
+            data = f.read()
+        m = re.match(r'bytes=(\d+)-(\d*)$', self.headers.get('Range', ''))
+        if m:
+            lo = int(m.group(1))
+            hi = int(m.group(2)) if m.group(2) else len(data) - 1
+            if lo >= len(data) or hi < lo:
+                self.send_error(416)
+                return
+            hi = min(hi, len(data) - 1)
+            self.send_response(206)
+            self.send_header('Content-Range', 'bytes %d-%d/%d' % (lo, hi, len(data)))
+            data = data[lo:hi+1]
+        else:
+            self.send_response(200)
+        self.send_header('Accept-Ranges', 'bytes')
+        self.send_header('Content-Length', str(len(data)))
+        self.end_headers()
+        self.wfile.write(data)
+
+    def log_message(self, *args):
+        pass
+
+os.chdir(sys.argv[2])
+http.server.ThreadingHTTPServer(('localhost', int(sys.argv[1])), RangeRequestHandler).serve_forever()